@@ -0,0 +1,130 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends large payloads from one UNIX domain client to another through the server, once
+// streamed through the socket as a chunked message and once as a memfd attachment. In
+// both cases the timing covers getting the bytes out of the sender's buffer and the
+// receiver reading every one of them.
+
+enum class Path { STREAM, ATTACHMENT };
+
+struct Result
+{
+    int delivered;
+    double seconds;
+};
+
+Result Run(std::string_view path_name, const std::vector<uint8_t>& payload, Path path,
+    int messages)
+{
+    bux::Server server({
+        .high_watermark = 1024 * 1024 * 512,
+        .max_message_size = 1024 * 1024 * 256
+    });
+    if (server.UnixServer(path_name).is_error()) {
+        fmt::print("Failed to start server\n");
+        return { 0, 0 };
+    }
+
+    bux::Client source({ .teamname = "source" });
+    bux::Client sink({ .teamname = "sink" });
+
+    // The sum keeps the reads from being optimised away
+    std::atomic<int> received = 0;
+    std::atomic<uint64_t> checksum = 0;
+    uint64_t partial = 0;
+    sink.AddChunkHandler("payload", [&] (bux::Client&, const bux::Message&,
+        const bux::Chunk& chunk) {
+        partial = std::accumulate(chunk.data.begin(), chunk.data.end(), partial);
+        if (chunk.last) {
+            checksum += std::exchange(partial, 0);
+            ++received;
+        }
+    });
+    sink.AddHandler("payload", [&] (bux::Client&, const bux::Message& m) {
+        std::span<const uint8_t> data = m.attachment->Data();
+        checksum += std::accumulate(data.begin(), data.end(), uint64_t { 0 });
+        ++received;
+    });
+
+    if (source.UnixConnect(path_name).is_error() || sink.UnixConnect(path_name).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return { 0, 0 };
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message message { .type = "payload", .dest = "sink" };
+    auto start = bench::Clock::now();
+
+    bool complete = true;
+    for (int i = 0; i < messages && complete; ++i) {
+        if (path == Path::STREAM) {
+            auto stream_id = source.StartChunked(message);
+            if (stream_id.is_ok())
+                source.WriteChunk(stream_id.get_mut_unchecked(), payload, true).ignore_error();
+        } else {
+            bux::Attachment::Create(payload).if_ok_mut([&] (bux::SharedAttachment& a) {
+                message.attachment = std::move(a);
+                source.Write(message).ignore_error();
+            });
+        }
+        complete = bench::WaitFor([&received, i] { return received == i + 1; }, 30s);
+    }
+
+    Result result { received, bench::SecondsSince(start) };
+    server.Close();
+
+    return result;
+}
+
+int main()
+{
+    constexpr std::string_view UNIX_FILE = "_unix_bux_bench_attachment";
+    constexpr size_t MB = 1024 * 1024;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    if (!bux::Attachment::Supported()) {
+        fmt::print("Attachments are not supported on this platform\n");
+        return 0;
+    }
+
+    bool complete = true;
+    for (size_t size : { MB, 16 * MB, 128 * MB }) {
+        std::vector<uint8_t> payload(size);
+        for (size_t i = 0; i < size; ++i) payload[i] = i * 31 + (i >> 16);
+
+        // Roughly the same number of bytes for every size
+        int messages = std::max<size_t>(4, 256 * MB / size / 2);
+
+        for (Path path : { Path::STREAM, Path::ATTACHMENT }) {
+            Result result = Run(UNIX_FILE, payload, path, messages);
+            complete = complete && result.delivered == messages;
+
+            fmt::print("{:>4} MB {:>10}: {} of {} delivered, {:8.1f} MB/s, "
+                "{:8.2f} ms per message\n", size / MB,
+                path == Path::STREAM ? "stream" : "attachment", result.delivered, messages,
+                result.delivered * size / result.seconds / 1e6,
+                result.seconds * 1e3 / std::max(result.delivered, 1));
+        }
+    }
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends only_first messages from one INTERNAL client to a team of INTERNAL workers that
+// are each unavailable for N other message types, and reports the time per message.
+// Checking a member's availability should cost the same however many types it has
+// turned down.
+
+namespace
+{
+
+constexpr int WORKERS = 32;
+constexpr int MESSAGES = 200000;
+
+bool Measure(int unavailable_types)
+{
+    bux::Server server({ .dispatch = bux::Dispatch::ROUND_ROBIN });
+    if (server.InternalServer().is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> received = 0;
+    std::vector<std::unique_ptr<bux::Client>> workers;
+    for (int i = 0; i < WORKERS; ++i) {
+        auto& worker = workers.emplace_back(std::make_unique<bux::Client>(
+            bux::ClientPreferences { .teamname = "workers" }));
+        worker->AddHandler("job", [&received] (bux::Client&, const bux::Message&) {
+            ++received;
+        });
+        if (worker->InternalConnect(server).is_error()) {
+            fmt::print("Failed to connect worker\n");
+            return false;
+        }
+        for (int type = 0; type < unavailable_types; ++type)
+            worker->SetAvailable(fmt::format("other-{}", type), false).ignore_error();
+    }
+
+    bux::Client producer({ .teamname = "producer" });
+    if (producer.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect producer\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message job { .type = "job", .dest = "workers", .only_first = true };
+    auto start = bench::Clock::now();
+    for (int i = 0; i < MESSAGES; ++i) producer.Write(job).ignore_error();
+
+    bool complete = bench::WaitFor([&received] { return received == MESSAGES; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    if (complete) {
+        fmt::print("{:>5} unavailable types per worker: {:>7.3f} us per message\n",
+            unavailable_types, elapsed * 1e6 / MESSAGES);
+    } else {
+        fmt::print("{:>5} unavailable types per worker: only {} of {} messages arrived\n",
+            unavailable_types, received.load(), MESSAGES);
+    }
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (int types : { 0, 10, 100, 1000 }) complete = Measure(types) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends small messages from one UNIX client to another with WriteBatch(), in batches of
+// 1, 16 and 256, and reports how many arrive per second. Larger batches take fewer
+// frames and fewer passes of the server's loop for the same messages.
+
+namespace
+{
+
+constexpr int MESSAGES = 256000;
+
+bool Measure(int batch_size)
+{
+    std::string path = fmt::format("_bench_batch_{}", batch_size);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 256 });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> received = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+
+    bux::Client producer({ .teamname = "producer" });
+    if (sink.UnixConnect(path).is_error() || producer.UnixConnect(path).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    std::vector<bux::Message> batch(batch_size, {
+        .type = "tick", .dest = "sink", .content = 42
+    });
+    auto start = bench::Clock::now();
+    for (int i = 0; i < MESSAGES / batch_size; ++i)
+        producer.WriteBatch(batch).ignore_error();
+
+    bool complete = bench::WaitFor([&received] { return received == MESSAGES; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("Batches of {:>3}: {:>9.0f} messages/s{}\n", batch_size,
+        received / elapsed, complete ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (int batch_size : { 1, 16, 256 }) complete = Measure(batch_size) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Has 1 to 8 threads write small messages through one UNIX client at once, with and
+// without a write delay, and reports how many reach an INTERNAL sink per second. The
+// writers only queue their messages; the client's listening thread sends them.
+
+namespace
+{
+
+constexpr int MESSAGES = 200000;
+
+bool Measure(int threads, std::chrono::microseconds delay)
+{
+    std::string path = fmt::format("_bench_client_writers_{}", threads);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 256 });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> received = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+
+    bux::Client producer({ .teamname = "producer", .write_delay = delay });
+    if (sink.InternalConnect(server).is_error()
+        || producer.UnixConnect(path).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message tick { .type = "tick", .dest = "sink", .content = 42 };
+    auto start = bench::Clock::now();
+
+    std::vector<std::thread> writers;
+    for (int i = 0; i < threads; ++i) {
+        writers.emplace_back([&producer, &tick, threads] {
+            for (int n = 0; n < MESSAGES / threads; ++n)
+                producer.Write(tick).ignore_error();
+        });
+    }
+    for (std::thread& writer : writers) writer.join();
+    double writing = bench::SecondsSince(start);
+
+    int expected = MESSAGES / threads * threads;
+    bool complete = bench::WaitFor([&] { return received == expected; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("{} writer(s), {:>3} us delay: {:>9.0f} writes/s, {:>9.0f} delivered/s"
+        "{}\n", threads, delay.count(), expected / writing, received / elapsed,
+        complete ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    using namespace std::chrono_literals;
+
+    bool complete = true;
+    for (auto delay : { 0us, 100us }) {
+        for (int threads : { 1, 2, 4, 8 })
+            complete = Measure(threads, delay) && complete;
+    }
+
+    return complete ? 0 : 1;
+}
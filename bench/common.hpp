@@ -0,0 +1,123 @@
+#pragma once
+
+#include <buxtehude/buxtehude.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace bench
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Counts of read(2)- and write(2)-family system calls made so far by every thread of
+// this process. Only available on Linux (/proc/self/io), zero elsewhere.
+struct SyscallCounts
+{
+    uint64_t reads = 0, writes = 0;
+};
+
+inline SyscallCounts GetSyscallCounts()
+{
+    SyscallCounts counts;
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:") counts.reads = value;
+        else if (key == "syscw:") counts.writes = value;
+    }
+    return counts;
+}
+
+// Resident and virtual memory of this process in bytes. Only available on Linux
+// (/proc/self/statm), zero elsewhere.
+struct MemoryUsage
+{
+    uint64_t resident = 0, virtual_size = 0;
+};
+
+inline MemoryUsage GetMemoryUsage()
+{
+    MemoryUsage usage;
+    std::ifstream statm("/proc/self/statm");
+    uint64_t pages_virtual = 0, pages_resident = 0;
+    if (statm >> pages_virtual >> pages_resident) {
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        usage.virtual_size = pages_virtual * page_size;
+        usage.resident = pages_resident * page_size;
+    }
+    return usage;
+}
+
+inline double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// A complete JSON frame of `message`, for benchmarks that drive the server over raw
+// sockets
+inline std::string JsonFrame(const buxtehude::Message& message)
+{
+    std::string serialised = buxtehude::json(message).dump();
+
+    std::string frame(buxtehude::FRAME_HEADER_SIZE, '\0');
+    frame[0] = static_cast<char>(buxtehude::MessageFormat::JSON);
+    uint32_t length = serialised.size();
+    memcpy(frame.data() + sizeof(buxtehude::MessageFormat), &length, sizeof(length));
+
+    return frame + serialised;
+}
+
+// A complete $$handshake frame
+inline std::string HandshakeFrame(std::string_view teamname,
+    buxtehude::MessageFormat format = buxtehude::MessageFormat::JSON)
+{
+    return JsonFrame({
+        .type = std::string { buxtehude::MSG_HANDSHAKE },
+        .content = {
+            { "format", format },
+            { "teamname", teamname },
+            { "version", buxtehude::CURRENT_VERSION }
+        }
+    });
+}
+
+// Connects a raw UNIX socket to the server at `path` and sends it `frame`. Returns
+// the descriptor, or -1 on failure.
+inline int ConnectRaw(std::string_view path, std::string_view frame)
+{
+    sockaddr_un addr { .sun_family = AF_LOCAL };
+    memcpy(addr.sun_path, path.data(), std::min(path.size(), sizeof(addr.sun_path) - 1));
+
+    int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+        || write(fd, frame.data(), frame.size()) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+template<typename Predicate>
+bool WaitFor(Predicate&& done, std::chrono::milliseconds timeout)
+{
+    auto deadline = Clock::now() + timeout;
+    while (!done()) {
+        if (Clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
+}
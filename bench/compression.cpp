@@ -0,0 +1,125 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends large messages from one internet domain client to another through the server,
+// with and without zstd frame compression, and reports throughput and the bytes sent
+// over the socket per message. One payload is repetitive structured JSON, the other is
+// random bytes that do not compress at all.
+
+struct Result
+{
+    int delivered;
+    double seconds;
+};
+
+Result Run(uint16_t port, const bux::json& content, bux::Compression compression,
+    int messages)
+{
+    constexpr int BURST = 16;
+
+    bux::Server server({
+        .high_watermark = 1024 * 1024 * 256,
+        .compression = compression
+    });
+    if (server.IPServer(port).is_error()) {
+        fmt::print("Failed to start server\n");
+        return { 0, 0 };
+    }
+
+    bux::Client source({ .teamname = "source", .compression = compression });
+    bux::Client sink({ .teamname = "sink", .compression = compression });
+
+    std::atomic<int> received = 0;
+    sink.AddHandler("payload", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+
+    if (source.IPConnect("localhost", port).is_error()
+        || sink.IPConnect("localhost", port).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return { 0, 0 };
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message message { .type = "payload", .dest = "sink", .content = content };
+    auto start = bench::Clock::now();
+
+    bool complete = true;
+    for (int i = 0; i < messages && complete; i += BURST) {
+        for (int j = i; j < i + BURST; ++j) source.Write(message).ignore_error();
+        complete = bench::WaitFor([&received, i] { return received == i + BURST; }, 10s);
+    }
+
+    Result result { received, bench::SecondsSince(start) };
+    server.Close();
+
+    return result;
+}
+
+int main()
+{
+    constexpr uint16_t PORT = 16390;
+    constexpr int MESSAGES = 480;
+    constexpr size_t PAYLOAD_SIZE = 1024 * 200;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::json records = bux::json::array();
+    for (int i = 0; bux::json(records).dump().size() < PAYLOAD_SIZE; ++i) {
+        records.push_back({
+            { "id", i }, { "work", fmt::format("BuxWV {}", i % 300) },
+            { "key", i % 2 ? "D minor" : "E minor" }, { "instrument", "organ" }
+        });
+    }
+
+    std::mt19937 rng(1637);
+    std::vector<uint8_t> noise(PAYLOAD_SIZE);
+    for (uint8_t& byte : noise) byte = rng();
+
+    struct Payload { std::string_view name; bux::json content; };
+    const Payload payloads[] = {
+        { "compressible", records },
+        { "incompressible", bux::json::binary(noise) }
+    };
+
+    uint16_t port = PORT;
+    bool complete = true;
+    for (const Payload& payload : payloads) {
+        bux::Message sample { .type = "payload", .dest = "sink", .content = payload.content };
+        bux::SharedFrame frame = bux::EncodedFrame::Encode(bux::MessageFormat::MSGPACK,
+            sample);
+        size_t compressed_size = bux::EncodedFrame::Compress(frame,
+            bux::DEFAULT_COMPRESSION_THRESHOLD)->Size();
+
+        for (bux::Compression compression : { bux::Compression::NONE, bux::Compression::ZSTD }) {
+            Result result = Run(port++, payload.content, compression, MESSAGES);
+            complete = complete && result.delivered == MESSAGES;
+
+            size_t wire_size = compression == bux::Compression::NONE ? frame->Size()
+                                                                     : compressed_size;
+            fmt::print("{:>14} {:>4}: {} of {} delivered, {:7.1f} MB/s of messages, "
+                "{:6.0f} msg/s, {:6} bytes per message on the socket\n",
+                payload.name, compression == bux::Compression::NONE ? "none" : "zstd",
+                result.delivered, MESSAGES,
+                result.delivered * frame->Size() / result.seconds / 1e6,
+                result.delivered / result.seconds, wire_size);
+        }
+    }
+
+    return complete ? 0 : 1;
+}
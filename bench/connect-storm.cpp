@@ -0,0 +1,190 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Opens 10k internet domain connections to a server all at once and reports how long
+// each of them took to be greeted with the server's handshake. The clients live in a
+// child process, which starts every connection before it waits for any of them.
+
+namespace
+{
+
+constexpr int CLIENTS = 10000;
+constexpr uint16_t FIRST_PORT = 16370;
+
+struct Connection
+{
+    int fd;
+    bench::Clock::time_point start;
+    std::string received;
+    bool handshake_sent = false;
+};
+
+// Microseconds until the server's greeting arrived, for every connection
+std::vector<double> Storm(uint16_t port)
+{
+    std::string handshake = bench::HandshakeFrame("storm");
+
+    sockaddr_in addr { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    std::vector<Connection> connections;
+    std::vector<pollfd> fds;
+    for (int i = 0; i < CLIENTS; ++i) {
+        int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) _exit(1);
+        auto start = bench::Clock::now();
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+            && errno != EINPROGRESS) {
+            _exit(1);
+        }
+        connections.push_back({ .fd = fd, .start = start });
+        fds.push_back({ .fd = fd, .events = POLLIN | POLLOUT });
+    }
+
+    std::vector<double> latencies;
+    char buffer[4096];
+    size_t waiting = CLIENTS;
+    while (waiting > 0) {
+        if (poll(fds.data(), fds.size(), 10000) <= 0) _exit(1);
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            Connection& connection = connections[i];
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            if (fds[i].revents & (POLLERR | POLLHUP)) _exit(1);
+
+            if ((fds[i].revents & POLLOUT) && !connection.handshake_sent) {
+                if (write(connection.fd, handshake.data(), handshake.size()) < 0)
+                    _exit(1);
+                connection.handshake_sent = true;
+                fds[i].events = POLLIN;
+            }
+
+            if (!(fds[i].revents & POLLIN)) continue;
+            ssize_t n = read(connection.fd, buffer, sizeof(buffer));
+            if (n <= 0) _exit(1);
+            connection.received.append(buffer, n);
+
+            if (connection.received.size() < bux::FRAME_HEADER_SIZE) continue;
+            uint32_t length;
+            memcpy(&length, connection.received.data() + sizeof(bux::MessageFormat),
+                sizeof(length));
+            if (connection.received.size() < bux::FRAME_HEADER_SIZE + length) continue;
+
+            latencies.push_back(std::chrono::duration<double, std::micro>(
+                bench::Clock::now() - connection.start).count());
+            // Stays open, but is no longer polled
+            fds[i].fd = -1;
+            --waiting;
+        }
+    }
+
+    return latencies;
+}
+
+void Run(uint16_t port, int result_pipe, int done_pipe)
+{
+    std::vector<double> latencies = Storm(port);
+    if (write(result_pipe, latencies.data(), latencies.size() * sizeof(double)) < 0)
+        _exit(1);
+
+    // Stay connected until the parent is done
+    char byte;
+    if (read(done_pipe, &byte, 1) < 0) _exit(1);
+    _exit(0);
+}
+
+bool Measure(std::string_view name, uint16_t port, const bux::ServerPreferences& prefs)
+{
+    bux::Server server(prefs);
+    if (server.IPServer(port).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    int result[2], done[2];
+    if (pipe(result) || pipe(done)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(result[0]);
+        close(done[1]);
+        Run(port, result[1], done[0]);
+    }
+    close(result[1]);
+    close(done[0]);
+
+    std::vector<double> latencies(CLIENTS);
+    size_t expected = latencies.size() * sizeof(double), received = 0;
+    auto* out = reinterpret_cast<char*>(latencies.data());
+    while (received < expected) {
+        ssize_t n = read(result[0], out + received, expected - received);
+        if (n <= 0) break;
+        received += n;
+    }
+
+    bool complete = received == expected;
+    if (complete) {
+        std::ranges::sort(latencies);
+        auto percentile = [&latencies] (double p) {
+            return latencies[std::min(latencies.size() - 1, size_t(latencies.size() * p))]
+                / 1000;
+        };
+        fmt::print("{:<28} p50 {:>8.2f} ms, p99 {:>8.2f} ms, max {:>8.2f} ms\n", name,
+            percentile(0.5), percentile(0.99), latencies.back() / 1000);
+    } else {
+        fmt::print("{:<28} client process failed\n", name);
+    }
+
+    server.Close();
+    close(done[1]);
+    waitpid(child, nullptr, 0);
+    close(result[0]);
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    fmt::print("{} simultaneous connections, time to the server's handshake\n", CLIENTS);
+
+    // A new port for each, so that no connection from the last one is still around
+    bool complete = true;
+    complete = Measure("1 reactor", FIRST_PORT, {}) && complete;
+    complete = Measure("4 reactors, one listener", FIRST_PORT + 1, {
+        .reactor_threads = 4, .shard_ip_listeners = false
+    }) && complete;
+    complete = Measure("4 reactors, sharded", FIRST_PORT + 2, {
+        .reactor_threads = 4
+    }) && complete;
+
+    return complete ? 0 : 1;
+}
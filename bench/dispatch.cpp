@@ -0,0 +1,112 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends only_first messages to a team of UNIX workers with each Dispatch strategy and
+// reports how many each worker got. Workers have capacities 1, 1, 2, 2, 4, 4, 8 and 8,
+// which only Dispatch::WEIGHTED takes into account.
+
+namespace
+{
+
+constexpr int WORKERS = 8;
+constexpr int MESSAGES = 40000;
+constexpr uint32_t CAPACITIES[WORKERS] = { 1, 1, 2, 2, 4, 4, 8, 8 };
+
+bool Measure(std::string_view name, bux::Dispatch dispatch)
+{
+    std::string path = fmt::format("_bench_dispatch_{}", name);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 64, .dispatch = dispatch });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    struct Worker
+    {
+        std::unique_ptr<bux::Client> client;
+        std::atomic<int> received = 0;
+    };
+
+    std::vector<Worker> workers(WORKERS);
+    std::atomic<int> total = 0;
+    for (int i = 0; i < WORKERS; ++i) {
+        Worker& worker = workers[i];
+        worker.client = std::make_unique<bux::Client>(bux::ClientPreferences {
+            .teamname = "workers", .capacity = CAPACITIES[i]
+        });
+        worker.client->AddHandler("job", [&worker, &total] (bux::Client&,
+            const bux::Message&) {
+            ++worker.received;
+            ++total;
+        });
+        if (worker.client->UnixConnect(path).is_error()) {
+            fmt::print("Failed to connect worker\n");
+            return false;
+        }
+    }
+
+    bux::Client producer({ .teamname = "producer" });
+    if (producer.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect producer\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message job { .type = "job", .dest = "workers", .only_first = true };
+    auto start = bench::Clock::now();
+    for (int i = 0; i < MESSAGES; ++i) producer.Write(job).ignore_error();
+
+    bool complete = bench::WaitFor([&total] { return total == MESSAGES; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    std::string counts;
+    int least = MESSAGES, most = 0;
+    for (Worker& worker : workers) {
+        counts += fmt::format(" {:>6}", worker.received.load());
+        least = std::min(least, worker.received.load());
+        most = std::max(most, worker.received.load());
+    }
+
+    fmt::print("{:<16}{} | max/min {:>7.2f}, {:>8.0f} messages/s{}\n", name, counts,
+        least ? double(most) / least : 0.0, total / elapsed,
+        complete ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    fmt::print("{} only_first messages to {} workers\n", MESSAGES, WORKERS);
+
+    bool complete = true;
+    complete = Measure("first available", bux::Dispatch::FIRST_AVAILABLE) && complete;
+    complete = Measure("round robin", bux::Dispatch::ROUND_ROBIN) && complete;
+    complete = Measure("least loaded", bux::Dispatch::LEAST_LOADED) && complete;
+    complete = Measure("weighted", bux::Dispatch::WEIGHTED) && complete;
+
+    return complete ? 0 : 1;
+}
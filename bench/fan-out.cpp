@@ -0,0 +1,160 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Broadcasts messages with a serialisation-heavy body to N UNIX recipients and
+// reports the user CPU time the process spent per message. The recipients are raw
+// sockets drained by a child process, so the parent's CPU time is the server's routing
+// and encoding plus the INTERNAL producer.
+
+namespace
+{
+
+constexpr int MESSAGES = 100;
+
+void DrainRecipients(std::string_view path, int count, int ready_pipe, int done_pipe)
+{
+    std::string frame = bench::HandshakeFrame("fanout");
+
+    std::vector<pollfd> fds;
+    for (int i = 0; i < count; ++i) {
+        int fd = bench::ConnectRaw(path, frame);
+        if (fd < 0) _exit(1);
+        fds.push_back({ .fd = fd, .events = POLLIN });
+    }
+    fds.push_back({ .fd = done_pipe, .events = POLLIN });
+
+    char byte = 0;
+    if (write(ready_pipe, &byte, 1) < 0) _exit(1);
+
+    static char buffer[1024 * 64];
+    while (poll(fds.data(), fds.size(), -1) > 0) {
+        if (fds.back().revents) _exit(0);
+        for (pollfd& p : fds) {
+            if (p.revents & POLLIN) {
+                if (read(p.fd, buffer, sizeof(buffer)) <= 0) _exit(0);
+            }
+        }
+    }
+    _exit(0);
+}
+
+double UserSeconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+}
+
+void Measure(int recipients, const bux::json& content)
+{
+    std::string path = fmt::format("_bench_fan_out_{}", recipients);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 256 });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        std::exit(1);
+    }
+
+    int ready[2], done[2];
+    if (pipe(ready) || pipe(done)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ready[0]);
+        close(done[1]);
+        DrainRecipients(path, recipients, ready[1], done[0]);
+    }
+    close(ready[1]);
+    close(done[0]);
+
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+        fmt::print("Recipient process failed\n");
+        std::exit(1);
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms + recipients * 1ms);
+
+    bux::Client producer({ .teamname = "producer" });
+    bux::Client probe({ .teamname = "probe" });
+    std::atomic<bool> probed = false;
+    probe.AddHandler("probe", [&probed] (bux::Client&, const bux::Message&) {
+        probed = true;
+    });
+
+    if (producer.InternalConnect(server).is_error() || probe.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect internal clients\n");
+        std::exit(1);
+    }
+
+    double user_before = UserSeconds();
+    auto start = bench::Clock::now();
+
+    for (int i = 0; i < MESSAGES; ++i) {
+        producer.Write({ .type = "update", .dest = "fanout", .content = content })
+            .ignore_error();
+    }
+
+    // Internal messages are routed in order, so the probe arrives after the rest
+    producer.Write({ .type = "probe", .dest = "probe" }).ignore_error();
+    bench::WaitFor([&probed] { return probed.load(); }, 60s);
+    bench::WaitFor([&server] {
+        for (const bux::QueueStats& stats : server.GetQueueStats())
+            if (stats.queued_bytes > 0) return false;
+        return true;
+    }, 60s);
+
+    double user = UserSeconds() - user_before;
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("{:>5} recipients: {:>9.1f} us user CPU per message, {:>7.2f} us per "
+               "delivery, {:.3f}s wall\n", recipients, user * 1e6 / MESSAGES,
+               user * 1e6 / MESSAGES / recipients, elapsed);
+
+    server.Close();
+    close(done[1]);
+    waitpid(child, nullptr, 0);
+    close(ready[0]);
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    bux::json content = bux::json::array();
+    for (int i = 0; i < 100; ++i) {
+        content.push_back({
+            { "id", i }, { "name", fmt::format("item-{}", i) }, { "value", i * 0.5 }
+        });
+    }
+
+    for (int recipients : { 1, 10, 100, 1000 }) Measure(recipients, content);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends messages of 16 types to a UNIX client whose handler spends 20 us of CPU on each,
+// with handler pools of several sizes, and reports how many it handles per second.
+// Handler throughput should grow with the pool, up to the number of cores.
+
+namespace
+{
+
+constexpr int MESSAGES = 40000;
+constexpr int TYPES = 16;
+constexpr auto WORK = std::chrono::microseconds(20);
+
+bool Measure(size_t threads, bux::HandlerOrdering ordering, std::string_view name)
+{
+    std::string path = fmt::format("_bench_handler_pool_{}", threads);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 64 });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> handled = 0;
+    bux::Client worker({
+        .teamname = "worker", .handler_threads = threads, .handler_ordering = ordering
+    });
+    for (int type = 0; type < TYPES; ++type) {
+        worker.AddHandler(fmt::format("job-{}", type), [&handled] (bux::Client&,
+            const bux::Message&) {
+            // Busy rather than asleep, as a handler that does real work would be
+            auto until = bench::Clock::now() + WORK;
+            while (bench::Clock::now() < until) {}
+            ++handled;
+        });
+    }
+
+    bux::Client producer({ .teamname = "producer" });
+    if (worker.UnixConnect(path).is_error()
+        || producer.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    std::vector<bux::Message> jobs;
+    for (int type = 0; type < TYPES; ++type)
+        jobs.push_back({ .type = fmt::format("job-{}", type), .dest = "worker" });
+
+    auto start = bench::Clock::now();
+    for (int i = 0; i < MESSAGES; ++i) producer.Write(jobs[i % TYPES]).ignore_error();
+
+    bool complete = bench::WaitFor([&handled] { return handled == MESSAGES; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("{:>2} handler threads, {:<10}: {:>8.0f} messages/s{}\n", threads, name,
+        handled / elapsed, complete ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (size_t threads : { 0, 1, 2, 4, 8 }) {
+        complete = Measure(threads, bux::HandlerOrdering::NONE, "unordered") && complete;
+        complete = Measure(threads, bux::HandlerOrdering::PER_TYPE, "per type")
+            && complete;
+    }
+
+    return complete ? 0 : 1;
+}
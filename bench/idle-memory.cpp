@@ -0,0 +1,104 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <string>
+#include <string_view>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Opens N idle UNIX connections to a server, each of which only completes the
+// handshake, and reports how much the server process grew per connection. The client
+// ends live in a child process so that only the server's side is measured.
+
+namespace
+{
+
+void ConnectIdleClients(std::string_view path, int count, int ready_pipe, int done_pipe)
+{
+    std::string frame = bench::HandshakeFrame("idle");
+
+    for (int i = 0; i < count; ++i) {
+        if (bench::ConnectRaw(path, frame) < 0) {
+            fmt::print("Connection {} failed: {}\n", i, strerror(errno));
+            _exit(1);
+        }
+    }
+
+    char byte = 0;
+    if (write(ready_pipe, &byte, 1) < 0) _exit(1);
+    if (read(done_pipe, &byte, 1) < 0) _exit(1);
+    _exit(0);
+}
+
+void Measure(int count)
+{
+    std::string path = fmt::format("_bench_idle_memory_{}", count);
+
+    bux::Server server;
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        std::exit(1);
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(100ms);
+    bench::MemoryUsage before = bench::GetMemoryUsage();
+
+    int ready[2], done[2];
+    if (pipe(ready) || pipe(done)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ready[0]);
+        close(done[1]);
+        ConnectIdleClients(path, count, ready[1], done[0]);
+    }
+    close(ready[1]);
+    close(done[0]);
+
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+        fmt::print("Client process failed\n");
+        std::exit(1);
+    }
+
+    // Give the server time to accept every connection and read every handshake
+    std::this_thread::sleep_for(count / 1000 * 500ms + 500ms);
+    bench::MemoryUsage after = bench::GetMemoryUsage();
+
+    fmt::print("{:>6} idle connections: {:>8.1f} KiB RSS, {:>8.1f} KiB virtual per connection\n",
+        count, double(after.resident - before.resident) / 1024 / count,
+        double(after.virtual_size - before.virtual_size) / 1024 / count);
+
+    server.Close();
+    close(done[1]);
+    waitpid(child, nullptr, 0);
+    close(ready[0]);
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    Measure(1000);
+    Measure(10000);
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Has N threads write to one INTERNAL sink through INTERNAL clients of their own, each
+// passing its messages by rvalue, and reports the total throughput. Writers only share
+// an exchange on the server's queue, so adding threads should not make it collapse.
+
+namespace
+{
+
+constexpr int MESSAGES_PER_THREAD = 100000;
+
+bool Measure(int threads)
+{
+    bux::Server server;
+    if (server.InternalServer().is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> received = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+    if (sink.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect sink\n");
+        return false;
+    }
+
+    std::vector<std::unique_ptr<bux::Client>> writers;
+    for (int i = 0; i < threads; ++i) {
+        auto& writer = writers.emplace_back(std::make_unique<bux::Client>(
+            bux::ClientPreferences { .teamname = "writer" }));
+        if (writer->InternalConnect(server).is_error()) {
+            fmt::print("Failed to connect writer\n");
+            return false;
+        }
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(100ms);
+
+    auto start = bench::Clock::now();
+    std::vector<std::thread> running;
+    for (auto& writer : writers) {
+        running.emplace_back([&writer] {
+            for (int i = 0; i < MESSAGES_PER_THREAD; ++i) {
+                writer->Write({
+                    .type = "tick", .dest = "sink", .content = { { "n", i } }
+                }).ignore_error();
+            }
+        });
+    }
+    for (std::thread& thread : running) thread.join();
+
+    int total = threads * MESSAGES_PER_THREAD;
+    bool complete = bench::WaitFor([&] { return received == total; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("{:>3} writer threads: {:>10.0f} messages/s{}\n", threads,
+        received / elapsed, complete ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (int threads : { 1, 2, 4, 8 }) complete = Measure(threads) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Has N raw UNIX connections all send to one INTERNAL sink at once and reports how
+// many messages per second the server routes. The senders live in a child process and
+// write a few frames to every connection in turn, so that most of them are ready
+// whenever the server polls.
+
+namespace
+{
+
+constexpr int MESSAGES = 200000; // In total, whatever the number of senders
+constexpr int FRAMES_PER_WRITE = 4;
+
+void Send(std::string_view path, int count, int ready_pipe, int go_pipe)
+{
+    std::string handshake = bench::HandshakeFrame("sender");
+    std::vector<int> fds;
+    for (int i = 0; i < count; ++i) {
+        int fd = bench::ConnectRaw(path, handshake);
+        if (fd < 0) _exit(1);
+        fds.push_back(fd);
+    }
+
+    std::string frame = bench::JsonFrame({
+        .type = "tick", .dest = "sink", .content = { { "value", 42 } }
+    });
+    std::string batch;
+    for (int i = 0; i < FRAMES_PER_WRITE; ++i) batch += frame;
+
+    char byte = 0;
+    if (write(ready_pipe, &byte, 1) < 0 || read(go_pipe, &byte, 1) != 1) _exit(1);
+
+    for (int sent = 0; sent + FRAMES_PER_WRITE <= MESSAGES / count;
+        sent += FRAMES_PER_WRITE) {
+        for (int fd : fds) {
+            if (write(fd, batch.data(), batch.size()) < 0) _exit(1);
+        }
+    }
+
+    // Stay connected until the parent is done
+    if (read(go_pipe, &byte, 1) < 0) _exit(1);
+    _exit(0);
+}
+
+double CpuSeconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+bool Measure(int senders)
+{
+    std::string path = fmt::format("_bench_many_connections_{}", senders);
+
+    bux::Server server;
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    std::atomic<int> received = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&received] (bux::Client&, const bux::Message&) {
+        received.fetch_add(1, std::memory_order_relaxed);
+    });
+    if (sink.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect sink\n");
+        return false;
+    }
+
+    int ready[2], go[2];
+    if (pipe(ready) || pipe(go)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ready[0]);
+        close(go[1]);
+        Send(path, senders, ready[1], go[0]);
+    }
+    close(ready[1]);
+    close(go[0]);
+
+    char byte = 0;
+    if (read(ready[0], &byte, 1) != 1) {
+        fmt::print("Sender process failed\n");
+        std::exit(1);
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms + senders * 1ms);
+
+    int expected = senders * (MESSAGES / senders / FRAMES_PER_WRITE * FRAMES_PER_WRITE);
+    double cpu_before = CpuSeconds();
+    auto start = bench::Clock::now();
+    if (write(go[1], &byte, 1) != 1) std::exit(1);
+
+    bool complete = bench::WaitFor([&] { return received == expected; }, 120s);
+    double elapsed = bench::SecondsSince(start);
+    double cpu = CpuSeconds() - cpu_before;
+
+    fmt::print("{:>5} senders: {} of {} routed, {:>9.0f} messages/s, {:>6.2f} us CPU "
+        "per message\n", senders, received.load(), expected, received / elapsed,
+        cpu * 1e6 / std::max(received.load(), 1));
+
+    server.Close();
+    close(go[1]);
+    waitpid(child, nullptr, 0);
+    close(ready[0]);
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    bool complete = true;
+    for (int senders : { 1, 10, 100, 1000 }) complete = Measure(senders) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Routes messages between pairs of raw UNIX connections, a sender and a receiver per
+// pair, with 1 to 16 reactor threads. The pairs live in a child process with a thread
+// each. They connect in turn, so round robin puts the sender and receiver of every pair
+// on different reactors: each message is read on one and written on another.
+
+namespace
+{
+
+constexpr int PAIRS = 32;
+constexpr int MESSAGES_PER_PAIR = 20000;
+constexpr int FRAMES_PER_WRITE = 8;
+
+// Counts the frames in what a receiver reads, however the reads split them
+struct FrameCounter
+{
+    void Feed(const char* data, size_t size)
+    {
+        while (size > 0) {
+            if (header_read < bux::FRAME_HEADER_SIZE) {
+                size_t n = std::min(size, bux::FRAME_HEADER_SIZE - header_read);
+                memcpy(header + header_read, data, n);
+                header_read += n;
+                data += n;
+                size -= n;
+                if (header_read == bux::FRAME_HEADER_SIZE) {
+                    memcpy(&remaining, header + sizeof(bux::MessageFormat),
+                        sizeof(remaining));
+                }
+            } else {
+                size_t n = std::min<size_t>(size, remaining);
+                remaining -= n;
+                data += n;
+                size -= n;
+            }
+
+            if (header_read == bux::FRAME_HEADER_SIZE && remaining == 0) {
+                ++frames;
+                header_read = 0;
+            }
+        }
+    }
+
+    char header[bux::FRAME_HEADER_SIZE];
+    size_t header_read = 0;
+    uint32_t remaining = 0;
+    int frames = 0;
+};
+
+void RunPair(int sender, int receiver, const std::string& batch)
+{
+    // The server greets the receiver first
+    int expected = MESSAGES_PER_PAIR + 1;
+    FrameCounter counter;
+    char buffer[1 << 16];
+
+    for (int sent = 0; sent < MESSAGES_PER_PAIR; sent += FRAMES_PER_WRITE) {
+        if (write(sender, batch.data(), batch.size()) < 0) _exit(1);
+        ssize_t n = recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) counter.Feed(buffer, n);
+    }
+
+    while (counter.frames < expected) {
+        ssize_t n = read(receiver, buffer, sizeof(buffer));
+        if (n <= 0) _exit(1);
+        counter.Feed(buffer, n);
+    }
+}
+
+void Run(std::string_view path, int ready_pipe, int go_pipe)
+{
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < PAIRS; ++i) {
+        int sender = bench::ConnectRaw(path,
+            bench::HandshakeFrame(fmt::format("s{}", i)));
+        int receiver = bench::ConnectRaw(path,
+            bench::HandshakeFrame(fmt::format("r{}", i)));
+        if (sender < 0 || receiver < 0) _exit(1);
+        pairs.emplace_back(sender, receiver);
+    }
+
+    // Every receiver has to have joined on every reactor before anything is sent to it
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    char byte = 0;
+    if (write(ready_pipe, &byte, 1) < 0 || read(go_pipe, &byte, 1) != 1) _exit(1);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < PAIRS; ++i) {
+        std::string frame = bench::JsonFrame({
+            .type = "tick", .dest = fmt::format("r{}", i), .content = { { "value", 42 } }
+        });
+        std::string batch;
+        for (int j = 0; j < FRAMES_PER_WRITE; ++j) batch += frame;
+
+        threads.emplace_back(RunPair, pairs[i].first, pairs[i].second, batch);
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    if (write(ready_pipe, &byte, 1) < 0) _exit(1);
+    // Stay connected until the parent is done
+    if (read(go_pipe, &byte, 1) < 0) _exit(1);
+    _exit(0);
+}
+
+bool Measure(size_t threads)
+{
+    std::string path = fmt::format("_bench_reactors_{}", threads);
+
+    bux::Server server({
+        .high_watermark = 1024 * 1024 * 64,
+        .overflow_policy = bux::OverflowPolicy::BLOCK,
+        .reactor_threads = threads
+    });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    int ready[2], go[2];
+    if (pipe(ready) || pipe(go)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ready[0]);
+        close(go[1]);
+        Run(path, ready[1], go[0]);
+    }
+    close(ready[1]);
+    close(go[0]);
+
+    char byte = 0;
+    if (read(ready[0], &byte, 1) != 1) {
+        fmt::print("Pair process failed\n");
+        std::exit(1);
+    }
+
+    auto start = bench::Clock::now();
+    if (write(go[1], &byte, 1) != 1) std::exit(1);
+    bool complete = read(ready[0], &byte, 1) == 1;
+    double elapsed = bench::SecondsSince(start);
+
+    int messages = PAIRS * MESSAGES_PER_PAIR;
+    if (complete) {
+        fmt::print("{:>2} reactor threads: {:>9.0f} messages/s\n", threads,
+            messages / elapsed);
+    } else {
+        fmt::print("{:>2} reactor threads: pair process failed\n", threads);
+    }
+
+    close(go[1]);
+    waitpid(child, nullptr, 0);
+    close(ready[0]);
+    server.Close();
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    fmt::print("{} pairs, {} messages each, {} hardware threads\n", PAIRS,
+        MESSAGES_PER_PAIR, std::thread::hardware_concurrency());
+
+    bool complete = true;
+    for (size_t threads : { 1, 2, 4, 8, 16 }) complete = Measure(threads) && complete;
+
+    return complete ? 0 : 1;
+}
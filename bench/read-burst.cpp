@@ -0,0 +1,74 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <string_view>
+
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends bursts of small messages from one UNIX client to another through the server
+// and reports how many read/write system calls the whole process made per message.
+// Each burst is small enough to fit in the socket and stream buffers.
+
+int main()
+{
+    constexpr std::string_view UNIX_FILE = "_bench_read_burst";
+    constexpr int MESSAGES = 20000;
+    constexpr int BURST = 500;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server;
+    if (server.UnixServer(UNIX_FILE).is_error()) {
+        fmt::print("Failed to start server\n");
+        return 1;
+    }
+
+    bux::Client source({ .teamname = "source" });
+    bux::Client sink({ .teamname = "sink" });
+
+    std::atomic<int> received = 0;
+    sink.AddHandler("burst", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+
+    if (source.UnixConnect(UNIX_FILE).is_error() || sink.UnixConnect(UNIX_FILE).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return 1;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bench::SyscallCounts before = bench::GetSyscallCounts();
+    auto start = bench::Clock::now();
+
+    bool complete = true;
+    for (int i = 0; i < MESSAGES && complete; i += BURST) {
+        for (int j = i; j < i + BURST; ++j) {
+            source.Write({ .type = "burst", .dest = "sink", .content = j }).ignore_error();
+        }
+
+        complete = bench::WaitFor([&received, i] { return received == i + BURST; }, 5s);
+    }
+    double elapsed = bench::SecondsSince(start);
+    bench::SyscallCounts after = bench::GetSyscallCounts();
+
+    fmt::print("{} of {} messages delivered in {:.3f}s ({:.0f} msg/s)\n",
+        received.load(), MESSAGES, elapsed, received / elapsed);
+    fmt::print("read syscalls per message:  {:.3f}\n",
+        double(after.reads - before.reads) / MESSAGES);
+    fmt::print("write syscalls per message: {:.3f}\n",
+        double(after.writes - before.writes) / MESSAGES);
+
+    unlink(UNIX_FILE.data());
+    return complete ? 0 : 1;
+}
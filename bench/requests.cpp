@@ -0,0 +1,92 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends requests from one UNIX client to another that replies to each, keeping 1, 16
+// and 256 of them in flight at once, and reports how many complete per second. With
+// one in flight every request waits a full round trip; with more the round trips
+// overlap.
+
+namespace
+{
+
+constexpr int REQUESTS = 100000;
+
+bool Measure(int in_flight)
+{
+    std::string path = fmt::format("_bench_requests_{}", in_flight);
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 256 });
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    bux::Client responder({ .teamname = "responder" });
+    responder.AddHandler("ping", [] (bux::Client& c, const bux::Message& m) {
+        c.Reply(m, { .type = "pong", .content = m.content }).ignore_error();
+    });
+
+    bux::Client requester({ .teamname = "requester" });
+    if (responder.UnixConnect(path).is_error()
+        || requester.UnixConnect(path).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return false;
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    std::atomic<int> sent = 0, completed = 0, failed = 0;
+    using Reply = tb::result<bux::Message, bux::RequestError>;
+    std::function<void(Reply)> on_reply = [&] (Reply r) {
+        if (r.is_error()) ++failed;
+        ++completed;
+        // Keep the same number in flight by sending another as each one completes
+        if (sent++ < REQUESTS - in_flight) {
+            requester.Request({ .type = "ping", .dest = "responder", .content = 42 },
+                on_reply);
+        }
+    };
+
+    auto start = bench::Clock::now();
+    for (int i = 0; i < in_flight; ++i) {
+        requester.Request({ .type = "ping", .dest = "responder", .content = 42 },
+            on_reply);
+    }
+
+    bool complete = bench::WaitFor([&completed] { return completed == REQUESTS; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    fmt::print("{:>3} in flight: {:>9.0f} requests/s{}\n", in_flight,
+        completed / elapsed, complete && !failed ? "" : " (incomplete)");
+
+    server.Close();
+
+    return complete && !failed;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (int in_flight : { 1, 16, 256 }) complete = Measure(in_flight) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Bounces a message between two clients through the server, one round trip at a time,
+// with both clients connected over plain UNIX sockets or both over shared memory. A
+// round trip is four hops: ping to server, server to pong, and back again. Then has
+// ping send a long run of messages without waiting, which is where the rings only
+// needing a wake-up when they go from empty to non-empty pays off.
+
+enum class Transport { UNIX, SHM };
+
+struct Result
+{
+    int completed;
+    std::vector<double> microseconds; // Of each round trip, sorted
+    double seconds; // For the whole run
+};
+
+Result Run(Transport transport, std::string_view content, int round_trips, bool wait)
+{
+    constexpr std::string_view UNIX_FILE = "_unix_bux_bench_shm";
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 256 });
+    auto listening = transport == Transport::UNIX ? server.UnixServer(UNIX_FILE)
+        : server.ShmServer(UNIX_FILE);
+    if (listening.is_error()) {
+        fmt::print("Failed to start server\n");
+        return {};
+    }
+
+    bux::Client ping({ .teamname = "ping" });
+    bux::Client pong({ .teamname = "pong" });
+
+    std::atomic<int> returned = 0;
+    ping.AddHandler("ball", [&returned] (bux::Client&, const bux::Message&) {
+        returned.fetch_add(1, std::memory_order_release);
+    });
+    pong.AddHandler("ball", [] (bux::Client& c, const bux::Message& m) {
+        c.Write({ .type = "ball", .dest = "ping", .content = m.content }).ignore_error();
+    });
+
+    auto connect = [transport] (bux::Client& client) {
+        return transport == Transport::UNIX ? client.UnixConnect(UNIX_FILE)
+            : client.ShmConnect(UNIX_FILE);
+    };
+    if (connect(ping).is_error() || connect(pong).is_error()) {
+        fmt::print("Failed to connect clients\n");
+        return {};
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message ball { .type = "ball", .dest = "pong", .content = content };
+    Result result;
+    result.microseconds.reserve(round_trips);
+
+    auto run_start = bench::Clock::now();
+    for (int i = 0; i < round_trips && !wait; ++i) {
+        if (ping.Write(ball).is_error()) break;
+    }
+    if (!wait) {
+        bench::WaitFor([&] { return returned == round_trips; }, 30s);
+        result.completed = returned;
+        result.seconds = bench::SecondsSince(run_start);
+        server.Close();
+        return result;
+    }
+
+    for (int i = 0; i < round_trips; ++i) {
+        auto start = bench::Clock::now();
+        if (ping.Write(ball).is_error()) break;
+
+        auto deadline = start + 5s;
+        while (returned.load(std::memory_order_acquire) != i + 1
+            && bench::Clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        if (returned != i + 1) break;
+
+        result.microseconds.push_back(bench::SecondsSince(start) * 1e6);
+    }
+
+    result.completed = result.microseconds.size();
+    result.seconds = bench::SecondsSince(run_start);
+    std::ranges::sort(result.microseconds);
+    server.Close();
+
+    return result;
+}
+
+int main()
+{
+    constexpr int WARMUP = 1000;
+    constexpr int ROUND_TRIPS = 20000;
+    constexpr int MESSAGES = 200000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bool complete = true;
+    for (size_t size : { 16, 1024, 16 * 1024 }) {
+        std::string content(size, 'x');
+
+        for (Transport transport : { Transport::UNIX, Transport::SHM }) {
+            Run(transport, content, WARMUP, true);
+            Result result = Run(transport, content, ROUND_TRIPS, true);
+            complete = complete && result.completed == ROUND_TRIPS;
+            if (result.microseconds.empty()) continue;
+
+            auto percentile = [&result] (double p) {
+                return result.microseconds[(result.microseconds.size() - 1) * p];
+            };
+            fmt::print("{:>6} B {:>4}: {} of {} round trips, p50 {:7.1f} us, "
+                "p99 {:7.1f} us\n", size, transport == Transport::UNIX ? "unix" : "shm",
+                result.completed, ROUND_TRIPS, percentile(0.5), percentile(0.99));
+        }
+    }
+
+    for (size_t size : { 16, 1024 }) {
+        std::string content(size, 'x');
+
+        for (Transport transport : { Transport::UNIX, Transport::SHM }) {
+            Result result = Run(transport, content, MESSAGES, false);
+            complete = complete && result.completed == MESSAGES;
+
+            fmt::print("{:>6} B {:>4}: {} of {} one way, {:9.0f} messages/s\n", size,
+                transport == Transport::UNIX ? "unix" : "shm", result.completed,
+                MESSAGES, result.completed / result.seconds);
+        }
+    }
+
+    return complete ? 0 : 1;
+}
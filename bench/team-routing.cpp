@@ -0,0 +1,129 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+
+namespace bux = buxtehude;
+
+// Sends messages from one INTERNAL client to another's team while N idle UNIX clients
+// are spread over 1000 other teams, and reports the time per message. Routing to a team
+// should cost the same however many clients the server has in total.
+
+namespace
+{
+
+constexpr int MESSAGES = 200000;
+constexpr int TEAMS = 1000;
+
+void ConnectIdleClients(std::string_view path, int count, int ready_pipe, int done_pipe)
+{
+    for (int i = 0; i < count; ++i) {
+        std::string frame = bench::HandshakeFrame(fmt::format("team-{}", i % TEAMS));
+        if (bench::ConnectRaw(path, frame) < 0) {
+            fmt::print("Connection {} failed: {}\n", i, strerror(errno));
+            _exit(1);
+        }
+    }
+
+    char byte = 0;
+    if (write(ready_pipe, &byte, 1) < 0) _exit(1);
+    if (read(done_pipe, &byte, 1) < 0) _exit(1);
+    _exit(0);
+}
+
+bool Measure(int idle)
+{
+    std::string path = fmt::format("_bench_team_routing_{}", idle);
+
+    bux::Server server;
+    if (server.UnixServer(path).is_error()) {
+        fmt::print("Failed to start server\n");
+        return false;
+    }
+
+    int ready[2], done[2];
+    if (pipe(ready) || pipe(done)) std::exit(1);
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ready[0]);
+        close(done[1]);
+        ConnectIdleClients(path, idle, ready[1], done[0]);
+    }
+    close(ready[1]);
+    close(done[0]);
+
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+        fmt::print("Client process failed\n");
+        std::exit(1);
+    }
+
+    // Every idle client has to have handshaken, or it would still be joining a team
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(idle / 1000 * 200ms + 200ms);
+
+    std::atomic<int> received = 0;
+    bux::Client producer({ .teamname = "producer" });
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&received] (bux::Client&, const bux::Message&) {
+        ++received;
+    });
+
+    if (producer.InternalConnect(server).is_error()
+        || sink.InternalConnect(server).is_error()) {
+        fmt::print("Failed to connect internal clients\n");
+        std::exit(1);
+    }
+
+    bux::Message tick { .type = "tick", .dest = "sink", .content = 42 };
+    auto start = bench::Clock::now();
+    for (int i = 0; i < MESSAGES; ++i) producer.Write(tick).ignore_error();
+
+    bool complete = bench::WaitFor([&received] { return received == MESSAGES; }, 60s);
+    double elapsed = bench::SecondsSince(start);
+
+    if (complete) {
+        fmt::print("{:>6} idle clients in {} teams: {:>7.3f} us per message\n", idle,
+            TEAMS, elapsed * 1e6 / MESSAGES);
+    } else {
+        fmt::print("{:>6} idle clients: only {} of {} messages arrived\n", idle,
+            received.load(), MESSAGES);
+    }
+
+    server.Close();
+    close(done[1]);
+    waitpid(child, nullptr, 0);
+    close(ready[0]);
+
+    return complete;
+}
+
+}
+
+int main()
+{
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    bool complete = true;
+    for (int idle : { 0, 1000, 10000 }) complete = Measure(idle) && complete;
+
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+
+#include <tb/tb.h>
+
+#include "core.hpp"
+
+namespace buxtehude
+{
+
+struct AttachmentError
+{
+    enum Type
+    {
+        UNSUPPORTED, FILE_ERROR, NOT_SEALED
+    };
+
+    Type type;
+    ErrnoCode code = ERRNO_NO_ERROR;
+
+    std::string What() const
+    {
+        switch (type) {
+        case UNSUPPORTED:
+            return "attachments are not supported on this platform";
+        case FILE_ERROR:
+            return fmt::format("file error: {}", strerror(code));
+        case NOT_SEALED:
+            return "descriptor is not a sealed memfd";
+        }
+    }
+};
+
+// A block of bytes sent beside a message instead of inside it. It lives in a sealed
+// memfd whose descriptor is passed over UNIX connections with SCM_RIGHTS, so the
+// bytes never go through the socket and every recipient maps the same pages. Sealing
+// makes it immutable, which is what lets recipients trust a read-only view of it.
+// Only available on Linux.
+class Attachment
+{
+public:
+    using Fill = std::function<void(std::span<uint8_t>)>;
+
+    // Whether Create() can work at all on this platform
+    static auto Supported() -> bool;
+
+    // Creates an attachment of `size` bytes, which `fill` writes in place
+    static auto Create(size_t size, const Fill& fill)
+    -> tb::result<SharedAttachment, AttachmentError>;
+    static auto Create(std::span<const uint8_t> data)
+    -> tb::result<SharedAttachment, AttachmentError>;
+    // Takes ownership of a received descriptor, which must be a memfd that can no
+    // longer be written to or resized
+    static auto FromDescriptor(FileDescriptor fd)
+    -> tb::result<SharedAttachment, AttachmentError>;
+
+    Attachment(const Attachment&) = delete;
+    Attachment& operator=(const Attachment&) = delete;
+    ~Attachment();
+
+    // Mapped read-only on first use. Empty if the mapping fails.
+    auto Data() const -> std::span<const uint8_t>;
+    auto Size() const -> size_t;
+    auto Descriptor() const -> FileDescriptor;
+
+private:
+    Attachment(FileDescriptor fd, size_t size);
+
+    FileDescriptor fd_;
+    size_t size_;
+    mutable std::once_flag mapped_;
+    mutable const uint8_t* data_ = nullptr;
+};
+
+}
@@ -3,7 +3,9 @@
 #include <nlohmann/json.hpp>
 #include <ctime>
 
+#include "attachment.hpp"
 #include "core.hpp"
 #include "client.hpp"
+#include "envelope.hpp"
 #include "server.hpp"
 #include "validate.hpp"
@@ -1,16 +1,29 @@
 #pragma once
 
 #include "core.hpp"
+#include "executor.hpp"
+#include "mpsc.hpp"
+#include "slotmap.hpp"
 #include "stream.hpp"
 
 #include <tb/tb.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <semaphore>
+#include <shared_mutex>
+#include <span>
 #include <string>
 #include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <event2/event.h>
 
@@ -20,9 +33,26 @@ namespace buxtehude
 class Server;
 class ClientHandle;
 
+// What the server hands an INTERNAL client, queued for its executor
+struct InternalDelivery
+{
+    enum Type
+    {
+        MESSAGE,
+        CHUNK,
+        DISCONNECTED // Runs the disconnect handler, after everything queued before it
+    };
+
+    Type type;
+    std::shared_ptr<const Message> message; // Or the head of a CHUNK_FIRST chunk
+    ChunkHeader header {};
+    std::vector<uint8_t> data;
+};
+
 class Client
 {
     using DisconnectHandler = std::function<void(Client&)>;
+    using ReplyHandler = std::function<void(tb::result<Message, RequestError>)>;
 public:
     Client() = default;
     Client(const Client& other) = delete;
@@ -32,14 +62,48 @@ public:
 
     tb::error<ConnectError> IPConnect(std::string_view hostname, uint16_t port);
     tb::error<ConnectError> UnixConnect(std::string_view path);
+    // Connects to a Server::ShmServer() on the same host. Messages then go through a
+    // pair of rings in shared memory rather than the socket. Linux only.
+    tb::error<ConnectError> ShmConnect(std::string_view path);
     tb::error<ConnectError> InternalConnect(Server& server);
 
     void Disconnect();
 
+    // Messages with an attachment can only be sent over INTERNAL connections, or UNIX
+    // ones once the server's handshake has said it takes them. Safe to call from any
+    // number of threads at once; over a socket the listening thread does the sending.
     tb::error<WriteError> Write(const Message& msg);
+    // Same, but an INTERNAL connection hands the message itself to the server
+    tb::error<WriteError> Write(Message&& msg);
+    // Writes the messages in order. Over a socket, to a server that takes batch
+    // frames, they are sent several to a frame rather than one each. Messages with an
+    // attachment still get a frame of their own.
+    tb::error<WriteError> WriteBatch(std::span<const Message> msgs);
+    // Sends `msg` as a request and calls `handler` with its reply, or with why there is
+    // none: the write failed, `timeout` passed or the client disconnected. It is called
+    // on the thread that reads the reply or on the shared timer's, so it has to be
+    // quick. Replies never go to the handlers added with AddHandler().
+    void Request(Message msg, ReplyHandler handler,
+        std::chrono::milliseconds timeout = DEFAULT_REQUEST_TIMEOUT);
+    // Same, but the reply is waited for through the future
+    auto Request(Message msg, std::chrono::milliseconds timeout = DEFAULT_REQUEST_TIMEOUT)
+    -> std::future<tb::result<Message, RequestError>>;
+    // Answers a message sent with Request(). The server sends the reply to the
+    // connection the request came from, and to no other member of its team.
+    tb::error<WriteError> Reply(const Message& request, Message reply);
+    // Starts a chunked message, for content too large to send at once: `head` is
+    // delivered first, then every piece passed to WriteChunk() as it is written.
+    // Returns the id to pass to WriteChunk(). Only for UNIX/INTERNET connections.
+    tb::result<uint32_t, WriteError> StartChunked(const Message& head);
+    // Sends the next part of a chunked message, in frames of at most CHUNK_SIZE bytes
+    // of data. `last` ends the message.
+    tb::error<WriteError> WriteChunk(uint32_t stream_id, std::span<const uint8_t> data,
+        bool last = false);
     tb::error<WriteError> SetAvailable(std::string_view type, bool available);
 
     void AddHandler(std::string_view type, Handler&& h);
+    // Receives chunked messages whose head has the given type
+    void AddChunkHandler(std::string_view type, ChunkHandler&& h);
     void SetDisconnectHandler(DisconnectHandler&& h);
     void EraseHandler(const std::string& type);
     void ClearHandlers();
@@ -49,36 +113,119 @@ public:
     ClientPreferences preferences;
 private: // Only for INTERNAL clients
     friend ClientHandle;
-    // Called by the Server ClientHandle when it sends a message
-    void Internal_Receive(const Message& msg);
+    // Called by the Server ClientHandle when it sends a message. These only queue it
+    // for the executor, see ClientPreferences::executor.
+    void Internal_Receive(std::shared_ptr<const Message> msg);
+    void Internal_ReceiveChunk(ChunkHeader header, std::shared_ptr<const Message> head,
+        std::span<const uint8_t> data);
     void Internal_Disconnect();
+    void Internal_Post(InternalDelivery&& delivery);
+    // Handles everything queued. False once the client has disconnected.
+    bool Internal_Drain();
+    void Internal_Run(); // For InternalExecutor::OWN_THREAD
 private:
     // Only for socket-based connections
+    tb::result<FileDescriptor, ConnectError> ConnectToFile(std::string_view path);
     tb::error<AllocError> SetupEvents(FileDescriptor socket);
     void StartListening();
     void Read();
     void Listen();
+    void HandleEvent(const Event& event);
+    void FlushWrites();
+    void SendOutbox();
 
     void HandleMessage(const Message& msg);
+    // Hands the message to the handler pool if there is one, else handles it here
+    void QueueHandler(Message&& msg);
+    // Handles the messages queued under `key` until there are none left
+    void RunHandlers(const std::string& key);
+    // `head` is only needed with CHUNK_FIRST
+    void HandleChunk(ChunkHeader header, const Message* head,
+        std::span<const uint8_t> data);
+    tb::error<WriteError> QueueFrame(SharedFrame frame);
+    // Installs the handlers for the server's handshake and resets what it sets. Has to
+    // come before the server can send it.
+    void PrepareHandshake();
     tb::error<WriteError> Handshake();
+    // Hands a reply to the request it answers, if that is still waiting
+    void CompleteRequest(Message&& reply);
+    // Ends every request still waiting, once no reply can come
+    void FailRequests(RequestError error);
     void SetupDefaultHandlers();
 
     ConnectionType conn_type;
-
+    // preferences.format once the server has shown it understands it
+    std::atomic<MessageFormat> write_format = MessageFormat::MSGPACK;
+    // preferences.compression once the server has offered the same
+    std::atomic<Compression> write_compression = Compression::NONE;
+    // Whether the server has said it takes attachments
+    std::atomic<bool> write_attachments = false;
+    // Whether the server has said it takes batch frames
+    std::atomic<bool> write_batches = false;
+
+    // Only touched by the listening thread, once connected
     Stream stream;
+    // Frames written from any thread, encoded and compressed already, for the listening
+    // thread to send in as few system calls as it can
+    MpscQueue<SharedFrame> outbox;
     std::atomic<Server*> server_ptr = nullptr;
+    SlotKey internal_slot = INVALID_SLOT_KEY; // Of its ClientHandle, if INTERNAL
 
+    // Read by the handler threads and changed from any thread, handlers included
+    std::shared_mutex handlers_mutex;
     std::unordered_map<std::string, Handler> handlers;
+    std::unordered_map<std::string, ChunkHandler> chunk_handlers;
+    // Heads of the chunked messages being received, by stream id
+    std::unordered_map<uint32_t, Message> chunk_heads;
+    std::atomic<uint32_t> next_stream_id = 0;
     DisconnectHandler disconnect_handler;
 
+    struct PendingRequest
+    {
+        ReplyHandler handler;
+        TimerQueue::TimerId timeout;
+    };
+
+    // Requests waiting for their reply, by correlation id. Shared with their timers,
+    // which may go off once the client is gone.
+    struct PendingRequests
+    {
+        // Removes the request if it is still waiting
+        auto Take(uint64_t correlation) -> std::optional<PendingRequest>;
+
+        std::mutex mutex;
+        std::unordered_map<uint64_t, PendingRequest> requests;
+    };
+
+    std::shared_ptr<PendingRequests> pending_requests =
+        std::make_shared<PendingRequests>();
+    std::atomic<uint64_t> next_correlation = 1;
+
     std::thread current_thread;
+
+    // Only with preferences.handler_threads
+    std::unique_ptr<HandlerPool> handler_pool;
+    // Messages for the pool, by what they are ordered by. A key is only here while a
+    // task of the pool is working through its messages.
+    std::unordered_map<std::string, std::deque<Message>> handler_queues;
+    std::mutex handler_queues_mutex;
     std::atomic<bool> connected = false;
 
     // Libevent internals
     UEventBase ebase;
-    UEvent interrupt_event;
-
-    EventCallbackData callback_data;
+    UEvent interrupt_event, outbox_event;
+
+    EventHandler event_handler;
+
+    // INTERNAL executor state
+    MpscQueue<InternalDelivery> internal_inbox;
+    std::counting_semaphore<> internal_ready { 0 }; // For InternalExecutor::OWN_THREAD
+    // Pool threads may be given the same client's queue at once
+    std::mutex internal_drain_mutex;
+    // Drains submitted to the pool and not yet finished, which it must outlive
+    size_t internal_drains = 0;
+    std::mutex internal_drains_mutex;
+    std::condition_variable internal_drained;
 };
 
 }
@@ -2,9 +2,13 @@
 
 #include <nlohmann/json.hpp>
 
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <span>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 
 #include <cstdio>
 
@@ -38,34 +42,69 @@ constexpr std::string_view MSG_YOU        = "$$you";
 
 constexpr uint32_t MAX_MESSAGE_LENGTH = 1024 * 256;
 constexpr uint16_t DEFAULT_PORT = 1637;
+constexpr std::chrono::milliseconds DEFAULT_REQUEST_TIMEOUT { 30000 };
 
-constexpr uint8_t CURRENT_VERSION        = 0;
+constexpr uint8_t CURRENT_VERSION        = 1;
 constexpr uint8_t MIN_COMPATIBLE_VERSION = 0;
+// First version that understands MessageFormat::BINARY
+constexpr uint8_t BINARY_FORMAT_VERSION  = 1;
 
 using ErrnoCode = int;
 constexpr ErrnoCode ERRNO_NO_ERROR = -1;
 
+using FileDescriptor = int;
+constexpr FileDescriptor INVALID_FILE_DESCRIPTOR = -1;
+
 using nlohmann::json;
 
+class Attachment;
 class Client;
 
+using SharedAttachment = std::shared_ptr<const Attachment>;
+
 enum class LogLevel { DEBUG = 0, INFO = 1, WARNING = 2, SEVERE = 3 };
 
-enum class ConnectionType { UNIX, INTERNET, INTERNAL };
-enum class MessageFormat : uint8_t { JSON = 0, MSGPACK = 1 };
+// SHM connections are UNIX ones whose frames go through shared memory instead
+enum class ConnectionType { UNIX, INTERNET, INTERNAL, SHM };
+// BINARY frames start with a fixed binary envelope followed by MessagePack content
+enum class MessageFormat : uint8_t { JSON = 0, MSGPACK = 1, BINARY = 2 };
+constexpr size_t MESSAGE_FORMAT_COUNT = 3;
+
+// What to use with peers that predate `format`, and how its content is encoded
+constexpr auto FallbackFormat(MessageFormat format) -> MessageFormat
+{
+    return format == MessageFormat::BINARY ? MessageFormat::MSGPACK : format;
+}
+
+// Frame compression both sides of a connection have to ask for in their handshakes
+enum class Compression : uint8_t { NONE = 0, ZSTD = 1 };
+constexpr size_t DEFAULT_COMPRESSION_THRESHOLD = 1024 * 4;
 
 enum class EventType
 {
     NEW_CONNECTION, READ_READY, TIMEOUT, INTERRUPT, INTERNAL_READ_READY,
-    WRITE_READY
+    WRITE_READY, INBOX_READY, OUTBOX_READY
+};
+
+struct Event
+{
+    EventType type;
+    // Only for NEW_CONNECTION: the accepted socket and the listener that accepted it
+    FileDescriptor socket = INVALID_FILE_DESCRIPTOR;
+    evconnlistener* listener = nullptr;
 };
 
+// Run from inside the libevent callbacks, so every event that one poll reports is
+// handled in the same pass of the event loop. Each connection has its own, which the
+// callbacks below take a pointer to as their argument.
+using EventHandler = std::function<void(const Event&)>;
+
 struct ConnectError
 {
     enum Type
     {
         GETADDRINFO_ERROR, CONNECT_ERROR, LIBEVENT_ERROR, SOCKET_ERROR,
-        WRITE_ERROR, ALREADY_CONNECTED
+        WRITE_ERROR, ALREADY_CONNECTED, SHM_ERROR
     };
 
     Type type;
@@ -86,6 +125,8 @@ struct ConnectError
             return "handshake write error";
         case ALREADY_CONNECTED:
             return "already connected";
+        case SHM_ERROR:
+            return "shared memory setup error";
         }
     }
 };
@@ -94,7 +135,7 @@ struct ListenError
 {
     enum Type
     {
-        LIBEVENT_ERROR, BIND_ERROR
+        LIBEVENT_ERROR, BIND_ERROR, ADDRESS_ERROR
     };
 
     Type type;
@@ -107,6 +148,8 @@ struct ListenError
             return "libevent structure initialisation error";
         case BIND_ERROR:
             return fmt::format("bind error: {}", strerror(code));
+        case ADDRESS_ERROR:
+            return fmt::format("getaddrinfo error: {}", gai_strerror(code));
         }
     }
 };
@@ -114,6 +157,29 @@ struct ListenError
 struct WriteError {};
 struct AllocError {};
 
+// Why a request got no reply
+struct RequestError
+{
+    enum Type
+    {
+        WRITE_ERROR, TIMED_OUT, DISCONNECTED
+    };
+
+    Type type;
+
+    std::string What() const
+    {
+        switch (type) {
+        case WRITE_ERROR:
+            return "request write error";
+        case TIMED_OUT:
+            return "timed out waiting for the reply";
+        case DISCONNECTED:
+            return "disconnected before the reply";
+        }
+    }
+};
+
 template<typename T>
 T make(typename T::element_type* ptr) { return T { ptr }; }
 
@@ -126,18 +192,126 @@ struct Message
     std::string dest, src, type;
     json content;
     bool only_first = false;
+    // Optional. Only_first messages with the same key go to the same team member for
+    // as long as it stays in the team and available.
+    std::string key;
+    // Set by Client::Request() and copied onto the reply by Client::Reply(), 0 on
+    // messages that are neither
+    uint64_t correlation = 0;
+    bool reply = false; // Answers the request with the same correlation id
+    // The server's id for the connection a request came from, set by the server. A
+    // reply goes to that connection alone.
+    uint64_t requester = 0;
+    // Sent beside the message rather than in it, see attachment.hpp
+    SharedAttachment attachment;
 };
 
 void to_json(json& j, const Message& msg);
 void from_json(const json& j, Message& msg);
 
+// Where the handlers of an INTERNAL client run. Never on the server's threads, so that
+// a slow handler only holds up its own client.
+enum class InternalExecutor
+{
+    OWN_THREAD,  // A thread of the client's own
+    SHARED_POOL  // One of the threads of HandlerPool::Shared()
+};
+
+// Which messages a socket client's handler threads may handle at the same time. Server
+// messages ($$handshake and the like) are always handled on the listening thread.
+enum class HandlerOrdering
+{
+    NONE,       // Any of them, in any order
+    PER_TYPE,   // Those of different types. One type's are handled in order of arrival.
+    PER_SOURCE  // Those from different teams (src). One team's are handled in order.
+};
+
 struct ClientPreferences
 {
     std::string teamname = "default";
     MessageFormat format = MessageFormat::MSGPACK;
+    Compression compression = Compression::NONE;
+    // Smallest message, in bytes once serialised, that is sent compressed
+    size_t compression_threshold = DEFAULT_COMPRESSION_THRESHOLD;
+    // This client's share of its team's only_first messages under Dispatch::WEIGHTED,
+    // relative to the capacities of the other members
+    uint32_t capacity = 1;
+    InternalExecutor executor = InternalExecutor::OWN_THREAD;
+    // UNIX/INTERNET/SHM only: threads that run the handlers, so that reading and
+    // decoding go on while they do. With 0 they run on the listening thread.
+    size_t handler_threads = 0;
+    HandlerOrdering handler_ordering = HandlerOrdering::PER_TYPE;
+    // UNIX/INTERNET/SHM only: how long a written message may wait for others to be
+    // sent along with it. With 0 the listening thread sends it as soon as it can.
+    std::chrono::microseconds write_delay { 0 };
+};
+
+// What a server does when a client's outbound queue goes over the high watermark
+enum class OverflowPolicy
+{
+    DROP_OLDEST,  // Discard the oldest queued messages that have not started sending
+    DROP_NEWEST,  // Discard new messages until the queue drains to the low watermark
+    DISCONNECT,   // Disconnect the client
+    BLOCK         // Keep queueing, and block INTERNAL clients' Write() calls until the
+                  // queue drains to the low watermark
+};
+
+// How a server with several reactor threads picks the one to take a new connection
+enum class ReactorBalancing
+{
+    ROUND_ROBIN,  // Each in turn
+    LEAST_LOADED  // The one with the fewest connections
+};
+
+// How a server picks the member of a team that gets an only_first message. Members
+// unavailable for the message's type are passed over whichever is used. Messages with a
+// key are dispatched by it instead, see Message::key.
+enum class Dispatch
+{
+    FIRST_AVAILABLE, // The member that joined the team first
+    ROUND_ROBIN,     // Each member in turn
+    LEAST_LOADED,    // The one with fewer bytes queued of two picked at random
+    WEIGHTED         // Picked at random, in proportion to their handshaken capacity
+};
+
+struct ServerPreferences
+{
+    // Sizes of a client's outbound queue, in bytes
+    size_t high_watermark = 1024 * 1024 * 4;
+    size_t low_watermark = 1024 * 1024;
+    OverflowPolicy overflow_policy = OverflowPolicy::DROP_NEWEST;
+    // Offered to clients in the handshake, used with those that ask for it too
+    Compression compression = Compression::NONE;
+    size_t compression_threshold = DEFAULT_COMPRESSION_THRESHOLD;
+    // Largest message accepted, in bytes. Chunked messages may be this large in total;
+    // anything else is limited to MAX_MESSAGE_LENGTH as well.
+    size_t max_message_size = 1024 * 1024 * 64;
+    // Event loop threads, each with its own share of the connections
+    size_t reactor_threads = 1;
+    // Only applies to UNIX and SHM connections while IP listeners are sharded
+    ReactorBalancing balancing = ReactorBalancing::ROUND_ROBIN;
+    // Gives every reactor its own SO_REUSEPORT listener for each IP address, so that
+    // the kernel spreads new connections between them. Linux only.
+    bool shard_ip_listeners = true;
+    // Connections that may wait to be accepted on each listening socket
+    int listen_backlog = SOMAXCONN;
+    // For only_first messages to the teams not in team_dispatch, including MSG_ALL
+    Dispatch dispatch = Dispatch::FIRST_AVAILABLE;
+    std::unordered_map<std::string, Dispatch> team_dispatch;
+};
+
+// A piece of a chunked message, as passed to a ChunkHandler
+struct Chunk
+{
+    std::span<const uint8_t> data;
+    bool first = false; // Only the head has arrived, data is empty
+    bool last = false;
+    bool aborted = false; // The sender stopped or the message went over the limit
 };
 
 using Handler = std::function<void(Client&, const Message&)>;
+// Called with the head of the chunked message for each of its chunks, in order
+using ChunkHandler = std::function<void(Client&, const Message& head, const Chunk&)>;
 using LogCallback = void (*)(LogLevel, std::string_view);
 using SignalHandler = void (*)(int);
 
@@ -162,6 +336,40 @@ inline const ValidationSeries VALIDATE_HANDSHAKE_SERVERSIDE = {
     VERSION_CHECK
 };
 
+// Only checked for version 1 clients and up, which may ask for a format that older
+// servers would reject in "format"
+inline const ValidationSeries VALIDATE_PREFERRED_FORMAT = {
+    { "/preferred_format"_json_pointer, predicates::Matches({
+        MessageFormat::JSON, MessageFormat::MSGPACK, MessageFormat::BINARY
+      })
+    }
+};
+
+// Optional in both handshakes
+inline const ValidationSeries VALIDATE_COMPRESSION = {
+    { "/compression"_json_pointer, predicates::Matches({
+        Compression::NONE, Compression::ZSTD
+      })
+    }
+};
+
+// Optional in both handshakes: whether the sender takes attachments on this connection
+inline const ValidationSeries VALIDATE_ATTACHMENTS = {
+    { "/attachments"_json_pointer, predicates::IsBool }
+};
+
+// Optional in both handshakes: whether the sender takes batch frames
+inline const ValidationSeries VALIDATE_BATCHES = {
+    { "/batches"_json_pointer, predicates::IsBool }
+};
+
+// Optional in the client's handshake, see ClientPreferences::capacity
+inline const ValidationSeries VALIDATE_CAPACITY = {
+    { "/capacity"_json_pointer, predicates::IsUnsigned },
+    { "/capacity"_json_pointer, predicates::GreaterEq<1> },
+    { "/capacity"_json_pointer, predicates::LessEq<UINT32_MAX> }
+};
+
 inline const ValidationSeries VALIDATE_HANDSHAKE_CLIENTSIDE = {
     VERSION_CHECK
 };
@@ -188,6 +396,10 @@ void LoopInterruptCallback(evutil_socket_t fd, short what, void* data);
 
 void InternalReadCallback(evutil_socket_t fd, short what, void* data);
 
+void InboxCallback(evutil_socket_t fd, short what, void* data);
+
+void OutboxCallback(evutil_socket_t fd, short what, void* data);
+
 }
 
 }
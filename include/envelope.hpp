@@ -0,0 +1,133 @@
+#pragma once
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include <tb/tb.h>
+
+#include "core.hpp"
+#include "stream.hpp"
+
+namespace buxtehude
+{
+
+// Flags byte of the binary envelope
+constexpr uint8_t ENVELOPE_ONLY_FIRST = 1 << 0;
+constexpr uint8_t ENVELOPE_KEY = 1 << 1; // A key field follows src
+constexpr uint8_t ENVELOPE_CORRELATION = 1 << 2; // 8 bytes of correlation id follow
+constexpr uint8_t ENVELOPE_REPLY = 1 << 3;
+constexpr uint8_t ENVELOPE_REQUESTER = 1 << 4; // Then 8 bytes of requester id
+constexpr size_t MAX_ENVELOPE_FIELD_LENGTH = UINT16_MAX;
+
+// Appends the envelope of a BINARY frame to `payload`, to be followed by the content.
+// Returns false, leaving `payload` untouched, if a field is too long to fit.
+auto AppendBinaryEnvelope(std::string& payload, std::string_view type,
+    std::string_view dest, std::string_view src, bool only_first,
+    std::string_view key = {}, uint64_t correlation = 0, bool reply = false,
+    uint64_t requester = 0) -> bool;
+
+// Decodes a received frame in full. Nothing if it is malformed.
+auto DecodeMessage(MessageFormat format, std::span<const uint8_t> data)
+-> std::optional<Message>;
+
+// A message whose routing fields have been read but whose content is left as the
+// bytes it arrived in. Routing never needs to look inside the content, so it is only
+// decoded if someone asks for it, and it is forwarded as-is to recipients that use the
+// same MessageFormat as the sender.
+class LazyMessage
+{
+public:
+    LazyMessage(Message&& message);
+    LazyMessage(const Message& message);
+
+    // Extracts the envelope of a received frame without building a DOM for it. Only
+    // the structure of the content is checked; it is copied out of the frame verbatim.
+    static auto Scan(MessageFormat format, std::span<const uint8_t> data)
+    -> tb::result<LazyMessage, StreamError>;
+
+    // Decodes the content on first use. Null if there is none or it is malformed.
+    auto Content() -> const json&;
+    auto ToMessage() & -> Message;
+    auto ToMessage() && -> Message;
+    // Whether the content is still in the bytes it arrived in. If not, nothing is
+    // lost by moving the message out with ToMessage().
+    auto HasRawContent() const -> bool;
+    // Serialises the message, splicing in the original content bytes if `format`
+    // encodes content the same way as the format it was received in
+    auto Encode(MessageFormat format) -> SharedFrame;
+
+    std::string dest, src, type;
+    bool only_first = false;
+    std::string key;
+    uint64_t correlation = 0;
+    bool reply = false;
+    uint64_t requester = 0;
+    SharedAttachment attachment;
+
+private:
+    LazyMessage() = default;
+
+    std::optional<json> content_;
+    std::string raw_content_;
+    MessageFormat raw_format_ = MessageFormat::JSON; // Encoding of raw_content_
+};
+
+// Encodes a message at most once per MessageFormat, however many recipients it has
+class FrameCache
+{
+public:
+    FrameCache(LazyMessage&& message);
+    FrameCache(const Message& message);
+
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+
+    auto Get(MessageFormat format) -> SharedFrame;
+    // Same as Get(), but compressed if it is at least `threshold` bytes. The threshold
+    // is expected to be the same for every call on one FrameCache.
+    auto GetCompressed(MessageFormat format, size_t threshold) -> SharedFrame;
+    // Whichever of the two a recipient that negotiated `compression` takes
+    auto Get(MessageFormat format, Compression compression, size_t threshold)
+    -> SharedFrame;
+    auto GetAttachment() const -> const SharedAttachment&;
+    // For INTERNAL recipients, which take the message itself and share it. One that
+    // was never encoded is moved rather than copied, and later frames are encoded
+    // from it.
+    auto GetMessage() -> std::shared_ptr<const Message>;
+
+private:
+    LazyMessage message_; // Moved from once decoded_ has taken its place
+    std::array<SharedFrame, MESSAGE_FORMAT_COUNT> frames_, compressed_frames_;
+    std::shared_ptr<Message> decoded_;
+    bool moved_ = false;
+};
+
+// One chunk of a chunked message as the server forwards it, encoded at most once per
+// MessageFormat like FrameCache. Only the head depends on the recipient's format.
+class ChunkCache
+{
+public:
+    ChunkCache(ChunkHeader header, std::span<const uint8_t> data);
+    ChunkCache(ChunkHeader header, FrameCache& head);
+
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache& operator=(const ChunkCache&) = delete;
+
+    auto Get(MessageFormat format) -> SharedFrame;
+    auto GetCompressed(MessageFormat format, size_t threshold) -> SharedFrame;
+    auto Get(MessageFormat format, Compression compression, size_t threshold)
+    -> SharedFrame;
+
+    const ChunkHeader header;
+    const std::span<const uint8_t> data; // Empty for the head
+    FrameCache* const head = nullptr;
+
+private:
+    auto Index(MessageFormat format) const -> size_t;
+
+    std::array<SharedFrame, MESSAGE_FORMAT_COUNT> frames_, compressed_frames_;
+};
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace buxtehude
+{
+
+// Threads that run handlers, taking tasks in the order they were submitted. Shared()
+// serves the INTERNAL clients that use InternalExecutor::SHARED_POOL, and socket
+// clients with ClientPreferences::handler_threads have one of their own. Ordering
+// between tasks is up to the submitter, which gives each task a whole queue to work
+// through when its messages must stay in order.
+class HandlerPool
+{
+public:
+    explicit HandlerPool(size_t threads);
+    ~HandlerPool();
+
+    HandlerPool(const HandlerPool&) = delete;
+    HandlerPool& operator=(const HandlerPool&) = delete;
+
+    void Submit(std::function<void()>&& task);
+
+    // One thread per core, and at least two so that one slow handler cannot hold up
+    // every other client. Started on first use and joined at exit.
+    static auto Shared() -> HandlerPool&;
+
+private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::queue<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// One thread that runs tasks once their deadline has passed. Shared() times out the
+// requests of every client, so the tasks it runs have to be quick.
+class TimerQueue
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    // Ordered by deadline, then by when the timer was set
+    using TimerId = std::pair<Clock::time_point, uint64_t>;
+
+    TimerQueue();
+    // Timers that have not gone off yet never do
+    ~TimerQueue();
+
+    TimerQueue(const TimerQueue&) = delete;
+    TimerQueue& operator=(const TimerQueue&) = delete;
+
+    auto Schedule(Clock::time_point deadline, std::function<void()>&& task) -> TimerId;
+    // False if the task has already run or is running
+    bool Cancel(const TimerId& id);
+
+    // Started on first use and joined at exit
+    static auto Shared() -> TimerQueue&;
+
+private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable changed_; // The earliest deadline, or stopping_
+    std::map<TimerId, std::function<void()>> timers_;
+    uint64_t next_id_ = 0;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace buxtehude
+{
+
+// Stands for a string in an InternTable. Ids count up from 0, so they can index arrays.
+using InternId = uint32_t;
+constexpr InternId INVALID_INTERN_ID = ~InternId { 0 };
+
+// Gives each of the strings a server keeps seeing, message types and team names, one
+// compact id, so that they are hashed once on arrival and compared as integers after
+// that. Safe from any thread. Ids are never forgotten or reused. Threads that look
+// names up often keep an InternSnapshot of it instead, and take no lock to do so.
+class InternTable
+{
+public:
+    InternTable() = default;
+    InternTable(const InternTable&) = delete;
+    InternTable& operator=(const InternTable&) = delete;
+
+    // The id of `name`, which is given one if it has none yet
+    auto Intern(std::string_view name) -> InternId
+    {
+        if (InternId id = Find(name); id != INVALID_INTERN_ID) return id;
+
+        std::unique_lock lock { mutex_ };
+        // Another thread may have interned it in between
+        if (auto iter = ids_.find(name); iter != ids_.end()) return iter->second;
+
+        // Keyed by a view of its own copy, which never moves once in the deque
+        InternId id = names_.size();
+        ids_.emplace(names_.emplace_back(name), id);
+
+        return id;
+    }
+
+    // INVALID_INTERN_ID if `name` was never interned
+    auto Find(std::string_view name) const -> InternId
+    {
+        std::shared_lock lock { mutex_ };
+        auto iter = ids_.find(name);
+        return iter == ids_.end() ? INVALID_INTERN_ID : iter->second;
+    }
+
+    auto Name(InternId id) const -> std::string_view
+    {
+        std::shared_lock lock { mutex_ };
+        return names_.at(id);
+    }
+
+    auto Size() const -> size_t
+    {
+        std::shared_lock lock { mutex_ };
+        return names_.size();
+    }
+
+    // Copies of the names with ids from `first` on, in order
+    auto NamesFrom(InternId first) const -> std::vector<std::string>
+    {
+        std::shared_lock lock { mutex_ };
+        if (first >= names_.size()) return {};
+        return { names_.begin() + first, names_.end() };
+    }
+
+private:
+    mutable std::shared_mutex mutex_;
+    std::deque<std::string> names_; // By id
+    std::unordered_map<std::string_view, InternId> ids_;
+};
+
+// One thread's copy of an InternTable, with the same ids. It only learns of names
+// interned since the last CatchUp, which its thread calls before it can meet their
+// ids. Not safe to share between threads.
+class InternSnapshot
+{
+public:
+    InternSnapshot() = default;
+    InternSnapshot(const InternSnapshot&) = delete;
+    InternSnapshot& operator=(const InternSnapshot&) = delete;
+
+    void CatchUp(const InternTable& table)
+    {
+        for (std::string& name : table.NamesFrom(names_.size())) {
+            InternId id = names_.size();
+            ids_.emplace(names_.emplace_back(std::move(name)), id);
+        }
+    }
+
+    // INVALID_INTERN_ID if `name` was not interned as of the last CatchUp
+    auto Find(std::string_view name) const -> InternId
+    {
+        auto iter = ids_.find(name);
+        return iter == ids_.end() ? INVALID_INTERN_ID : iter->second;
+    }
+
+    auto Name(InternId id) const -> std::string_view { return names_.at(id); }
+    auto Size() const -> size_t { return names_.size(); }
+
+private:
+    std::deque<std::string> names_; // By id
+    std::unordered_map<std::string_view, InternId> ids_;
+};
+
+// A set of interned ids, one bit each
+class InternSet
+{
+public:
+    // False for INVALID_INTERN_ID, which is never inserted
+    auto Contains(InternId id) const -> bool
+    {
+        size_t word = id / 64;
+        return word < words_.size() && (words_[word] >> (id % 64) & 1);
+    }
+
+    // Both return whether the set changed
+    auto Insert(InternId id) -> bool
+    {
+        if (id == INVALID_INTERN_ID || Contains(id)) return false;
+
+        size_t word = id / 64;
+        if (word >= words_.size()) words_.resize(word + 1);
+        words_[word] |= uint64_t { 1 } << (id % 64);
+        ++size_;
+
+        return true;
+    }
+
+    auto Erase(InternId id) -> bool
+    {
+        if (!Contains(id)) return false;
+        words_[id / 64] &= ~(uint64_t { 1 } << (id % 64));
+        --size_;
+
+        return true;
+    }
+
+    auto Size() const -> size_t { return size_; }
+
+private:
+    std::vector<uint64_t> words_;
+    size_t size_ = 0;
+};
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace buxtehude
+{
+
+// Unbounded lock-free queue with any number of producers and a single consumer.
+// Producers never wait on each other or on the consumer: a push is one exchange on the
+// head of the list. The consumer may briefly see the queue as empty while a push is
+// halfway done; that push then reports that the consumer has to be woken up.
+template<typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : head_(new Node), tail_(head_.load()) {}
+    ~MpscQueue()
+    {
+        while (Pop()) {}
+        delete tail_;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Safe from any thread. True if the consumer should be woken up, which is only
+    // the case for the first push since it last called Drain().
+    bool Push(T value)
+    {
+        Node* node = new Node { std::move(value) };
+        Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+        return !signalled_.exchange(true);
+    }
+
+    // Consumer only
+    std::optional<T> Pop()
+    {
+        Node* next = tail_->next.load(std::memory_order_acquire);
+        if (!next) return std::nullopt;
+
+        // The next node becomes the empty one at the tail
+        std::optional<T> value = std::move(next->value);
+        next->value.reset();
+        delete tail_;
+        tail_ = next;
+
+        return value;
+    }
+
+    // Consumer only: takes everything queued, and has the next push wake it up again
+    template<typename F>
+    void Drain(F&& f)
+    {
+        signalled_.store(false);
+        while (std::optional<T> value = Pop()) f(std::move(*value));
+    }
+
+private:
+    struct Node
+    {
+        std::optional<T> value;
+        std::atomic<Node*> next = nullptr;
+    };
+
+    std::atomic<Node*> head_; // Last pushed
+    Node* tail_; // Already consumed, followed by the oldest value
+    std::atomic<bool> signalled_ = false;
+};
+
+}
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "core.hpp"
+#include "envelope.hpp"
+#include "intern.hpp"
+#include "mpsc.hpp"
+#include "slotmap.hpp"
 #include "stream.hpp"
 
 #include <tb/tb.h>
@@ -8,10 +12,17 @@
 #include <ctime>
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <set>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <event2/event.h>
@@ -25,15 +36,176 @@ namespace buxtehude
 {
 
 class Client;
+class Server;
+struct Reactor;
+
+struct QueueStats
+{
+    std::string teamname;
+    size_t queued_frames = 0, queued_bytes = 0, dropped_messages = 0;
+    bool congested = false;
+};
+
+// Where a handshaken client lives and how to encode messages for it, which is all any
+// reactor needs to send it something
+struct Address
+{
+    uint64_t id; // Of its ClientHandle
+    size_t reactor;
+    SlotKey slot; // In the clients of its reactor
+    MessageFormat format;
+    Compression compression;
+    bool attachments;
+    bool batches; // Takes batch frames
+    bool internal; // Takes frames uncompressed, as it decodes them right away
+};
+
+// A handshaken client as every reactor sees it
+struct Member
+{
+    // Of the interned type, and so of any type that was never interned
+    bool Available(InternId type) const;
+
+    // Each type interned for it stays in the server's InternTable for good
+    static constexpr size_t MAX_UNAVAILABLE_TYPES = 256;
+
+    Address address;
+    InternId team; // Its teamname, interned
+    InternSet unavailable; // Interned message types
+    uint32_t capacity = 1; // See ClientPreferences::capacity
+    // Bytes in its outbound queue, kept up to date by the reactor serving it
+    std::shared_ptr<const std::atomic<size_t>> queued_bytes;
+};
+
+// The handshaken clients of a whole server, in one dense array for $$all and by team,
+// so that a message to a team only ever looks at the members of that team
+class MemberIndex
+{
+public:
+    // Which Dispatch each team uses is taken from `preferences`. Members' ids come
+    // from `names`, which teams and message types are looked up in a copy of, caught
+    // up as members are put.
+    MemberIndex(const ServerPreferences& preferences, InternTable& names);
+
+    // Adds `member`, or replaces the one with the same id
+    void Put(Member member);
+    void Remove(uint64_t id);
+    auto Get(uint64_t id) -> Member*;
+
+    // Calls `f` with every member of `team`, in the order they joined it, or with
+    // every member of the server for MSG_ALL
+    template<typename F>
+    void ForEach(std::string_view team, F&& f) const
+    {
+        if (team == MSG_ALL) {
+            for (const Member& member : members_) f(member);
+            return;
+        }
+
+        InternId id = names_.Find(team);
+        if (id >= teams_.size()) return;
+        for (uint32_t index : teams_[id].members) f(members_[index]);
+    }
+
+    // The member of `team`, or of the server for MSG_ALL, that gets an only_first
+    // message of `type` from client `exclude`. Unless every member is unavailable for
+    // it, in which case the last one looked at gets it anyway. With a `key` the team's
+    // Dispatch is ignored and the member is found on a consistent hash ring, so that
+    // members joining or leaving only move the keys that hashed next to them.
+    auto Choose(std::string_view team, std::string_view type, uint64_t exclude,
+        std::string_view key = {}) -> const Member*;
+
+    auto Size() const -> size_t { return members_.size(); }
+
+    // Ids of teams and message types, as this index knows them. Intern also makes
+    // the id known to the index at once, for members changed in place.
+    auto Intern(std::string_view name) -> InternId;
+    auto Find(std::string_view name) const -> InternId { return names_.Find(name); }
+
+private:
+    struct Team
+    {
+        std::vector<uint32_t> members; // Indices into members_, in the order they joined
+        Dispatch dispatch;
+        size_t next = 0; // For Dispatch::ROUND_ROBIN
+        // For Dispatch::WEIGHTED, running totals of the members' capacities
+        std::vector<uint64_t> capacities;
+        bool capacities_stale = true;
+        // For keyed messages, RING_POINTS (hash, member id) pairs per member, sorted
+        std::vector<std::pair<uint64_t, uint64_t>> ring;
+        bool ring_stale = true;
+    };
+
+    // Per member, to even out how many keys each gets
+    static constexpr size_t RING_POINTS = 64;
+
+    auto NewTeam(std::string_view teamname) const -> Team;
+    auto ChooseByKey(Team& team, InternId type, uint64_t exclude, std::string_view key)
+    -> const Member*;
+
+    const ServerPreferences* preferences_;
+    InternTable* table_;
+    InternSnapshot names_; // Of table_, so that routing takes no lock
+    std::vector<Member> members_;
+    std::unordered_map<uint64_t, uint32_t> indices_; // By id
+    std::vector<Team> teams_; // By the id of their name, empty if they have no members
+    Team all_; // Every member, for MSG_ALL. Its indices always count up from 0.
+    std::minstd_rand random_;
+};
+
+// A request as the server knows it: the id of the client that sent it, and the
+// correlation id it gave it
+using RequestKey = std::pair<uint64_t, uint64_t>;
+
+// Where the rest of a chunked message goes, decided when its head arrives
+struct ChunkRoute
+{
+    uint32_t stream_id; // As forwarded, unique within the server
+    std::vector<Address> recipients;
+    size_t bytes = 0;
+};
+
+// Frames for one recipient, collected while a batch frame is handled and then sent to it
+// as a batch frame of their own
+struct PendingBatch
+{
+    Address to;
+    std::vector<SharedFrame> frames; // Uncompressed, all in one format
+    size_t bytes = 0; // Of the batch frame's payload
+};
+
+// Work handed to a reactor by the others, through its inbox
+struct Delivery
+{
+    enum Type
+    {
+        FRAME,       // `frame`, encoded for the client at `slot`
+        BROADCAST,   // `message` for every client of the reactor
+        CONNECTION,  // `socket`, accepted by another reactor
+        MEMBER,      // `member` has handshaken or changed its availability
+        MEMBER_LEFT  // Client `client_id` is gone
+    };
+
+    Type type;
+    uint64_t client_id = 0;
+    SlotKey slot = INVALID_SLOT_KEY;
+    SharedFrame frame;
+    RequestKey request {}; // If `frame` is a request, which the recipient may reply to
+    std::shared_ptr<const Message> message;
+    FileDescriptor socket = INVALID_FILE_DESCRIPTOR;
+    ConnectionType conn_type = ConnectionType::UNIX;
+    Member member;
+};
 
 class ClientHandle
 {
     using Clock = std::chrono::high_resolution_clock;
     using TimePoint = std::chrono::time_point<Clock>;
 public:
-    ClientHandle(Client& iclient, std::string_view teamname);
-    ClientHandle(ConnectionType conn_type, FileDescriptor socket, event_base* ebase,
-        EventCallbackData& callback_data);
+    ClientHandle(Server& server, Reactor& reactor, Client& iclient,
+        std::string_view teamname);
+    ClientHandle(Server& server, Reactor& reactor, ConnectionType conn_type,
+        FileDescriptor socket, EventHandler handler);
 
     ClientHandle(const ClientHandle&) = delete;
     ClientHandle& operator=(const ClientHandle&) = delete;
@@ -44,24 +216,99 @@ public:
 
     // Applicable to all types of ClientHandle
     tb::error<WriteError> Handshake();
+    // The server's own messages, which the overflow policy never drops
     tb::error<WriteError> Write(const Message& m);
+    tb::error<WriteError> Write(Message&& m);
+    // Reuses the encoding cached in `frames` if the message has already been encoded
+    // in this client's format. Only `control` messages, the server's own, are exempt
+    // from the overflow policy.
+    tb::error<WriteError> Write(FrameCache& frames, bool control = false);
+    // Chunks are never dropped, as that would corrupt the rest of their message
+    tb::error<WriteError> WriteChunk(ChunkCache& chunk);
+    // A message or chunk another reactor has already encoded for this client
+    tb::error<WriteError> Write(SharedFrame frame, bool control = false);
     void Error(std::string_view errstr);
     void Disconnect(std::string_view reason="Disconnected by server");
     void Disconnect_NoWrite();
+    // Sends queued messages once the socket is writable (UNIX/INTERNET only)
+    void Flush();
 
-    bool Available(std::string_view type);
+    QueueStats Stats() const;
+    // How the other clients see this one once it has handshaken
+    Member ToMember() const;
 
-    Stream stream; // Only for UNIX/INTERNET
+    // Records a request delivered to this client, which it may then reply to once.
+    // Past MAX_OPEN_REQUESTS the oldest are forgotten.
+    void OpenRequest(RequestKey request);
+    // Whether this client may reply to `request`, which it then may not again
+    bool CloseRequest(RequestKey request);
+
+    static constexpr size_t MAX_OPEN_REQUESTS = 1 << 16;
+
+    Stream stream; // Only for UNIX/INTERNET/SHM
+    Server* server = nullptr;
+    Reactor* reactor = nullptr; // The one whose thread serves it
+    uint64_t id = 0; // Unique within the server
+    // In the clients of its reactor. Its events carry this, so finding it is no search.
+    SlotKey slot = INVALID_SLOT_KEY;
+
+    // Chunked messages this client is sending, by the stream id it chose
+    std::unordered_map<uint32_t, ChunkRoute> chunk_routes;
+    // Requests it has been sent and not replied to, and the order they came in
+    std::set<RequestKey> open_requests;
+    std::deque<RequestKey> open_request_order;
 
-    std::vector<std::string> unavailable;
     Client* client_ptr = nullptr; // Only for INTERNAL connections
     TimePoint last_error = Clock::now();
 
     ConnectionType conn_type;
     ClientPreferences preferences;
 
+    size_t dropped_messages = 0;
+    uint32_t capacity = 1; // See ClientPreferences::capacity
+    // Published in its Member, for the other reactors to read
+    std::shared_ptr<std::atomic<size_t>> queued_bytes =
+        std::make_shared<std::atomic<size_t>>(0);
+
     bool handshaken = false;
     bool connected = false;
+    bool attachments = false; // Takes attachments as descriptors (UNIX only)
+    bool batches = false; // Takes batch frames (UNIX/INTERNET/SHM only)
+    bool congested = false; // Over the high watermark and not yet back to the low one
+private:
+    void SetCongested(bool congested);
+    void ReceiveInternal(const EncodedFrame& frame);
+};
+
+// One event loop thread of a Server and the connections it serves. Each reactor has
+// its own copy of the members of every team, kept up to date through the inboxes, so
+// routing never has to look at another reactor's state.
+struct Reactor
+{
+    Reactor(size_t index, const ServerPreferences& preferences, InternTable& names);
+
+    size_t index;
+
+    UEventBase ebase;
+    UEvent interrupt_event, inbox_event;
+    EventHandler event_handler;
+    std::thread thread;
+
+    // Only used by the reactor's thread, or by others with clients_mutex held
+    SlotMap<ClientHandle> clients;
+    std::unordered_map<Client*, SlotKey> internal_clients;
+    MemberIndex members; // Of the whole server
+    std::mutex clients_mutex;
+    bool clients_disconnected = false; // Some of `clients` are waiting to be removed
+    bool listening = false;
+
+    MpscQueue<Delivery> inbox;
+    std::atomic<size_t> connections = 0; // Including those still in the inbox
+
+    // While a batch frame is handled, frames for clients that take batches wait here
+    // to be sent together, by client id
+    bool batching = false;
+    std::unordered_map<uint64_t, PendingBatch> pending_batches;
 };
 
 class Server
@@ -69,56 +316,115 @@ class Server
 public:
     Server() = default;
     Server(const Server& other) = delete;
+    Server(const ServerPreferences& preferences);
     ~Server();
 
     tb::error<ListenError> UnixServer(std::string_view path="buxtehude_unix");
     tb::error<ListenError> IPServer(uint16_t port=DEFAULT_PORT);
+    // Listens on one numeric IPv4 or IPv6 address. Can be called again to listen on
+    // several addresses and ports at once.
+    tb::error<ListenError> IPServer(std::string_view address, uint16_t port);
+    // Listens for Client::ShmConnect(). Linux only.
+    tb::error<ListenError> ShmServer(std::string_view path="buxtehude_shm");
     tb::error<AllocError> InternalServer();
 
     void Close();
+
+    // Outbound queue depth and drop counters of every connected client
+    std::vector<QueueStats> GetQueueStats();
+
+    const ServerPreferences preferences;
 private: // For INTERNAL connections only.
     friend Client;
-    void Internal_AddClient(Client& cl);
+    friend ClientHandle;
+    // Returns the slot of its handle, which its messages are addressed from
+    SlotKey Internal_AddClient(Client& cl);
     void Internal_RemoveClient(Client& cl);
-    void Internal_ReceiveFrom(Client& cl, const Message& msg);
+    void Internal_ReceiveFrom(SlotKey slot, Message&& msg);
 private:
-    using HandleIter = std::vector<ClientHandle>::iterator;
-
     void Run();
-    void Serve(HandleIter client_handle);
-    void HandleMessage(ClientHandle& client_handle, Message&& msg);
-    void Broadcast_NoLock(const Message& msg);
+    void Serve(ClientHandle& client_handle);
+    void HandleMessage(ClientHandle& client_handle, LazyMessage&& msg);
+    // Handles every message in the frame, then sends each recipient what it got from
+    // them in one batch frame
+    void HandleBatch(ClientHandle& client_handle, MessageFormat format,
+        std::span<const uint8_t> data);
+    void HandleChunk(ClientHandle& client_handle, MessageFormat format,
+        std::span<const uint8_t> data);
+    // Writes to the client at `to`, from whichever reactor it is on
+    // `request` is set if the message is one, for the recipient to be able to reply
+    void Deliver(Reactor& reactor, const Address& to, FrameCache& frames,
+        RequestKey request = {});
+    void AddToBatch(Reactor& reactor, const Address& to, SharedFrame frame);
+    void SendBatch(Reactor& reactor, PendingBatch& batch);
+    void DeliverChunk(Reactor& reactor, const Address& to, ChunkCache& chunk);
+    void ForwardChunk(Reactor& reactor, const ChunkRoute& route, ChunkCache& chunk);
+    // Tells the recipients of every unfinished chunked message from this client
+    void AbortChunks(ClientHandle& client_handle);
+    void Broadcast_NoLock(Reactor& reactor, const Message& msg);
+    // Broadcasts to the clients of every reactor
+    void BroadcastAll(Reactor& reactor, const Message& msg);
+
+    // Keeping the members of every reactor up to date
+    void PublishMember(Reactor& reactor, const Member& member);
+    void RemoveMember(Reactor& reactor, uint64_t id);
+    void Send(size_t reactor, Delivery&& delivery);
+    void HandleInbox(Reactor& reactor);
 
     // Only if listening sockets are opened
     tb::error<AllocError> SetupEvents();
-    void Listen();
-    void AddConnection(FileDescriptor socket, sa_family_t addr_type);
+    void Listen(Reactor& reactor);
+    // For the listeners and the reactors' own events
+    void HandleEvent(Reactor& reactor, const Event& event);
+    void HandleClientEvent(Reactor& reactor, SlotKey slot, const Event& event);
+    // Erases the handles that have disconnected and tells everyone they have gone
+    void RemoveDisconnected(Reactor& reactor);
+    void RemoveClient(Reactor& reactor, ClientHandle& client_handle);
+    tb::error<ListenError> ListenOnFile(std::string_view path, UEvconnListener& listener,
+        std::string& bound_path);
+    // Hands a socket accepted on `reactor` to the reactor that is to serve it
+    void Accept(Reactor& reactor, FileDescriptor socket, evconnlistener* listener);
+    auto ChooseReactor() -> Reactor&;
+    bool ShardsIPListeners() const;
+    void AddConnection(Reactor& reactor, FileDescriptor socket,
+        ConnectionType conn_type);
+    // Takes the shared memory a SHM client sends first, then greets it
+    void AcceptShm(ClientHandle& client_handle);
+    bool OnReactorThread() const;
 
-    // Retrieving clients
-    HandleIter GetClientBySocket(int fd);
-    HandleIter GetClientByPointer(Client* ptr);
-    HandleIter GetFirstAvailable(std::string_view team, std::string_view type,
-        const ClientHandle& exclude);
+    // Retrieving clients, null if they have gone
+    ClientHandle* GetClientByPointer(Reactor& reactor, Client* ptr);
+    ClientHandle* GetClient(Reactor& reactor, SlotKey slot);
 
-    std::vector<ClientHandle> clients;
-    std::vector<std::pair<Client*, Message>> internal_messages;
-    std::mutex clients_mutex, internal_mutex;
+    // Team names and message types, which the MemberIndex of every reactor copies
+    InternTable names;
+    // Connections are split between the reactors, INTERNAL ones all go to the first
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    size_t next_reactor = 0; // For ReactorBalancing::ROUND_ROBIN
+    std::atomic<uint64_t> next_client_id = 0;
+    std::atomic<uint32_t> next_stream_id = 0;
+    // From INTERNAL clients, by the slot of their handle on the first reactor. Many
+    // threads writing at once only ever contend on one exchange.
+    MpscQueue<std::pair<SlotKey, Message>> internal_messages;
+
+    // Only for OverflowPolicy::BLOCK
+    void SetBlocking(bool blocking);
+    size_t blocking_clients = 0;
+    std::mutex blocking_mutex;
+    std::condition_variable unblocked;
 
-    std::thread current_thread;
     bool started = false;
 
     // File descriptors for listening sockets
     FileDescriptor unix_server = INVALID_FILE_DESCRIPTOR;
-    FileDescriptor ip_server = INVALID_FILE_DESCRIPTOR;
-
-    std::string unix_path;
 
-    // Libevent internals
-    UEventBase ebase;
-    UEvconnListener ip_listener, unix_listener;
-    UEvent interrupt_event, read_internal_event;
+    std::string unix_path, shm_path;
 
-    EventCallbackData callback_data;
+    // Libevent internals, on the first reactor except for sharded IP listeners, of
+    // which every reactor has one per address
+    UEvconnListener unix_listener, shm_listener;
+    std::vector<UEvconnListener> ip_listeners;
+    UEvent read_internal_event;
 };
 
 }
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace buxtehude
+{
+
+// Identifies a value in a SlotMap: its slot in the low half, and in the high half how
+// many values that slot had held before it
+using SlotKey = uint64_t;
+constexpr SlotKey INVALID_SLOT_KEY = ~SlotKey { 0 };
+
+// Values that never move while they are in the map, looked up by key in constant time.
+// Erased slots are reused, with a new generation, so keys to erased values no longer
+// find anything even once their slot is taken again.
+template<typename T>
+class SlotMap
+{
+public:
+    template<typename... Args>
+    auto Emplace(Args&&... args) -> std::pair<SlotKey, T&>
+    {
+        uint32_t index;
+        if (free_.empty()) {
+            index = slots_.size();
+            slots_.emplace_back();
+        } else {
+            index = free_.back();
+            free_.pop_back();
+        }
+
+        Slot& slot = slots_[index];
+        slot.value.emplace(std::forward<Args>(args)...);
+        ++size_;
+
+        return { SlotKey { slot.generation } << 32 | index, *slot.value };
+    }
+
+    // What the next Emplace() returns
+    auto NextKey() const -> SlotKey
+    {
+        uint32_t index = free_.empty() ? slots_.size() : free_.back();
+        uint32_t generation = index < slots_.size() ? slots_[index].generation : 0;
+
+        return SlotKey { generation } << 32 | index;
+    }
+
+    auto Get(SlotKey key) -> T*
+    {
+        uint32_t index = key & 0xffffffff;
+        if (index >= slots_.size()) return nullptr;
+
+        Slot& slot = slots_[index];
+        if (slot.generation != key >> 32 || !slot.value) return nullptr;
+
+        return &*slot.value;
+    }
+
+    void Erase(SlotKey key)
+    {
+        if (!Get(key)) return;
+
+        uint32_t index = key & 0xffffffff;
+        slots_[index].value.reset();
+        ++slots_[index].generation;
+        free_.push_back(index);
+        --size_;
+    }
+
+    // Erases every value `f` returns true for
+    template<typename F>
+    void EraseIf(F&& f)
+    {
+        for (uint32_t index = 0; index < slots_.size(); ++index) {
+            Slot& slot = slots_[index];
+            if (slot.value && f(*slot.value))
+                Erase(SlotKey { slot.generation } << 32 | index);
+        }
+    }
+
+    template<typename F>
+    void ForEach(F&& f)
+    {
+        for (Slot& slot : slots_) {
+            if (slot.value) f(*slot.value);
+        }
+    }
+
+    template<typename F>
+    void ForEach(F&& f) const
+    {
+        for (const Slot& slot : slots_) {
+            if (slot.value) f(*slot.value);
+        }
+    }
+
+    auto Size() const -> size_t { return size_; }
+
+private:
+    struct Slot
+    {
+        std::optional<T> value;
+        uint32_t generation = 0;
+    };
+
+    std::deque<Slot> slots_; // A deque, so that adding a slot moves no others
+    std::vector<uint32_t> free_;
+    size_t size_ = 0;
+};
+
+}
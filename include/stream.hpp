@@ -1,9 +1,17 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -12,28 +20,47 @@
 
 #include <event2/event.h>
 
+#include "attachment.hpp"
 #include "core.hpp"
 
 namespace buxtehude
 {
 
-using FileDescriptor = int;
-using UFile = std::unique_ptr<FILE, tb::deleter<fclose>>;
+constexpr size_t FRAME_HEADER_SIZE = sizeof(MessageFormat) + sizeof(uint32_t);
 
-constexpr FileDescriptor INVALID_FILE_DESCRIPTOR = -1;
+// The first byte of a frame header holds the MessageFormat in its low bits and flags in
+// the high ones
+constexpr uint8_t FRAME_FORMAT_MASK = 0x0f;
+constexpr uint8_t FRAME_BATCH       = 0x10; // Several messages, see below
+constexpr uint8_t FRAME_ATTACHMENT  = 0x20; // A memfd is passed with the frame
+constexpr uint8_t FRAME_CHUNK       = 0x40; // Part of a chunked message, see below
+constexpr uint8_t FRAME_COMPRESSED  = 0x80; // The payload is a zstd frame
 
-enum class ReadState
-{
-    AWAITING_MESSAGE_FORMAT, AWAITING_MESSAGE_LENGTH, AWAITING_MESSAGE_DATA
-};
+// Chunked messages stream content too large for one frame. Each chunk frame starts
+// with a ChunkHeader; the first one is followed by the message's head (a message in
+// the frame's format), the others by the next piece of data.
+constexpr uint8_t CHUNK_FIRST   = 1 << 0;
+constexpr uint8_t CHUNK_LAST    = 1 << 1;
+constexpr uint8_t CHUNK_ABORTED = 1 << 2; // The message ends here, incomplete
+constexpr size_t CHUNK_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+// Largest piece of data sent in one chunk frame
+constexpr size_t CHUNK_SIZE = 1024 * 64;
+
+// Batch frames carry several messages in the frame's format, each preceded by its
+// length in 4 bytes. They are never chunks and never have an attachment.
+constexpr size_t BATCH_ENTRY_HEADER_SIZE = sizeof(uint32_t);
 
-struct EventCallbackData
+// Calls `f` with each message in the payload of a batch frame. False if the payload is
+// malformed, in which case `f` has only seen the messages before the bad one.
+auto SplitBatch(std::span<const uint8_t> payload,
+    const std::function<void(std::span<const uint8_t>)>& f) -> bool;
+
+struct ChunkHeader
 {
-    sockaddr address;
-    size_t address_length;
-    event_base* event_base;
-    FileDescriptor socket;
-    EventType type;
+    static auto Parse(std::span<const uint8_t> payload) -> std::optional<ChunkHeader>;
+
+    uint32_t stream_id;
+    uint8_t flags;
 };
 
 struct IOError
@@ -70,67 +97,279 @@ struct StreamError
     IOError io_error;
 };
 
+using Slab = tb::dynamically_allocated_array<uint8_t, std::dynamic_extent>;
+
+// Process-wide cache of buffer memory in power-of-two size classes, shared by every
+// Stream so that connections only hold large buffers while they are in use.
+class BufferPool
+{
+public:
+    constexpr static size_t MIN_SLAB_SIZE = 4096;
+    constexpr static size_t MAX_POOLED_BYTES_PER_CLASS = 1024 * 1024 * 8;
+
+    static auto Shared() -> BufferPool&;
+
+    // Returns a slab of at least `size` bytes
+    auto Acquire(size_t size) -> Slab;
+    void Release(Slab slab);
+
+    static auto SlabSize(size_t size) -> size_t;
+
+private:
+    constexpr static size_t SIZE_CLASSES = 24;
+
+    std::array<std::vector<Slab>, SIZE_CLASSES> free_slabs_;
+    std::mutex mutex_;
+};
+
+// One direction of a shared-memory connection
+struct ShmRingControl
+{
+    alignas(64) std::atomic<uint64_t> head; // Bytes read so far, advanced by the reader
+    alignas(64) std::atomic<uint64_t> tail; // Bytes written so far, advanced by the writer
+    // Set by a side that has found the ring empty (reader) or full (writer) and is about
+    // to wait for the other to wake it
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    alignas(64) std::atomic<uint32_t> writer_waiting;
+};
+
+// The transport of a SHM connection: a byte ring in each direction, in a memfd that
+// both processes map, and an eventfd for each side that the other writes to when it
+// has to be woken. Frames go through the rings exactly as they would through a socket.
+// Each side only signals the other when it went to sleep on an empty (or full) ring,
+// so a busy connection makes no system calls at all. Only available on Linux.
+class ShmChannel
+{
+public:
+    constexpr static size_t RING_SIZE = 1024 * 1024;
+    constexpr static size_t DESCRIPTOR_COUNT = 3;
+    using Descriptors = std::array<FileDescriptor, DESCRIPTOR_COUNT>;
+
+    // Creates the memory and eventfds of a new connection, on the client side
+    static auto Create() -> tb::result<std::unique_ptr<ShmChannel>, IOError>;
+    // Takes ownership of what the client sent, on the server side. The memory has to be
+    // sealed against shrinking, so that the client cannot pull it away underneath.
+    static auto Adopt(const Descriptors& descriptors)
+    -> tb::result<std::unique_ptr<ShmChannel>, IOError>;
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    ~ShmChannel();
+
+    // The memfd and both eventfds, for sending to the server
+    auto GetDescriptors() const -> Descriptors;
+    auto GetWakeDescriptor() const -> FileDescriptor;
+
+    // Copies as much of `data` into the outbound ring as fits and returns how much
+    // that was. Fails if the peer has corrupted the ring.
+    auto Write(std::span<const uint8_t> data) -> tb::result<size_t, IOError>;
+    // Copies up to out.size() bytes from the inbound ring
+    auto Read(std::span<uint8_t> out) -> tb::result<size_t, IOError>;
+    // Ask the peer for a wake-up once there is something to read, or room to write.
+    // Return false if there already is, in which case no wake-up may come.
+    auto WaitForData() -> bool;
+    auto WaitForSpace() -> bool;
+    // Resets this side's eventfd once it has fired
+    void ClearWake();
+    // Makes this side's eventfd fire again, to come back to a ring left unfinished
+    void WakeSelf();
+
+private:
+    enum class Side { CLIENT, SERVER };
+
+    ShmChannel(Side side, const Descriptors& descriptors);
+    auto Map() -> tb::error<IOError>;
+    void Signal(FileDescriptor fd);
+
+    Side side_;
+    FileDescriptor memory_, client_wake_, server_wake_;
+    uint8_t* mapping_ = nullptr;
+    ShmRingControl *in_ = nullptr, *out_ = nullptr;
+    uint8_t *in_data_ = nullptr, *out_data_ = nullptr;
+    // Own copies of the positions this side advances, never read back from shared
+    // memory where the peer could change them
+    uint64_t read_position_ = 0, write_position_ = 0;
+};
+
+// Starts at `initial_size` bytes and grows in pool-sized steps up to `max_size`. Memory
+// is taken from and returned to the shared BufferPool.
 class ByteBuffer
 {
 public:
     ByteBuffer() = default;
-    ByteBuffer(size_t size);
+    ByteBuffer(size_t initial_size, size_t max_size);
+
+    ByteBuffer(const ByteBuffer&) = delete;
+    ByteBuffer& operator=(const ByteBuffer&) = delete;
+
+    ByteBuffer(ByteBuffer&& other) noexcept;
+    ByteBuffer& operator=(ByteBuffer&& other) noexcept;
+    ~ByteBuffer();
 
-    auto WriteFromStream(FILE* stream, size_t bytes) -> tb::error<IOError>;
+    // Descriptors passed with SCM_RIGHTS are appended to `descriptors`
+    auto WriteFromSocket(FileDescriptor socket, std::deque<FileDescriptor>& descriptors)
+    -> tb::error<IOError>;
+    // Returns the number of bytes read, 0 if the ring is empty
+    auto WriteFromShm(ShmChannel& channel) -> tb::result<size_t, IOError>;
     auto WriteFromMemory(tb::contiguous_byte_range auto const& source)
     -> tb::error<IOError>;
 
     template<typename T> requires std::is_scalar_v<T>
     auto WriteFromMemory(T object) -> tb::error<IOError>;
-    auto ReadIntoStream(FILE* stream, size_t bytes) -> tb::error<IOError>;
 
     template<typename T> requires std::is_scalar_v<T>
     auto ReadIntoMemory(T& object) -> tb::error<IOError>;
 
+    // Makes room for `bytes` more bytes after the unread data, growing if needed
+    auto Reserve(size_t bytes) -> tb::error<IOError>;
+    // Gives memory above the initial size back to the pool if nothing is left to read
+    void Shrink();
+    void Skip(size_t bytes);
+    void Compact();
     void Reset();
     auto BytesToRead() const -> size_t;
+    auto BytesFree() const -> size_t;
+    auto Capacity() const -> size_t;
     auto ReadView() const -> std::span<uint8_t>;
 
 private:
-    tb::dynamically_allocated_array<uint8_t, std::dynamic_extent> data_;
+    Slab data_;
+    size_t initial_size_ = 0, max_size_ = 0;
     size_t write_position_ = 0;
     size_t read_position_ = 0;
 };
 
+// A serialised message ready to be sent. The frame header and the payload are kept
+// in separate buffers so that both can be handed to sendmsg(2) as they are. Frames are
+// immutable once encoded and shared between every outbound queue they are sent on.
+struct EncodedFrame
+{
+    // Carries message.attachment if it has one
+    static auto Encode(MessageFormat format, const Message& message)
+    -> std::shared_ptr<const EncodedFrame>;
+    // Adds the frame header to an already serialised message
+    static auto FromPayload(MessageFormat format, std::string&& payload,
+        uint8_t flags = 0, SharedAttachment attachment = nullptr)
+    -> std::shared_ptr<const EncodedFrame>;
+    // Returns a compressed copy of `frame`, or `frame` itself if its payload is
+    // smaller than `threshold` bytes or would not get any smaller
+    static auto Compress(const std::shared_ptr<const EncodedFrame>& frame,
+        size_t threshold)
+    -> std::shared_ptr<const EncodedFrame>;
+
+    // A chunk frame: `data` is either the head's payload or a piece of data
+    static auto EncodeChunk(MessageFormat format, ChunkHeader header,
+        std::span<const uint8_t> data)
+    -> std::shared_ptr<const EncodedFrame>;
+    // A batch frame of the payloads of `frames`, which have to be plain frames of one
+    // format that fit in MAX_MESSAGE_LENGTH together, entry headers included
+    static auto Batch(std::span<const std::shared_ptr<const EncodedFrame>> frames)
+    -> std::shared_ptr<const EncodedFrame>;
+
+    auto Format() const -> MessageFormat;
+    auto Flags() const -> uint8_t;
+    auto Size() const -> size_t;
+
+    std::array<uint8_t, FRAME_HEADER_SIZE> header;
+    std::string payload;
+    SharedAttachment attachment; // Sent with the frame, which has FRAME_ATTACHMENT
+};
+
+using SharedFrame = std::shared_ptr<const EncodedFrame>;
+
+// Called with the frame's flags, apart from FRAME_COMPRESSED and FRAME_ATTACHMENT, its
+// payload and the attachment passed with it, if any
+using FrameCallback = std::function<void(MessageFormat, uint8_t, std::span<const uint8_t>,
+    SharedAttachment)>;
+
 class Stream
 {
 public:
-    constexpr static size_t BUFFER_SIZE = sizeof(MessageFormat) + sizeof(uint32_t)
-                                        + MAX_MESSAGE_LENGTH;
+    constexpr static size_t HEADER_SIZE = FRAME_HEADER_SIZE;
+    constexpr static size_t BUFFER_SIZE = HEADER_SIZE + MAX_MESSAGE_LENGTH;
+    constexpr static size_t INITIAL_READ_BUFFER_SIZE = BufferPool::MIN_SLAB_SIZE;
     Stream() = default;
 
     Stream(const Stream&) = delete;
     Stream& operator=(const Stream&) = delete;
 
-    Stream(Stream&&) = default;
-    Stream& operator=(Stream&&) = default;
+    Stream(Stream&& other) noexcept;
+    Stream& operator=(Stream&& other) noexcept;
+    ~Stream();
 
-    static auto FromSocket(FileDescriptor socket, event_base* ebase,
-        EventCallbackData& callback_data)
+    // The events of the socket go to `handler`
+    static auto FromSocket(FileDescriptor socket, event_base* ebase, EventHandler handler)
     -> tb::result<Stream, StreamError>;
 
+    // Moves the stream onto shared memory. The socket is then only used to notice the
+    // peer going away. The client creates the channel and sends it over the socket,
+    // and the server takes it from the first thing it reads; AcceptShm() fails with
+    // BUFFER_EMPTY until it has arrived.
+    auto ConnectShm(event_base* ebase) -> tb::error<StreamError>;
+    auto AcceptShm(event_base* ebase) -> tb::error<StreamError>;
+    auto UsesShm() const -> bool;
+
     auto WriteMessage(MessageFormat format, const Message& message)
     -> tb::error<IOError>;
-    auto ReadMessage() -> tb::result<Message, StreamError>;
+    // Appends a frame to the outbound queue and, if nothing was queued before it,
+    // tries to send it straight away. Whatever the socket does not take is sent by
+    // Flush() once it becomes writable.
+    auto QueueFrame(SharedFrame frame) -> tb::error<IOError>;
+    // Appends a frame without trying to send it, so that several can go out in the
+    // next Flush()
+    auto AppendFrame(SharedFrame frame) -> tb::error<IOError>;
+    // Removes whole frames that have not started sending, oldest first, until at
+    // most `target_bytes` are queued. Chunk frames are kept, since losing one would
+    // corrupt the rest of their message. Returns the number of frames removed.
+    auto DropOldest(size_t target_bytes) -> size_t;
+    // Reads everything available on the socket (up to the free space in the read
+    // buffer) with a single read(2), then passes the payload of each complete frame
+    // to `callback`, decompressed if need be. The span is only valid for the duration
+    // of the call. A partially received frame is kept in the buffer until the next
+    // call. Frames with FRAME_ATTACHMENT whose descriptor is missing or not a sealed
+    // memfd are dropped.
+    auto ReadFrames(const FrameCallback& callback) -> tb::error<StreamError>;
+    // Sends as much of the outbound queue as the socket accepts, several frames per
+    // sendmsg(2). A frame with an attachment starts a new call, which passes its
+    // descriptor along with its first bytes. Over shared memory, copies as much as
+    // fits into the ring, and the rest once the peer has made room.
     auto Flush() -> tb::error<IOError>;
 
+    auto QueuedBytes() const -> size_t;
+    auto QueuedFrames() const -> size_t;
+
     auto GetSocket() const -> FileDescriptor;
+    // The eventfd that fires for SHM streams, INVALID_FILE_DESCRIPTOR otherwise
+    auto GetWakeDescriptor() const -> FileDescriptor;
     void Close();
 
 private:
+    // Bytes read from shared memory in one go before coming back to it later, so
+    // that a busy peer does not hold up the rest of the event loop
+    constexpr static size_t MAX_SHM_READ = BUFFER_SIZE * 4;
+
+    // Passes the complete frames in the read buffer to `callback`
+    auto ParseFrames(const FrameCallback& callback) -> tb::error<StreamError>;
+    auto ReadShmFrames(const FrameCallback& callback) -> tb::error<StreamError>;
+    auto FlushShm() -> tb::error<IOError>;
+    auto WatchShm(event_base* ebase) -> tb::error<StreamError>;
+
+    constexpr static size_t MAX_FRAMES_PER_WRITE = 64;
+    // Received descriptors kept for frames that have not been read yet; any more are
+    // closed straight away
+    constexpr static size_t MAX_RECEIVED_DESCRIPTORS = 64;
+
     ByteBuffer read_buffer_;
-    ByteBuffer write_buffer_;
-    UFile stream_handle_;
-    UEvent read_event_, write_event_;
-    ReadState read_state_ = ReadState::AWAITING_MESSAGE_FORMAT;
+    std::deque<FileDescriptor> received_descriptors_;
+    std::deque<SharedFrame> write_queue_;
+    size_t write_offset_ = 0; // Bytes of the first queued frame already sent
+    size_t queued_bytes_ = 0;
+    UEvent read_event_, write_event_, wake_event_;
+    // Kept at the same address however the stream is moved, as the events point to it.
+    // Close() leaves it alone, since it may be running.
+    std::unique_ptr<EventHandler> handler_;
+    std::unique_ptr<ShmChannel> shm_;
     FileDescriptor socket_ = INVALID_FILE_DESCRIPTOR;
-    uint32_t expected_length_;
-    MessageFormat expected_format_;
 };
 
 }
@@ -68,10 +68,14 @@ constexpr auto IntegralCompare = [] (const json& j) -> bool
 template<auto cmp>
 constexpr auto GreaterEq = IntegralCompare<EqualityType::GREATER_EQ, cmp>;
 
+template<auto cmp>
+constexpr auto LessEq = IntegralCompare<EqualityType::LESS_EQ, cmp>;
+
 constexpr auto Exists = nullptr;
 constexpr auto NotEmpty = [] (const json& j) { return j.is_string() && j != ""; };
 constexpr auto IsBool = [] (const json& j) { return j.is_boolean(); };
 constexpr auto IsNumber = [] (const json& j) { return j.is_number(); };
+constexpr auto IsUnsigned = [] (const json& j) { return j.is_number_unsigned(); };
 constexpr auto IsArray = [] (const json& j) { return j.is_array(); };
 
 }
@@ -0,0 +1,125 @@
+#include "attachment.hpp"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace buxtehude
+{
+
+#ifdef __linux__
+namespace
+{
+
+// Without all of these the sender could still change the bytes under a recipient
+constexpr int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+}
+#endif
+
+auto Attachment::Supported() -> bool
+{
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+auto Attachment::Create(size_t size, const Fill& fill)
+-> tb::result<SharedAttachment, AttachmentError>
+{
+#ifdef __linux__
+    FileDescriptor fd = memfd_create("buxtehude", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return AttachmentError { AttachmentError::FILE_ERROR, errno };
+
+    // Owns fd until the attachment does
+    SharedAttachment attachment { new Attachment { fd, size } };
+
+    if (ftruncate(fd, size) < 0)
+        return AttachmentError { AttachmentError::FILE_ERROR, errno };
+
+    if (size > 0) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            return AttachmentError { AttachmentError::FILE_ERROR, errno };
+        fill({ static_cast<uint8_t*>(data), size });
+        // F_SEAL_WRITE is refused while a writable mapping exists
+        munmap(data, size);
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, REQUIRED_SEALS | F_SEAL_SEAL) < 0)
+        return AttachmentError { AttachmentError::FILE_ERROR, errno };
+
+    return attachment;
+#else
+    return AttachmentError { AttachmentError::UNSUPPORTED };
+#endif
+}
+
+auto Attachment::Create(std::span<const uint8_t> data)
+-> tb::result<SharedAttachment, AttachmentError>
+{
+    return Create(data.size(), [data] (std::span<uint8_t> out) {
+        memcpy(out.data(), data.data(), data.size());
+    });
+}
+
+auto Attachment::FromDescriptor(FileDescriptor fd)
+-> tb::result<SharedAttachment, AttachmentError>
+{
+#ifdef __linux__
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS) {
+        close(fd);
+        return AttachmentError { AttachmentError::NOT_SEALED };
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0) {
+        AttachmentError error { AttachmentError::FILE_ERROR, errno };
+        close(fd);
+        return error;
+    }
+
+    return SharedAttachment { new Attachment { fd, size_t(status.st_size) } };
+#else
+    close(fd);
+    return AttachmentError { AttachmentError::UNSUPPORTED };
+#endif
+}
+
+Attachment::Attachment(FileDescriptor fd, size_t size) : fd_(fd), size_(size) {}
+
+Attachment::~Attachment()
+{
+    if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+    close(fd_);
+}
+
+auto Attachment::Data() const -> std::span<const uint8_t>
+{
+    std::call_once(mapped_, [this] {
+        if (size_ == 0) return;
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (data != MAP_FAILED) data_ = static_cast<const uint8_t*>(data);
+    });
+
+    if (!data_) return {};
+    return { data_, size_ };
+}
+
+auto Attachment::Size() const -> size_t
+{
+    return size_;
+}
+
+auto Attachment::Descriptor() const -> FileDescriptor
+{
+    return fd_;
+}
+
+}
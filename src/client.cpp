@@ -1,9 +1,13 @@
 #include "client.hpp"
 
+#include "envelope.hpp"
+#include "executor.hpp"
 #include "server.hpp"
 #include "core.hpp"
 #include <tb/tb.h>
 
+#include <utility>
+
 #include <fmt/core.h>
 
 namespace buxtehude
@@ -17,6 +21,11 @@ Client::~Client()
         && std::this_thread::get_id() != current_thread.get_id()) {
         current_thread.join();
     }
+    // Handles what is left in it first
+    handler_pool.reset();
+
+    std::unique_lock<std::mutex> lock(internal_drains_mutex);
+    internal_drained.wait(lock, [this] { return internal_drains == 0; });
 }
 
 Client::Client(const ClientPreferences& preferences) : preferences(preferences) {}
@@ -63,6 +72,7 @@ tb::error<ConnectError> Client::IPConnect(std::string_view hostname, uint16_t po
     if (SetupEvents(client_socket).is_error())
         return ConnectError { ConnectError::LIBEVENT_ERROR };
 
+    PrepareHandshake();
     if (Handshake().is_error())
         return ConnectError { ConnectError::WRITE_ERROR };
 
@@ -77,6 +87,58 @@ tb::error<ConnectError> Client::UnixConnect(std::string_view path)
 
     conn_type = ConnectionType::UNIX;
 
+    auto socket_or_err = ConnectToFile(path);
+    if (socket_or_err.is_error()) return socket_or_err.get_error();
+
+    connected = true;
+
+    if (SetupEvents(socket_or_err.get_mut_unchecked()).is_error())
+        return ConnectError { ConnectError::LIBEVENT_ERROR };
+
+    PrepareHandshake();
+    if (Handshake().is_error())
+        return ConnectError { ConnectError::WRITE_ERROR };
+
+    StartListening();
+
+    return tb::ok;
+}
+
+tb::error<ConnectError> Client::ShmConnect(std::string_view path)
+{
+    if (connected) return ConnectError { ConnectError::ALREADY_CONNECTED };
+
+    conn_type = ConnectionType::SHM;
+
+    auto socket_or_err = ConnectToFile(path);
+    if (socket_or_err.is_error()) return socket_or_err.get_error();
+
+    connected = true;
+
+    if (SetupEvents(socket_or_err.get_mut_unchecked()).is_error())
+        return ConnectError { ConnectError::LIBEVENT_ERROR };
+
+    // Everything from the handshake on goes through shared memory
+    if (auto result = stream.ConnectShm(ebase.get()); result.is_error()) {
+        StreamError error = result.get_error();
+        logger(LogLevel::WARNING, fmt::format("Failed to set up shared memory at {}: {}",
+            path, error.What()));
+        connected = false;
+        stream.Close();
+        return ConnectError { ConnectError::SHM_ERROR };
+    }
+
+    PrepareHandshake();
+    if (Handshake().is_error())
+        return ConnectError { ConnectError::WRITE_ERROR };
+
+    StartListening();
+
+    return tb::ok;
+}
+
+tb::result<FileDescriptor, ConnectError> Client::ConnectToFile(std::string_view path)
+{
     FileDescriptor client_socket = socket(PF_LOCAL, SOCK_STREAM, 0);
     if (client_socket == INVALID_FILE_DESCRIPTOR)
         return ConnectError { ConnectError::SOCKET_ERROR, errno };
@@ -90,22 +152,14 @@ tb::error<ConnectError> Client::UnixConnect(std::string_view path)
     addr.sun_path[path_len] = '\0';
 
     if (connect(client_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(sockaddr_un))) {
+        ErrnoCode code = errno;
         logger(LogLevel::WARNING, fmt::format("Failed to connect to file {}: {}",
-            path, strerror(errno)));
-        return ConnectError { ConnectError::CONNECT_ERROR, errno };
+            path, strerror(code)));
+        close(client_socket);
+        return ConnectError { ConnectError::CONNECT_ERROR, code };
     }
 
-    connected = true;
-
-    if (SetupEvents(client_socket).is_error())
-        return ConnectError { ConnectError::LIBEVENT_ERROR };
-
-    if (Handshake().is_error())
-        return ConnectError { ConnectError::WRITE_ERROR };
-
-    StartListening();
-
-    return tb::ok;
+    return client_socket;
 }
 
 tb::error<ConnectError> Client::InternalConnect(Server& server)
@@ -114,8 +168,10 @@ tb::error<ConnectError> Client::InternalConnect(Server& server)
 
     conn_type = ConnectionType::INTERNAL;
 
+    // The server's handshake can be handled on the shared pool before this returns
+    PrepareHandshake();
     server_ptr = &server;
-    server.Internal_AddClient(*this);
+    internal_slot = server.Internal_AddClient(*this);
     connected = true;
 
     // This can only fail if the server closes between the AddClient call and
@@ -135,33 +191,243 @@ tb::error<ConnectError> Client::InternalConnect(Server& server)
 tb::error<WriteError> Client::Write(const Message& msg)
 {
     if (!connected) return WriteError {};
+    if (conn_type == ConnectionType::INTERNAL) return Write(Message { msg });
+
+    if (msg.attachment && !write_attachments) return WriteError {};
+
+    return QueueFrame(EncodedFrame::Encode(write_format, msg));
+}
+
+tb::error<WriteError> Client::Write(Message&& msg)
+{
+    if (!connected) return WriteError {};
+    if (conn_type != ConnectionType::INTERNAL) return Write(std::as_const(msg));
 
-    if (conn_type == ConnectionType::INTERNAL) {
-        if (!server_ptr) return WriteError {};
-        server_ptr.load()->Internal_ReceiveFrom(*this, msg);
+    Server* server = server_ptr;
+    if (!server) return WriteError {};
+    server->Internal_ReceiveFrom(internal_slot, std::move(msg));
+
+    return tb::ok;
+}
+
+tb::error<WriteError> Client::WriteBatch(std::span<const Message> msgs)
+{
+    if (!connected) return WriteError {};
+    if (conn_type == ConnectionType::INTERNAL || !write_batches) {
+        for (const Message& msg : msgs) {
+            if (auto result = Write(msg); result.is_error()) return result;
+        }
         return tb::ok;
     }
 
-    auto result = stream.WriteMessage(preferences.format, msg);
-    if (result.is_error()) {
-        IOError error = result.get_error();
-        if (error.type == IOError::STREAM_CLOSED) {
-            Disconnect();
+    std::vector<SharedFrame> batch;
+    size_t batch_bytes = 0;
+    auto send_batch = [this, &batch, &batch_bytes] () -> tb::error<WriteError> {
+        if (batch.empty()) return tb::ok;
+        SharedFrame frame = batch.size() == 1 ? batch.front()
+                          : EncodedFrame::Batch(batch);
+        batch.clear();
+        batch_bytes = 0;
+        return QueueFrame(std::move(frame));
+    };
+
+    for (const Message& msg : msgs) {
+        if (msg.attachment) {
+            if (auto result = send_batch(); result.is_error()) return result;
+            if (auto result = Write(msg); result.is_error()) return result;
+            continue;
         }
+
+        // BINARY frames fall back to MSGPACK for messages that do not fit the envelope
+        SharedFrame frame = EncodedFrame::Encode(write_format, msg);
+        size_t bytes = BATCH_ENTRY_HEADER_SIZE + frame->payload.size();
+        if (!batch.empty() && (batch_bytes + bytes > MAX_MESSAGE_LENGTH
+            || batch.front()->Format() != frame->Format())) {
+            if (auto result = send_batch(); result.is_error()) return result;
+        }
+        batch.emplace_back(std::move(frame));
+        batch_bytes += bytes;
+    }
+
+    return send_batch();
+}
+
+tb::result<uint32_t, WriteError> Client::StartChunked(const Message& head)
+{
+    if (!connected || conn_type == ConnectionType::INTERNAL) return WriteError {};
+
+    uint32_t stream_id = next_stream_id++;
+    SharedFrame head_frame = EncodedFrame::Encode(write_format, head);
+    std::span<const uint8_t> payload {
+        reinterpret_cast<const uint8_t*>(head_frame->payload.data()),
+        head_frame->payload.size()
+    };
+
+    auto result = QueueFrame(EncodedFrame::EncodeChunk(head_frame->Format(),
+        { stream_id, CHUNK_FIRST }, payload));
+    if (result.is_error()) return result.get_error();
+
+    return stream_id;
+}
+
+tb::error<WriteError> Client::WriteChunk(uint32_t stream_id,
+    std::span<const uint8_t> data, bool last)
+{
+    if (!connected || conn_type == ConnectionType::INTERNAL) return WriteError {};
+
+    do {
+        std::span<const uint8_t> piece = data.first(std::min(data.size(), CHUNK_SIZE));
+        data = data.subspan(piece.size());
+
+        uint8_t flags = last && data.empty() ? CHUNK_LAST : 0;
+        auto result = QueueFrame(EncodedFrame::EncodeChunk(write_format,
+            { stream_id, flags }, piece));
+        if (result.is_error()) return result;
+    } while (!data.empty());
+
+    return tb::ok;
+}
+
+void Client::Request(Message msg, ReplyHandler handler,
+    std::chrono::milliseconds timeout)
+{
+    uint64_t correlation = next_correlation++;
+    if (correlation == 0) correlation = next_correlation++; // Means no request
+    msg.correlation = correlation;
+    msg.reply = false;
+
+    {
+        // Held while the timer is set, so that it cannot go off before it is recorded
+        std::lock_guard<std::mutex> guard(pending_requests->mutex);
+        auto timer = TimerQueue::Shared().Schedule(TimerQueue::Clock::now() + timeout,
+            [pending = std::weak_ptr { pending_requests }, correlation] {
+            auto requests = pending.lock();
+            if (!requests) return;
+            if (auto request = requests->Take(correlation))
+                request->handler(RequestError { RequestError::TIMED_OUT });
+        });
+        pending_requests->requests.emplace(correlation,
+            PendingRequest { std::move(handler), timer });
+    }
+
+    if (Write(std::move(msg)).is_ok()) return;
+
+    if (auto request = pending_requests->Take(correlation)) {
+        TimerQueue::Shared().Cancel(request->timeout);
+        request->handler(RequestError { RequestError::WRITE_ERROR });
+    }
+}
+
+auto Client::Request(Message msg, std::chrono::milliseconds timeout)
+-> std::future<tb::result<Message, RequestError>>
+{
+    using Result = tb::result<Message, RequestError>;
+    auto promise = std::make_shared<std::promise<Result>>();
+    std::future<Result> future = promise->get_future();
+
+    Request(std::move(msg), [promise] (Result result) {
+        promise->set_value(std::move(result));
+    }, timeout);
+
+    return future;
+}
+
+tb::error<WriteError> Client::Reply(const Message& request, Message reply)
+{
+    // Without a requester, the request came through a server that cannot route replies
+    if (request.correlation == 0 || request.reply || request.requester == 0)
         return WriteError {};
+
+    reply.dest = request.src;
+    reply.only_first = false;
+    reply.correlation = request.correlation;
+    reply.reply = true;
+    reply.requester = request.requester;
+
+    return Write(std::move(reply));
+}
+
+void Client::CompleteRequest(Message&& reply)
+{
+    // Gone if it timed out
+    auto request = pending_requests->Take(reply.correlation);
+    if (!request) return;
+
+    TimerQueue::Shared().Cancel(request->timeout);
+    request->handler(std::move(reply));
+}
+
+void Client::FailRequests(RequestError error)
+{
+    std::unordered_map<uint64_t, PendingRequest> requests;
+    {
+        std::lock_guard<std::mutex> guard(pending_requests->mutex);
+        requests.swap(pending_requests->requests);
+    }
+
+    for (auto& [_, request] : requests) {
+        TimerQueue::Shared().Cancel(request.timeout);
+        request.handler(error);
+    }
+}
+
+auto Client::PendingRequests::Take(uint64_t correlation) -> std::optional<PendingRequest>
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    auto iter = requests.find(correlation);
+    if (iter == requests.end()) return std::nullopt;
+
+    PendingRequest request = std::move(iter->second);
+    requests.erase(iter);
+
+    return request;
+}
+
+tb::error<WriteError> Client::QueueFrame(SharedFrame frame)
+{
+    if (write_compression != Compression::NONE)
+        frame = EncodedFrame::Compress(frame, preferences.compression_threshold);
+
+    if (frame->payload.size() > MAX_MESSAGE_LENGTH) return WriteError {};
+
+    // Only the first frame since the listening thread last emptied the outbox wakes it.
+    // With a write delay, whatever is written in the meantime is sent along with it.
+    if (!outbox.Push(std::move(frame))) return tb::ok;
+
+    int64_t delay = preferences.write_delay.count();
+    if (delay <= 0) {
+        evuser_trigger(outbox_event.get());
+    } else {
+        timeval timeout = { .tv_sec = delay / 1000000, .tv_usec = delay % 1000000 };
+        event_add(outbox_event.get(), &timeout);
     }
 
     return tb::ok;
 }
 
-tb::error<WriteError> Client::Handshake()
+void Client::PrepareHandshake()
 {
     SetupDefaultHandlers();
 
+    // Older servers only accept (and send) what is in "format"
+    write_format = FallbackFormat(preferences.format);
+    write_compression = Compression::NONE;
+    write_attachments = false;
+    write_batches = false;
+}
+
+tb::error<WriteError> Client::Handshake()
+{
     return Write({
         .type { MSG_HANDSHAKE },
         .content = {
-            { "format", preferences.format },
+            { "attachments",
+                conn_type == ConnectionType::UNIX && Attachment::Supported() },
+            { "batches", true },
+            { "capacity", preferences.capacity },
+            { "compression", preferences.compression },
+            { "format", FallbackFormat(preferences.format) },
+            { "preferred_format", preferences.format },
             { "teamname", preferences.teamname },
             { "version", CURRENT_VERSION },
         }
@@ -177,6 +443,19 @@ void Client::SetupDefaultHandlers()
             return;
         }
 
+        if (m.content["version"] >= BINARY_FORMAT_VERSION)
+            c.write_format = c.preferences.format;
+        if (c.preferences.compression != Compression::NONE
+            && ValidateJSON(m.content, VALIDATE_COMPRESSION)
+            && m.content["compression"] == c.preferences.compression) {
+            c.write_compression = c.preferences.compression;
+        }
+        c.write_attachments = c.conn_type == ConnectionType::UNIX
+            && ValidateJSON(m.content, VALIDATE_ATTACHMENTS)
+            && m.content["attachments"] == true;
+        c.write_batches = ValidateJSON(m.content, VALIDATE_BATCHES)
+            && m.content["batches"] == true;
+
         c.EraseHandler(std::string { MSG_HANDSHAKE });
     });
 
@@ -209,24 +488,126 @@ void Client::HandleMessage(const Message& msg)
         return;
     }
 
-    if (handlers.contains(msg.type)) handlers[msg.type](*this, msg);
+    // Copied out, so that a handler can add or erase handlers, itself included
+    Handler handler;
+    {
+        std::shared_lock<std::shared_mutex> lock(handlers_mutex);
+        auto iter = handlers.find(msg.type);
+        if (iter == handlers.end()) return;
+        handler = iter->second;
+    }
+    handler(*this, msg);
+}
+
+void Client::QueueHandler(Message&& msg)
+{
+    if (msg.reply) {
+        CompleteRequest(std::move(msg));
+        return;
+    }
+
+    // Server messages change the client's own state, which handlers must not race
+    if (!handler_pool || msg.type.starts_with("$$")) {
+        HandleMessage(msg);
+        return;
+    }
+
+    if (preferences.handler_ordering == HandlerOrdering::NONE) {
+        handler_pool->Submit([this, msg = std::move(msg)] { HandleMessage(msg); });
+        return;
+    }
+
+    std::string key = preferences.handler_ordering == HandlerOrdering::PER_TYPE
+        ? msg.type : msg.src;
+    {
+        std::lock_guard<std::mutex> guard(handler_queues_mutex);
+        auto [iter, inserted] = handler_queues.try_emplace(key);
+        iter->second.push_back(std::move(msg));
+        // Otherwise the task already working through the key's queue takes it
+        if (!inserted) return;
+    }
+
+    handler_pool->Submit([this, key = std::move(key)] { RunHandlers(key); });
+}
+
+void Client::RunHandlers(const std::string& key)
+{
+    while (true) {
+        std::optional<Message> msg;
+        {
+            std::lock_guard<std::mutex> guard(handler_queues_mutex);
+            auto iter = handler_queues.find(key);
+            if (iter->second.empty()) {
+                handler_queues.erase(iter);
+                return;
+            }
+            msg = std::move(iter->second.front());
+            iter->second.pop_front();
+        }
+        HandleMessage(*msg);
+    }
+}
+
+void Client::HandleChunk(ChunkHeader header, const Message* head,
+    std::span<const uint8_t> data)
+{
+    if (header.flags & CHUNK_FIRST) {
+        if (!head) return;
+        chunk_heads.insert_or_assign(header.stream_id, *head);
+    }
+
+    auto iter = chunk_heads.find(header.stream_id);
+    if (iter == chunk_heads.end()) return;
+
+    const Message& message = iter->second;
+    ChunkHandler handler;
+    {
+        std::shared_lock<std::shared_mutex> lock(handlers_mutex);
+        auto handler_iter = chunk_handlers.find(message.type);
+        if (handler_iter != chunk_handlers.end()) handler = handler_iter->second;
+    }
+    if (handler) {
+        handler(*this, message, {
+            .data = data,
+            .first = bool(header.flags & CHUNK_FIRST),
+            .last = bool(header.flags & CHUNK_LAST),
+            .aborted = bool(header.flags & CHUNK_ABORTED)
+        });
+    }
+
+    if (header.flags & (CHUNK_LAST | CHUNK_ABORTED)) chunk_heads.erase(header.stream_id);
 }
 
 // Handlers
 
 void Client::AddHandler(std::string_view type, Handler&& h)
 {
+    std::lock_guard<std::shared_mutex> lock(handlers_mutex);
     handlers.emplace(type, std::forward<Handler>(h));
 }
 
+void Client::AddChunkHandler(std::string_view type, ChunkHandler&& h)
+{
+    std::lock_guard<std::shared_mutex> lock(handlers_mutex);
+    chunk_handlers.emplace(type, std::move(h));
+}
+
 void Client::SetDisconnectHandler(DisconnectHandler&& h)
 {
     disconnect_handler = std::move(h);
 }
 
-void Client::EraseHandler(const std::string& type) { handlers.erase(type); }
+void Client::EraseHandler(const std::string& type)
+{
+    std::lock_guard<std::shared_mutex> lock(handlers_mutex);
+    handlers.erase(type);
+}
 
-void Client::ClearHandlers() { handlers.clear(); }
+void Client::ClearHandlers()
+{
+    std::lock_guard<std::shared_mutex> lock(handlers_mutex);
+    handlers.clear();
+}
 
 bool Client::Connected() const { return connected; }
 
@@ -234,7 +615,13 @@ void Client::StartListening()
 {
     if (conn_type != ConnectionType::INTERNAL) {
         if (current_thread.joinable()) current_thread.join();
+        if (preferences.handler_threads && !handler_pool)
+            handler_pool = std::make_unique<HandlerPool>(preferences.handler_threads);
         current_thread = std::thread(&Client::Listen, this);
+    } else if (preferences.executor == InternalExecutor::OWN_THREAD) {
+        // Ends once it has handled the previous connection's DISCONNECTED
+        if (current_thread.joinable()) current_thread.join();
+        current_thread = std::thread(&Client::Internal_Run, this);
     }
 }
 
@@ -247,8 +634,12 @@ void Client::Disconnect()
 
     if (conn_type != ConnectionType::INTERNAL) {
         evuser_trigger(interrupt_event.get());
-    } else if (conn_type == ConnectionType::INTERNAL && server_ptr) {
-        server_ptr.load()->Internal_RemoveClient(*this);
+        FailRequests({ RequestError::DISCONNECTED });
+    } else {
+        if (server_ptr) server_ptr.load()->Internal_RemoveClient(*this);
+        // Handled by the executor, after the messages already queued
+        Internal_Post({ .type = InternalDelivery::DISCONNECTED });
+        return;
     }
 
     if (disconnect_handler) disconnect_handler(*this);
@@ -260,14 +651,80 @@ void Client::Internal_Disconnect()
     connected = false;
     server_ptr = nullptr;
     logger(LogLevel::DEBUG, "Disconnecting client");
-    if (disconnect_handler) disconnect_handler(*this);
+    Internal_Post({ .type = InternalDelivery::DISCONNECTED });
 }
 
 // INTERNAL clients only
 
-void Client::Internal_Receive(const Message& msg)
+void Client::Internal_Receive(std::shared_ptr<const Message> msg)
+{
+    Internal_Post({ .type = InternalDelivery::MESSAGE, .message = std::move(msg) });
+}
+
+void Client::Internal_ReceiveChunk(ChunkHeader header,
+    std::shared_ptr<const Message> head, std::span<const uint8_t> data)
+{
+    // The server's buffer is reused once this returns
+    Internal_Post({
+        .type = InternalDelivery::CHUNK,
+        .message = std::move(head),
+        .header = header,
+        .data = { data.begin(), data.end() }
+    });
+}
+
+void Client::Internal_Post(InternalDelivery&& delivery)
+{
+    // Only the first delivery since the executor last drained the queue wakes it up
+    if (!internal_inbox.Push(std::move(delivery))) return;
+
+    if (preferences.executor == InternalExecutor::OWN_THREAD) {
+        internal_ready.release();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(internal_drains_mutex);
+        ++internal_drains;
+    }
+    HandlerPool::Shared().Submit([this] {
+        Internal_Drain();
+
+        std::lock_guard<std::mutex> guard(internal_drains_mutex);
+        if (--internal_drains == 0) internal_drained.notify_all();
+    });
+}
+
+bool Client::Internal_Drain()
+{
+    std::lock_guard<std::mutex> guard(internal_drain_mutex);
+
+    bool disconnected = false;
+    internal_inbox.Drain([this, &disconnected] (InternalDelivery&& delivery) {
+        switch (delivery.type) {
+        case InternalDelivery::MESSAGE:
+            if (delivery.message->reply) CompleteRequest(Message { *delivery.message });
+            else HandleMessage(*delivery.message);
+            break;
+        case InternalDelivery::CHUNK:
+            HandleChunk(delivery.header, delivery.message.get(), delivery.data);
+            break;
+        case InternalDelivery::DISCONNECTED:
+            // Replies queued before this have been handed over already
+            FailRequests({ RequestError::DISCONNECTED });
+            if (disconnect_handler) disconnect_handler(*this);
+            disconnected = true;
+            break;
+        }
+    });
+
+    return !disconnected;
+}
+
+void Client::Internal_Run()
 {
-    HandleMessage(msg);
+    do internal_ready.acquire();
+    while (Internal_Drain());
 }
 
 // Socket-based connections only
@@ -275,53 +732,114 @@ void Client::Internal_Receive(const Message& msg)
 tb::error<AllocError> Client::SetupEvents(FileDescriptor socket)
 {
     ebase = make<UEventBase>(event_base_new());
-    callback_data.event_base = ebase.get();
+    event_handler = [this] (const Event& event) { HandleEvent(event); };
 
     interrupt_event = make<UEvent>(
         event_new(
             ebase.get(), INVALID_FILE_DESCRIPTOR, EV_PERSIST,
-            callbacks::LoopInterruptCallback, &callback_data
+            callbacks::LoopInterruptCallback, &event_handler
         )
     );
 
-    if (!ebase || !interrupt_event) {
+    outbox_event = make<UEvent>(
+        evuser_new(ebase.get(), callbacks::OutboxCallback, &event_handler)
+    );
+
+    if (!ebase || !interrupt_event || !outbox_event) {
         logger(LogLevel::WARNING, "Failed to create one or more libevent structures");
         return AllocError {};
     }
 
-    auto stream_or_err = Stream::FromSocket(socket, ebase.get(), callback_data);
+    auto stream_or_err = Stream::FromSocket(socket, ebase.get(), event_handler);
     if (stream_or_err.is_error())
         return AllocError {};
 
     stream = std::move(stream_or_err.get_mut_unchecked());
+    // Left over from the last connection, and not meant for this one
+    outbox.Drain([] (SharedFrame&&) {});
 
     return tb::ok;
 }
 
+void Client::FlushWrites()
+{
+    stream.Flush().if_err([this] (IOError error) {
+        if (error.type == IOError::STREAM_CLOSED)
+            Disconnect();
+    });
+}
+
+void Client::SendOutbox()
+{
+    event_del(outbox_event.get());
+    outbox.Drain([this] (SharedFrame&& frame) {
+        // Can't fail, QueueFrame() turns away frames that are too long
+        stream.AppendFrame(std::move(frame)).ignore_error();
+    });
+    FlushWrites();
+}
+
 void Client::Listen()
 {
-    while (event_base_dispatch(ebase.get()) == 0) {
-        switch (callback_data.type) {
-        case EventType::READ_READY:
-            stream.ReadMessage().if_ok_mut([this] (const Message& msg) {
-                HandleMessage(msg);
-            }).if_err([this] (StreamError error) {
-                if (error.type == StreamError::IO_ERROR
-                    && error.io_error.type == IOError::STREAM_CLOSED)
-                    Disconnect();
-            });
-            break;
-        case EventType::INTERRUPT:
-            return;
-        case EventType::WRITE_READY:
-            stream.Flush().if_err([this] (IOError error) {
-                if (error.type == IOError::STREAM_CLOSED)
-                    Disconnect();
-            });
-            break;
-        default:
-            break;
-        }
+    event_base_loop(ebase.get(), EVLOOP_NO_EXIT_ON_EMPTY);
+}
+
+void Client::HandleEvent(const Event& event)
+{
+    switch (event.type) {
+    case EventType::READ_READY:
+        // Over shared memory this also means the server has made room to write
+        if (conn_type == ConnectionType::SHM) FlushWrites();
+
+        stream.ReadFrames([this] (MessageFormat format, uint8_t flags,
+            std::span<const uint8_t> data, SharedAttachment attachment) {
+            if (!connected) return;
+
+            if (flags & FRAME_BATCH) {
+                SplitBatch(data, [this, format] (std::span<const uint8_t> entry) {
+                    if (auto msg = DecodeMessage(format, entry))
+                        QueueHandler(std::move(*msg));
+                });
+                return;
+            }
+
+            if (!(flags & FRAME_CHUNK)) {
+                if (auto msg = DecodeMessage(format, data)) {
+                    msg->attachment = std::move(attachment);
+                    QueueHandler(std::move(*msg));
+                }
+                return;
+            }
+
+            std::optional<ChunkHeader> header = ChunkHeader::Parse(data);
+            if (!header) return;
+            data = data.subspan(CHUNK_HEADER_SIZE);
+
+            std::optional<Message> head;
+            if (header->flags & CHUNK_FIRST) {
+                head = DecodeMessage(format, data);
+                data = {};
+            }
+            HandleChunk(*header, head ? &*head : nullptr, data);
+        }).if_err([this] (StreamError error) {
+            if (error.type == StreamError::IO_ERROR
+                && error.io_error.type == IOError::STREAM_CLOSED)
+                Disconnect();
+        });
+        break;
+    case EventType::INTERRUPT:
+        // What was written before disconnecting, in case a write delay held it back
+        SendOutbox();
+        event_base_loopbreak(ebase.get());
+        break;
+    case EventType::WRITE_READY:
+        FlushWrites();
+        break;
+    case EventType::OUTBOX_READY:
+        SendOutbox();
+        break;
+    default:
+        break;
     }
 }
 
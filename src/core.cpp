@@ -17,6 +17,10 @@ void to_json(json& j, const Message& msg)
     j = { { "type", msg.type }, { "only_first", msg.only_first } };
     if (!msg.dest.empty()) j["dest"] = msg.dest;
     if (!msg.src.empty()) j["src"] = msg.src;
+    if (!msg.key.empty()) j["key"] = msg.key;
+    if (msg.correlation) j["correlation"] = msg.correlation;
+    if (msg.reply) j["reply"] = true;
+    if (msg.requester) j["requester"] = msg.requester;
     if (!msg.content.empty()) j["content"] = msg.content;
 }
 
@@ -26,6 +30,10 @@ void from_json(const json& j, Message& msg)
     if (j.contains("src")) j["src"].get_to(msg.src);
     if (j.contains("type")) j["type"].get_to(msg.type);
     if (j.contains("only_first")) j["only_first"].get_to(msg.only_first);
+    if (j.contains("key")) j["key"].get_to(msg.key);
+    if (j.contains("correlation")) j["correlation"].get_to(msg.correlation);
+    if (j.contains("reply")) j["reply"].get_to(msg.reply);
+    if (j.contains("requester")) j["requester"].get_to(msg.requester);
     if (j.contains("content")) j["content"].get_to(msg.content);
 }
 
@@ -68,46 +76,40 @@ namespace callbacks
 void ConnectionCallback(evconnlistener* listener, evutil_socket_t fd,
     sockaddr* addr, int addr_len, void* data)
 {
-    auto* ecdata = static_cast<EventCallbackData*>(data);
-
-    ecdata->socket = fd;
-    ecdata->address = *addr;
-    ecdata->address_length = addr_len;
-    ecdata->type = EventType::NEW_CONNECTION;
-
-    event_base_loopbreak(ecdata->event_base);
-
-    // If there is a queue of connections, these callbacks will run in succession
-    // even with a call to event_base_loopbreak(). Disabling the listener will
-    // break out of the listener accept(2) loop. The listener is re-enabled after
-    // accepting the connection in Server::AddConnection().
-    evconnlistener_disable(listener);
+    // evconnlistener keeps accepting until the backlog is empty, so a whole queue of
+    // connections is taken in one wakeup
+    (*static_cast<EventHandler*>(data))({
+        .type = EventType::NEW_CONNECTION, .socket = fd, .listener = listener
+    });
 }
 
 void ReadWriteCallback(evutil_socket_t fd, short what, void* data)
 {
-    auto* ecdata = static_cast<EventCallbackData*>(data);
-
-    ecdata->socket = fd;
-    if (what & EV_READ) ecdata->type = EventType::READ_READY;
-    else if (what & EV_WRITE) ecdata->type = EventType::WRITE_READY;
-    else if (what & EV_TIMEOUT) ecdata->type = EventType::TIMEOUT;
+    EventType type = EventType::TIMEOUT;
+    if (what & EV_READ) type = EventType::READ_READY;
+    else if (what & EV_WRITE) type = EventType::WRITE_READY;
 
-    event_base_loopbreak(ecdata->event_base);
+    (*static_cast<EventHandler*>(data))({ .type = type });
 }
 
 void LoopInterruptCallback(evutil_socket_t fd, short what, void* data)
 {
-    auto* ecdata = static_cast<EventCallbackData*>(data);
-    ecdata->type = EventType::INTERRUPT;
-    event_base_loopbreak(ecdata->event_base);
+    (*static_cast<EventHandler*>(data))({ .type = EventType::INTERRUPT });
 }
 
 void InternalReadCallback(evutil_socket_t fd, short what, void* data)
 {
-    auto* ecdata = static_cast<EventCallbackData*>(data);
-    ecdata->type = EventType::INTERNAL_READ_READY;
-    event_base_loopbreak(ecdata->event_base);
+    (*static_cast<EventHandler*>(data))({ .type = EventType::INTERNAL_READ_READY });
+}
+
+void InboxCallback(evutil_socket_t fd, short what, void* data)
+{
+    (*static_cast<EventHandler*>(data))({ .type = EventType::INBOX_READY });
+}
+
+void OutboxCallback(evutil_socket_t fd, short what, void* data)
+{
+    (*static_cast<EventHandler*>(data))({ .type = EventType::OUTBOX_READY });
 }
 
 }
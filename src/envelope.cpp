@@ -0,0 +1,782 @@
+#include "envelope.hpp"
+
+#include <cstring>
+
+namespace buxtehude
+{
+
+namespace
+{
+
+// Envelope fields, as both scanners find them
+struct EnvelopeFields
+{
+    std::string dest, src, type;
+    bool only_first = false;
+    std::string key;
+    uint64_t correlation = 0, requester = 0;
+    bool reply = false;
+    std::span<const uint8_t> content;
+};
+
+// JSON
+
+class JSONScanner
+{
+public:
+    JSONScanner(std::span<const uint8_t> data) : data_(data) {}
+
+    auto Scan(EnvelopeFields& fields) -> bool
+    {
+        SkipWhitespace();
+        if (!Consume('{')) return false;
+
+        SkipWhitespace();
+        if (!Consume('}')) {
+            do {
+                SkipWhitespace();
+                std::string key;
+                if (!ReadString(key)) return false;
+
+                SkipWhitespace();
+                if (!Consume(':')) return false;
+                SkipWhitespace();
+
+                bool valid;
+                if (key == "type") valid = ReadString(fields.type);
+                else if (key == "dest") valid = ReadString(fields.dest);
+                else if (key == "src") valid = ReadString(fields.src);
+                else if (key == "only_first") valid = ReadBool(fields.only_first);
+                else if (key == "key") valid = ReadString(fields.key);
+                else if (key == "reply") valid = ReadBool(fields.reply);
+                else if (key == "correlation")
+                    valid = ReadUnsigned(fields.correlation);
+                else if (key == "requester") valid = ReadUnsigned(fields.requester);
+                else if (key == "content") {
+                    size_t start = pos_;
+                    valid = SkipValue();
+                    fields.content = data_.subspan(start, pos_ - start);
+                } else valid = SkipValue();
+
+                if (!valid) return false;
+                SkipWhitespace();
+            } while (Consume(','));
+
+            if (!Consume('}')) return false;
+        }
+
+        SkipWhitespace();
+        return pos_ == data_.size();
+    }
+
+private:
+    auto Peek() const -> int
+    {
+        return pos_ < data_.size() ? data_[pos_] : -1;
+    }
+
+    auto Consume(char c) -> bool
+    {
+        if (Peek() != c) return false;
+        ++pos_;
+        return true;
+    }
+
+    void SkipWhitespace()
+    {
+        while (Peek() == ' ' || Peek() == '\t' || Peek() == '\n' || Peek() == '\r')
+            ++pos_;
+    }
+
+    // Moves past a string, returning whether it contained escape sequences
+    auto SkipString(bool& escaped) -> bool
+    {
+        escaped = false;
+        if (!Consume('"')) return false;
+
+        while (pos_ < data_.size()) {
+            uint8_t c = data_[pos_++];
+            if (c == '"') return true;
+            if (c == '\\') {
+                escaped = true;
+                ++pos_;
+            }
+        }
+
+        return false;
+    }
+
+    auto ReadString(std::string& out) -> bool
+    {
+        size_t start = pos_;
+        bool escaped;
+        if (!SkipString(escaped)) return false;
+
+        auto token = data_.subspan(start, pos_ - start);
+        if (!escaped) {
+            out.assign(token.begin() + 1, token.end() - 1);
+            return true;
+        }
+
+        // Rare enough that it is not worth unescaping by hand
+        json decoded = json::parse(token, nullptr, false);
+        if (!decoded.is_string()) return false;
+        out = decoded.get<std::string>();
+
+        return true;
+    }
+
+    auto ReadUnsigned(uint64_t& out) -> bool
+    {
+        size_t start = pos_;
+        out = 0;
+        while (Peek() >= '0' && Peek() <= '9') {
+            uint64_t digit = data_[pos_++] - '0';
+            if (out > (UINT64_MAX - digit) / 10) return false;
+            out = out * 10 + digit;
+        }
+
+        return pos_ > start;
+    }
+
+    auto ReadBool(bool& out) -> bool
+    {
+        constexpr std::string_view TRUE = "true", FALSE = "false";
+        auto rest = data_.subspan(pos_);
+        auto starts_with = [&rest] (std::string_view word) {
+            return rest.size() >= word.size()
+                && memcmp(rest.data(), word.data(), word.size()) == 0;
+        };
+
+        if (starts_with(TRUE)) {
+            out = true;
+            pos_ += TRUE.size();
+        } else if (starts_with(FALSE)) {
+            out = false;
+            pos_ += FALSE.size();
+        } else return false;
+
+        return true;
+    }
+
+    auto SkipValue() -> bool
+    {
+        bool escaped;
+        switch (Peek()) {
+        case '"':
+            return SkipString(escaped);
+        case '{': case '[': {
+            std::string closers;
+            while (pos_ < data_.size()) {
+                switch (data_[pos_]) {
+                case '"':
+                    if (!SkipString(escaped)) return false;
+                    continue;
+                case '{': closers.push_back('}'); break;
+                case '[': closers.push_back(']'); break;
+                case '}': case ']':
+                    if (closers.empty() || closers.back() != data_[pos_]) return false;
+                    closers.pop_back();
+                    if (closers.empty()) {
+                        ++pos_;
+                        return true;
+                    }
+                    break;
+                }
+                ++pos_;
+            }
+            return false;
+        }
+        default: {
+            // Numbers and literals run until the next delimiter
+            size_t start = pos_;
+            while (pos_ < data_.size()) {
+                uint8_t c = data_[pos_];
+                if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\t'
+                    || c == '\n' || c == '\r') break;
+                ++pos_;
+            }
+            return pos_ > start;
+        }
+        }
+    }
+
+    std::span<const uint8_t> data_;
+    size_t pos_ = 0;
+};
+
+// Binary envelope
+
+auto ScanBinary(std::span<const uint8_t> data, EnvelopeFields& fields) -> bool
+{
+    constexpr uint8_t KNOWN_FLAGS = ENVELOPE_ONLY_FIRST | ENVELOPE_KEY
+        | ENVELOPE_CORRELATION | ENVELOPE_REPLY | ENVELOPE_REQUESTER;
+    if (data.empty() || (data[0] & ~KNOWN_FLAGS)) return false;
+    fields.only_first = data[0] & ENVELOPE_ONLY_FIRST;
+    fields.reply = data[0] & ENVELOPE_REPLY;
+    bool has_key = data[0] & ENVELOPE_KEY;
+    bool has_correlation = data[0] & ENVELOPE_CORRELATION;
+    bool has_requester = data[0] & ENVELOPE_REQUESTER;
+    data = data.subspan(1);
+
+    auto read_field = [&data] (std::string& field) {
+        if (data.size() < sizeof(uint16_t)) return false;
+        size_t length = data[0] | (data[1] << 8);
+        data = data.subspan(sizeof(uint16_t));
+
+        if (data.size() < length) return false;
+        field.assign(data.begin(), data.begin() + length);
+        data = data.subspan(length);
+        return true;
+    };
+
+    for (std::string* field : { &fields.type, &fields.dest, &fields.src })
+        if (!read_field(*field)) return false;
+    if (has_key && !read_field(fields.key)) return false;
+
+    auto read_id = [&data] (uint64_t& id) {
+        if (data.size() < sizeof(uint64_t)) return false;
+        for (size_t i = 0; i < sizeof(uint64_t); ++i)
+            id |= uint64_t { data[i] } << (8 * i);
+        data = data.subspan(sizeof(uint64_t));
+        return true;
+    };
+
+    if (has_correlation && !read_id(fields.correlation)) return false;
+    if (has_requester && !read_id(fields.requester)) return false;
+
+    fields.content = data;
+
+    return true;
+}
+
+// MessagePack
+
+// Maps of up to this many entries have their count in their first byte
+constexpr size_t MAX_FIXMAP_ENTRIES = 15;
+
+class MsgPackScanner
+{
+public:
+    MsgPackScanner(std::span<const uint8_t> data) : data_(data) {}
+
+    auto Scan(EnvelopeFields& fields) -> bool
+    {
+        uint64_t entries;
+        if (!ReadMapHeader(entries)) return false;
+
+        for (uint64_t i = 0; i < entries; ++i) {
+            std::string key;
+            if (!ReadString(key)) return false;
+
+            bool valid;
+            if (key == "type") valid = ReadString(fields.type);
+            else if (key == "dest") valid = ReadString(fields.dest);
+            else if (key == "src") valid = ReadString(fields.src);
+            else if (key == "only_first") valid = ReadBool(fields.only_first);
+            else if (key == "key") valid = ReadString(fields.key);
+            else if (key == "correlation") valid = ReadUnsigned(fields.correlation);
+            else if (key == "reply") valid = ReadBool(fields.reply);
+            else if (key == "requester") valid = ReadUnsigned(fields.requester);
+            else if (key == "content") {
+                size_t start = pos_;
+                valid = SkipValue();
+                fields.content = data_.subspan(start, pos_ - start);
+            } else valid = SkipValue();
+
+            if (!valid) return false;
+        }
+
+        return pos_ == data_.size();
+    }
+
+private:
+    // Big-endian unsigned integer of `bytes` bytes
+    auto ReadUint(size_t bytes, uint64_t& out) -> bool
+    {
+        if (data_.size() - pos_ < bytes) return false;
+
+        out = 0;
+        for (size_t i = 0; i < bytes; ++i) out = (out << 8) | data_[pos_++];
+
+        return true;
+    }
+
+    // Any unsigned integer value
+    auto ReadUnsigned(uint64_t& out) -> bool
+    {
+        if (pos_ == data_.size()) return false;
+
+        uint8_t marker = data_[pos_++];
+        if (marker <= 0x7f) {
+            out = marker;
+            return true;
+        }
+        if (marker >= 0xcc && marker <= 0xcf) return ReadUint(1 << (marker - 0xcc), out);
+
+        return false;
+    }
+
+    auto Skip(uint64_t bytes) -> bool
+    {
+        if (data_.size() - pos_ < bytes) return false;
+        pos_ += bytes;
+
+        return true;
+    }
+
+    auto ReadMapHeader(uint64_t& entries) -> bool
+    {
+        if (pos_ == data_.size()) return false;
+
+        uint8_t marker = data_[pos_++];
+        if ((marker & 0xf0) == 0x80) {
+            entries = marker & 0x0f;
+            return true;
+        }
+        if (marker == 0xde) return ReadUint(2, entries);
+        if (marker == 0xdf) return ReadUint(4, entries);
+
+        return false;
+    }
+
+    auto ReadString(std::string& out) -> bool
+    {
+        if (pos_ == data_.size()) return false;
+
+        uint8_t marker = data_[pos_++];
+        uint64_t length;
+        if ((marker & 0xe0) == 0xa0) length = marker & 0x1f;
+        else if (marker == 0xd9) { if (!ReadUint(1, length)) return false; }
+        else if (marker == 0xda) { if (!ReadUint(2, length)) return false; }
+        else if (marker == 0xdb) { if (!ReadUint(4, length)) return false; }
+        else return false;
+
+        size_t start = pos_;
+        if (!Skip(length)) return false;
+        out.assign(data_.begin() + start, data_.begin() + pos_);
+
+        return true;
+    }
+
+    auto ReadBool(bool& out) -> bool
+    {
+        if (pos_ == data_.size()) return false;
+
+        uint8_t marker = data_[pos_++];
+        if (marker != 0xc2 && marker != 0xc3) return false;
+        out = marker == 0xc3;
+
+        return true;
+    }
+
+    // Skips one complete value, nested containers included, without recursing
+    auto SkipValue() -> bool
+    {
+        uint64_t pending = 1;
+
+        while (pending > 0) {
+            --pending;
+            if (pos_ == data_.size()) return false;
+
+            uint8_t marker = data_[pos_++];
+            uint64_t length;
+
+            if (marker <= 0x7f || marker >= 0xe0) continue; // fixint
+            if (marker <= 0x8f) { pending += 2 * (marker & 0x0f); continue; } // fixmap
+            if (marker <= 0x9f) { pending += marker & 0x0f; continue; } // fixarray
+            if (marker <= 0xbf) { // fixstr
+                if (!Skip(marker & 0x1f)) return false;
+                continue;
+            }
+
+            switch (marker) {
+            case 0xc0: case 0xc2: case 0xc3: // nil, false, true
+                break;
+            case 0xc4: case 0xc5: case 0xc6: // bin 8/16/32
+                if (!ReadUint(1 << (marker - 0xc4), length) || !Skip(length))
+                    return false;
+                break;
+            case 0xc7: case 0xc8: case 0xc9: // ext 8/16/32, plus the type byte
+                if (!ReadUint(1 << (marker - 0xc7), length) || !Skip(length + 1))
+                    return false;
+                break;
+            case 0xca: if (!Skip(4)) return false; break; // float 32
+            case 0xcb: if (!Skip(8)) return false; break; // float 64
+            case 0xcc: case 0xcd: case 0xce: case 0xcf: // uint 8/16/32/64
+                if (!Skip(1 << (marker - 0xcc))) return false;
+                break;
+            case 0xd0: case 0xd1: case 0xd2: case 0xd3: // int 8/16/32/64
+                if (!Skip(1 << (marker - 0xd0))) return false;
+                break;
+            case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: // fixext 1-16
+                if (!Skip(1 + (1 << (marker - 0xd4)))) return false;
+                break;
+            case 0xd9: case 0xda: case 0xdb: // str 8/16/32
+                if (!ReadUint(1 << (marker - 0xd9), length) || !Skip(length))
+                    return false;
+                break;
+            case 0xdc: case 0xdd: // array 16/32
+                if (!ReadUint(marker == 0xdc ? 2 : 4, length)) return false;
+                pending += length;
+                break;
+            case 0xde: case 0xdf: // map 16/32
+                if (!ReadUint(marker == 0xde ? 2 : 4, length)) return false;
+                pending += 2 * length;
+                break;
+            default: // 0xc1 is never used
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::span<const uint8_t> data_;
+    size_t pos_ = 0;
+};
+
+auto DecodeContent(MessageFormat format, std::string_view raw) -> json
+{
+    json content;
+    switch (format) {
+    case MessageFormat::JSON:
+        content = json::parse(raw, nullptr, false);
+        break;
+    case MessageFormat::MSGPACK:
+    case MessageFormat::BINARY: // BINARY content is MessagePack
+        content = json::from_msgpack(raw, true, false);
+        break;
+    }
+
+    if (content.is_discarded()) return nullptr;
+
+    return content;
+}
+
+}
+
+auto AppendBinaryEnvelope(std::string& payload, std::string_view type,
+    std::string_view dest, std::string_view src, bool only_first, std::string_view key,
+    uint64_t correlation, bool reply, uint64_t requester) -> bool
+{
+    for (std::string_view field : { type, dest, src, key })
+        if (field.size() > MAX_ENVELOPE_FIELD_LENGTH) return false;
+
+    auto append_field = [&payload] (std::string_view field) {
+        // Little-endian, like the frame length
+        payload.push_back(field.size() & 0xff);
+        payload.push_back(field.size() >> 8);
+        payload.append(field);
+    };
+
+    payload.push_back((only_first ? ENVELOPE_ONLY_FIRST : 0)
+        | (key.empty() ? 0 : ENVELOPE_KEY)
+        | (correlation ? ENVELOPE_CORRELATION : 0)
+        | (reply ? ENVELOPE_REPLY : 0)
+        | (requester ? ENVELOPE_REQUESTER : 0));
+    for (std::string_view field : { type, dest, src }) append_field(field);
+    if (!key.empty()) append_field(key);
+    for (uint64_t id : { correlation, requester }) {
+        for (int shift = 0; id && shift < 64; shift += 8) payload.push_back(id >> shift);
+    }
+
+    return true;
+}
+
+auto DecodeMessage(MessageFormat format, std::span<const uint8_t> data)
+-> std::optional<Message>
+{
+    json object;
+    switch (format) {
+    case MessageFormat::JSON:
+        object = json::parse(data, nullptr, false);
+        break;
+    case MessageFormat::MSGPACK:
+        object = json::from_msgpack(data, true, false);
+        break;
+    case MessageFormat::BINARY: {
+        auto message = LazyMessage::Scan(format, data);
+        if (message.is_error()) return std::nullopt;
+        return std::move(message.get_mut_unchecked()).ToMessage();
+    }
+    }
+
+    if (object.is_discarded()) return std::nullopt;
+
+    return object.get<Message>();
+}
+
+// LazyMessage
+
+LazyMessage::LazyMessage(Message&& message)
+    : dest(std::move(message.dest)), src(std::move(message.src)),
+      type(std::move(message.type)), only_first(message.only_first),
+      key(std::move(message.key)), correlation(message.correlation),
+      reply(message.reply), requester(message.requester),
+      attachment(std::move(message.attachment)),
+      content_(std::move(message.content)) {}
+
+LazyMessage::LazyMessage(const Message& message)
+    : dest(message.dest), src(message.src), type(message.type),
+      only_first(message.only_first), key(message.key),
+      correlation(message.correlation), reply(message.reply),
+      requester(message.requester), attachment(message.attachment),
+      content_(message.content) {}
+
+auto LazyMessage::Scan(MessageFormat format, std::span<const uint8_t> data)
+-> tb::result<LazyMessage, StreamError>
+{
+    EnvelopeFields fields;
+
+    bool valid = false;
+    switch (format) {
+    case MessageFormat::JSON:
+        valid = JSONScanner { data }.Scan(fields);
+        break;
+    case MessageFormat::MSGPACK:
+        valid = MsgPackScanner { data }.Scan(fields);
+        break;
+    case MessageFormat::BINARY:
+        valid = ScanBinary(data, fields);
+        break;
+    }
+
+    if (!valid) return StreamError { StreamError::PARSE_ERROR };
+
+    LazyMessage message;
+    message.dest = std::move(fields.dest);
+    message.src = std::move(fields.src);
+    message.type = std::move(fields.type);
+    message.only_first = fields.only_first;
+    message.key = std::move(fields.key);
+    message.correlation = fields.correlation;
+    message.reply = fields.reply;
+    message.requester = fields.requester;
+    message.raw_content_.assign(fields.content.begin(), fields.content.end());
+    message.raw_format_ = FallbackFormat(format);
+
+    return message;
+}
+
+auto LazyMessage::Content() -> const json&
+{
+    if (!content_) {
+        content_ = raw_content_.empty() ? json {}
+                 : DecodeContent(raw_format_, raw_content_);
+    }
+
+    return *content_;
+}
+
+auto LazyMessage::ToMessage() & -> Message
+{
+    return {
+        .type = type,
+        .dest = dest,
+        .src = src,
+        .content = Content(),
+        .only_first = only_first,
+        .key = key,
+        .correlation = correlation,
+        .reply = reply,
+        .requester = requester,
+        .attachment = attachment
+    };
+}
+
+auto LazyMessage::ToMessage() && -> Message
+{
+    Content();
+
+    return {
+        .type = std::move(type),
+        .dest = std::move(dest),
+        .src = std::move(src),
+        .content = std::move(*content_),
+        .only_first = only_first,
+        .key = std::move(key),
+        .correlation = correlation,
+        .reply = reply,
+        .requester = requester,
+        .attachment = std::move(attachment)
+    };
+}
+
+auto LazyMessage::HasRawContent() const -> bool
+{
+    return !raw_content_.empty();
+}
+
+auto LazyMessage::Encode(MessageFormat format) -> SharedFrame
+{
+    // Content in the encoding it arrived in is used as it is, anything else is
+    // transcoded. An empty string means there is no content to send.
+    MessageFormat content_format = FallbackFormat(format);
+    std::string transcoded;
+    std::string_view content;
+    if (!raw_content_.empty() && content_format == raw_format_) {
+        content = raw_content_;
+    } else if (!Content().empty()) {
+        if (content_format == MessageFormat::JSON) transcoded = Content().dump();
+        else json::to_msgpack(Content(), transcoded);
+        content = transcoded;
+    }
+
+    std::string payload;
+    if (format == MessageFormat::BINARY) {
+        if (AppendBinaryEnvelope(payload, type, dest, src, only_first, key, correlation,
+            reply, requester)) {
+            payload.append(content);
+            return EncodedFrame::FromPayload(format, std::move(payload), 0, attachment);
+        }
+        // BINARY peers read MessagePack too, and the content is already encoded for it
+        format = MessageFormat::MSGPACK;
+    }
+
+    // One for each field set below
+    constexpr size_t MAX_ENVELOPE_ENTRIES = 8;
+    json envelope = { { "type", type }, { "only_first", only_first } };
+    if (!dest.empty()) envelope["dest"] = dest;
+    if (!src.empty()) envelope["src"] = src;
+    if (!key.empty()) envelope["key"] = key;
+    if (correlation) envelope["correlation"] = correlation;
+    if (reply) envelope["reply"] = true;
+    if (requester) envelope["requester"] = requester;
+
+    switch (format) {
+    case MessageFormat::JSON:
+        payload = envelope.dump();
+        if (!content.empty()) {
+            payload.pop_back(); // Closing brace
+            payload.append(",\"content\":");
+            payload.append(content);
+            payload.push_back('}');
+        }
+        break;
+    case MessageFormat::MSGPACK:
+        json::to_msgpack(envelope, payload);
+        if (!content.empty()) {
+            // The envelope has at most eight entries, so it is always a fixmap (of up
+            // to 15) and the new entry only changes the count in its first byte
+            static_assert(MAX_ENVELOPE_ENTRIES < MAX_FIXMAP_ENTRIES);
+            if (envelope.size() >= MAX_FIXMAP_ENTRIES) {
+                envelope["content"] = Content();
+                payload.clear();
+                json::to_msgpack(envelope, payload);
+                break;
+            }
+            ++payload[0];
+            payload.append("\xa7" "content");
+            payload.append(content);
+        }
+        break;
+    case MessageFormat::BINARY:
+        break;
+    }
+
+    return EncodedFrame::FromPayload(format, std::move(payload), 0, attachment);
+}
+
+// FrameCache
+
+FrameCache::FrameCache(LazyMessage&& message) : message_(std::move(message)) {}
+
+FrameCache::FrameCache(const Message& message) : message_(message) {}
+
+auto FrameCache::Get(MessageFormat format) -> SharedFrame
+{
+    SharedFrame& frame = frames_[static_cast<size_t>(format)];
+    if (!frame) {
+        frame = moved_ ? EncodedFrame::Encode(format, *decoded_)
+              : message_.Encode(format);
+    }
+
+    return frame;
+}
+
+auto FrameCache::GetCompressed(MessageFormat format, size_t threshold) -> SharedFrame
+{
+    SharedFrame& frame = compressed_frames_[static_cast<size_t>(format)];
+    if (!frame) frame = EncodedFrame::Compress(Get(format), threshold);
+
+    return frame;
+}
+
+auto FrameCache::Get(MessageFormat format, Compression compression, size_t threshold)
+-> SharedFrame
+{
+    if (compression == Compression::NONE) return Get(format);
+
+    return GetCompressed(format, threshold);
+}
+
+auto FrameCache::GetAttachment() const -> const SharedAttachment&
+{
+    return moved_ ? decoded_->attachment : message_.attachment;
+}
+
+auto FrameCache::GetMessage() -> std::shared_ptr<const Message>
+{
+    if (decoded_) return decoded_;
+
+    if (message_.HasRawContent()) {
+        decoded_ = std::make_shared<Message>(message_.ToMessage());
+    } else {
+        decoded_ = std::make_shared<Message>(std::move(message_).ToMessage());
+        moved_ = true;
+    }
+
+    return decoded_;
+}
+
+// ChunkCache
+
+ChunkCache::ChunkCache(ChunkHeader header, std::span<const uint8_t> data)
+    : header(header), data(data) {}
+
+ChunkCache::ChunkCache(ChunkHeader header, FrameCache& head)
+    : header(header), head(&head) {}
+
+auto ChunkCache::Index(MessageFormat format) const -> size_t
+{
+    return head ? static_cast<size_t>(format) : 0;
+}
+
+auto ChunkCache::Get(MessageFormat format) -> SharedFrame
+{
+    SharedFrame& frame = frames_[Index(format)];
+    if (frame) return frame;
+
+    if (head) {
+        // Which may not be `format`, if the head had to fall back to another one
+        SharedFrame message = head->Get(format);
+        std::span<const uint8_t> payload {
+            reinterpret_cast<const uint8_t*>(message->payload.data()),
+            message->payload.size()
+        };
+        frame = EncodedFrame::EncodeChunk(message->Format(), header, payload);
+    } else {
+        frame = EncodedFrame::EncodeChunk(format, header, data);
+    }
+
+    return frame;
+}
+
+auto ChunkCache::GetCompressed(MessageFormat format, size_t threshold) -> SharedFrame
+{
+    SharedFrame& frame = compressed_frames_[Index(format)];
+    if (!frame) frame = EncodedFrame::Compress(Get(format), threshold);
+
+    return frame;
+}
+
+auto ChunkCache::Get(MessageFormat format, Compression compression, size_t threshold)
+-> SharedFrame
+{
+    if (compression == Compression::NONE) return Get(format);
+
+    return GetCompressed(format, threshold);
+}
+
+}
@@ -0,0 +1,120 @@
+#include "executor.hpp"
+
+#include <algorithm>
+
+namespace buxtehude
+{
+
+HandlerPool::HandlerPool(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i) threads_.emplace_back(&HandlerPool::Run, this);
+}
+
+HandlerPool::~HandlerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_all();
+
+    for (std::thread& thread : threads_) thread.join();
+}
+
+void HandlerPool::Submit(std::function<void()>&& task)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        tasks_.push(std::move(task));
+    }
+    ready_.notify_one();
+}
+
+auto HandlerPool::Shared() -> HandlerPool&
+{
+    static HandlerPool pool { std::max(std::thread::hardware_concurrency(), 2u) };
+    return pool;
+}
+
+void HandlerPool::Run()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            // Whatever was submitted before stopping still runs
+            if (tasks_.empty()) return;
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+        task();
+    }
+}
+
+// TimerQueue
+
+TimerQueue::TimerQueue() : thread_(&TimerQueue::Run, this) {}
+
+TimerQueue::~TimerQueue()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    changed_.notify_one();
+
+    thread_.join();
+}
+
+auto TimerQueue::Schedule(Clock::time_point deadline, std::function<void()>&& task)
+-> TimerId
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    TimerId id { deadline, next_id_++ };
+    auto iter = timers_.emplace(id, std::move(task)).first;
+    bool earliest = iter == timers_.begin();
+    lock.unlock();
+
+    // Otherwise the thread wakes up before this one is due anyway
+    if (earliest) changed_.notify_one();
+
+    return id;
+}
+
+bool TimerQueue::Cancel(const TimerId& id)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return timers_.erase(id) > 0;
+}
+
+auto TimerQueue::Shared() -> TimerQueue&
+{
+    static TimerQueue timers;
+    return timers;
+}
+
+void TimerQueue::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        if (timers_.empty()) {
+            changed_.wait(lock);
+            continue;
+        }
+
+        auto first = timers_.begin();
+        if (first->first.first > Clock::now()) {
+            changed_.wait_until(lock, first->first.first);
+            continue;
+        }
+
+        std::function<void()> task = std::move(first->second);
+        timers_.erase(first);
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+}
@@ -8,29 +8,33 @@
 
 #include <ranges>
 
+#include <netdb.h>
 #include <unistd.h>
 
 namespace buxtehude
 {
 
-constexpr int LIBEVENT_CHOSEN_BACKLOG = -1;
-
-ClientHandle::ClientHandle(Client& iclient, std::string_view teamname)
-    : client_ptr(&iclient), conn_type(ConnectionType::INTERNAL), connected(true)
+ClientHandle::ClientHandle(Server& server, Reactor& reactor, Client& iclient,
+    std::string_view teamname)
+    : server(&server), reactor(&reactor), client_ptr(&iclient),
+      conn_type(ConnectionType::INTERNAL), connected(true)
 {
     preferences.teamname = teamname;
 }
 
-ClientHandle::ClientHandle(ConnectionType conn_type, FileDescriptor socket,
-    event_base* ebase, EventCallbackData& callback_data)
-    : conn_type(conn_type)
+ClientHandle::ClientHandle(Server& server, Reactor& reactor, ConnectionType conn_type,
+    FileDescriptor socket, EventHandler handler)
+    : server(&server), reactor(&reactor), conn_type(conn_type)
 {
-    auto stream_or_err = Stream::FromSocket(socket, ebase, callback_data);
+    auto stream_or_err = Stream::FromSocket(socket, reactor.ebase.get(),
+        std::move(handler));
     if (stream_or_err.is_error())
         return;
 
     stream = std::move(stream_or_err.get_mut_unchecked());
     connected = true;
+    // SHM clients are greeted once their shared memory has arrived
+    if (conn_type == ConnectionType::SHM) return;
     if (Handshake().is_error()) Disconnect_NoWrite();
 }
 
@@ -41,25 +45,186 @@ tb::error<WriteError> ClientHandle::Handshake()
     return Write({
         .type { MSG_HANDSHAKE },
         .content = {
+            { "attachments",
+                conn_type == ConnectionType::UNIX && Attachment::Supported() },
+            { "batches", conn_type != ConnectionType::INTERNAL },
+            { "compression", server->preferences.compression },
             { "version", CURRENT_VERSION }
         }
     });
 }
 
 tb::error<WriteError> ClientHandle::Write(const Message& msg)
+{
+    FrameCache frames { msg };
+    return Write(frames, true);
+}
+
+tb::error<WriteError> ClientHandle::Write(Message&& msg)
+{
+    FrameCache frames { LazyMessage { std::move(msg) } };
+    return Write(frames, true);
+}
+
+tb::error<WriteError> ClientHandle::Write(FrameCache& frames, bool control)
+{
+    if (!connected) return WriteError {};
+
+    if (conn_type == ConnectionType::INTERNAL) {
+        client_ptr->Internal_Receive(frames.GetMessage());
+        return tb::ok;
+    }
+
+    if (frames.GetAttachment() && !attachments) {
+        logger(LogLevel::WARNING, fmt::format("Client {} cannot receive attachments - "
+            "message not sent", preferences.teamname));
+        return tb::ok;
+    }
+
+    return Write(frames.Get(preferences.format, preferences.compression,
+        server->preferences.compression_threshold), control);
+}
+
+tb::error<WriteError> ClientHandle::WriteChunk(ChunkCache& chunk)
+{
+    if (!connected) return WriteError {};
+
+    if (conn_type == ConnectionType::INTERNAL) {
+        std::shared_ptr<const Message> head;
+        if (chunk.head) head = chunk.head->GetMessage();
+        client_ptr->Internal_ReceiveChunk(chunk.header, std::move(head), chunk.data);
+        return tb::ok;
+    }
+
+    return Write(chunk.Get(preferences.format, preferences.compression,
+        server->preferences.compression_threshold));
+}
+
+tb::error<WriteError> ClientHandle::Write(SharedFrame frame, bool control)
 {
     if (!connected) return WriteError {};
 
     if (conn_type == ConnectionType::INTERNAL) {
-        client_ptr->Internal_Receive(msg);
+        ReceiveInternal(*frame);
         return tb::ok;
     }
 
-    stream.WriteMessage(preferences.format, msg).ignore_error();
+    const ServerPreferences& limits = server->preferences;
+    bool over_limit = stream.QueuedBytes() + frame->Size() > limits.high_watermark;
+    if (over_limit) SetCongested(true);
+
+    if (frame->Flags() & FRAME_CHUNK) {
+        // Never dropped, but still counted so that other messages make way for it
+        if (over_limit && limits.overflow_policy == OverflowPolicy::DISCONNECT) {
+            logger(LogLevel::INFO, fmt::format("Client {} is not keeping up with its "
+                "messages - disconnecting", preferences.teamname));
+            return WriteError {};
+        }
+    } else if (congested && !control) {
+        // The server's own messages are always sent, so that a client learns why it
+        // was sent an error or disconnected
+        switch (limits.overflow_policy) {
+        case OverflowPolicy::DROP_OLDEST:
+            if (over_limit) {
+                dropped_messages += stream.DropOldest(
+                    limits.high_watermark - std::min(frame->Size(), limits.high_watermark)
+                );
+            }
+            break;
+        case OverflowPolicy::DROP_NEWEST:
+            ++dropped_messages;
+            return tb::ok;
+        case OverflowPolicy::DISCONNECT:
+            logger(LogLevel::INFO, fmt::format("Client {} is not keeping up with its "
+                "messages - disconnecting", preferences.teamname));
+            return WriteError {};
+        case OverflowPolicy::BLOCK:
+            break;
+        }
+    }
+
+    stream.QueueFrame(std::move(frame)).if_err([this] (IOError error) {
+        if (error.type == IOError::BUFFER_FULL) ++dropped_messages;
+        else if (error.type == IOError::STREAM_CLOSED) Disconnect_NoWrite();
+    });
+    queued_bytes->store(stream.QueuedBytes(), std::memory_order_relaxed);
 
     return tb::ok;
 }
 
+void ClientHandle::OpenRequest(RequestKey request)
+{
+    if (!open_requests.insert(request).second) return;
+
+    open_request_order.push_back(request);
+    if (open_request_order.size() > MAX_OPEN_REQUESTS) {
+        open_requests.erase(open_request_order.front());
+        open_request_order.pop_front();
+    }
+}
+
+bool ClientHandle::CloseRequest(RequestKey request)
+{
+    if (!open_requests.erase(request)) return false;
+
+    // Replies mostly come in the order of their requests, which keeps this short
+    while (!open_request_order.empty()
+        && !open_requests.contains(open_request_order.front())) {
+        open_request_order.pop_front();
+    }
+
+    return true;
+}
+
+void ClientHandle::ReceiveInternal(const EncodedFrame& frame)
+{
+    // Decoded the same way Client does for frames off its socket
+    std::span<const uint8_t> data {
+        reinterpret_cast<const uint8_t*>(frame.payload.data()), frame.payload.size()
+    };
+
+    if (!(frame.Flags() & FRAME_CHUNK)) {
+        if (auto msg = DecodeMessage(frame.Format(), data)) {
+            msg->attachment = frame.attachment;
+            client_ptr->Internal_Receive(
+                std::make_shared<const Message>(std::move(*msg)));
+        }
+        return;
+    }
+
+    std::optional<ChunkHeader> header = ChunkHeader::Parse(data);
+    if (!header) return;
+    data = data.subspan(CHUNK_HEADER_SIZE);
+
+    std::shared_ptr<const Message> head;
+    if (header->flags & CHUNK_FIRST) {
+        if (auto decoded = DecodeMessage(frame.Format(), data))
+            head = std::make_shared<const Message>(std::move(*decoded));
+        data = {};
+    }
+    client_ptr->Internal_ReceiveChunk(*header, std::move(head), data);
+}
+
+void ClientHandle::Flush()
+{
+    stream.Flush().if_err([this] (IOError error) {
+        if (error.type == IOError::STREAM_CLOSED) Disconnect_NoWrite();
+    });
+    queued_bytes->store(stream.QueuedBytes(), std::memory_order_relaxed);
+
+    if (congested && stream.QueuedBytes() <= server->preferences.low_watermark)
+        SetCongested(false);
+}
+
+void ClientHandle::SetCongested(bool is_congested)
+{
+    if (congested == is_congested) return;
+    congested = is_congested;
+
+    if (server->preferences.overflow_policy == OverflowPolicy::BLOCK)
+        server->SetBlocking(congested);
+}
+
 void ClientHandle::Error(std::string_view errstr)
 {
     using Seconds = std::chrono::duration<double>;
@@ -86,7 +251,8 @@ void ClientHandle::Disconnect(std::string_view reason)
 void ClientHandle::Disconnect_NoWrite()
 {
     if (!connected) return;
-    if (conn_type == ConnectionType::UNIX || conn_type == ConnectionType::INTERNET) {
+    reactor->clients_disconnected = true;
+    if (conn_type != ConnectionType::INTERNAL) {
         stream.Close();
     } else if (conn_type == ConnectionType::INTERNAL) {
         client_ptr->Internal_Disconnect();
@@ -94,11 +260,239 @@ void ClientHandle::Disconnect_NoWrite()
     logger(LogLevel::DEBUG, fmt::format("Disconnecting client {}",
         preferences.teamname));
     connected = false;
+    SetCongested(false);
+}
+
+QueueStats ClientHandle::Stats() const
+{
+    return {
+        .teamname = preferences.teamname,
+        .queued_frames = stream.QueuedFrames(),
+        .queued_bytes = stream.QueuedBytes(),
+        .dropped_messages = dropped_messages,
+        .congested = congested
+    };
+}
+
+Member ClientHandle::ToMember() const
+{
+    bool internal = conn_type == ConnectionType::INTERNAL;
+    return {
+        .address = {
+            .id = id,
+            .reactor = reactor->index,
+            .slot = slot,
+            .format = preferences.format,
+            .compression = internal ? Compression::NONE : preferences.compression,
+            .attachments = attachments || internal,
+            .batches = batches,
+            .internal = internal
+        },
+        .team = server->names.Intern(preferences.teamname),
+        .capacity = capacity,
+        .queued_bytes = queued_bytes
+    };
+}
+
+namespace
+{
+
+// Spreads ids and string hashes evenly over the hash ring (splitmix64's finaliser)
+auto MixHash(uint64_t x) -> uint64_t
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+}
+
+bool Member::Available(InternId type) const
+{
+    return !unavailable.Contains(type);
+}
+
+MemberIndex::MemberIndex(const ServerPreferences& preferences, InternTable& names)
+    : preferences_(&preferences), table_(&names), all_(NewTeam(MSG_ALL)) {}
+
+auto MemberIndex::NewTeam(std::string_view teamname) const -> Team
+{
+    auto iter = preferences_->team_dispatch.find(std::string { teamname });
+    if (iter == preferences_->team_dispatch.end())
+        return { .dispatch = preferences_->dispatch };
+
+    return { .dispatch = iter->second };
+}
+
+void MemberIndex::Put(Member member)
+{
+    // Whoever put the member interned its ids first
+    names_.CatchUp(*table_);
+
+    // Members never change teams, only their availability
+    if (Member* existing = Get(member.address.id)) {
+        *existing = std::move(member);
+        return;
+    }
+
+    uint32_t index = members_.size();
+    indices_[member.address.id] = index;
+
+    if (member.team >= teams_.size()) teams_.resize(member.team + 1);
+    Team& team = teams_[member.team];
+    if (team.members.empty()) team = NewTeam(names_.Name(member.team));
+    team.members.push_back(index);
+    team.capacities_stale = team.ring_stale = true;
+    all_.members.push_back(index);
+    all_.capacities_stale = all_.ring_stale = true;
+
+    members_.emplace_back(std::move(member));
+}
+
+void MemberIndex::Remove(uint64_t id)
+{
+    auto iter = indices_.find(id);
+    if (iter == indices_.end()) return;
+    uint32_t index = iter->second;
+    indices_.erase(iter);
+
+    Team& team = teams_[members_[index].team];
+    std::erase(team.members, index);
+    team.capacities_stale = team.ring_stale = true;
+
+    // The last member takes its place, keeping its own place in its team
+    uint32_t last = members_.size() - 1;
+    if (index != last) {
+        members_[index] = std::move(members_[last]);
+        indices_[members_[index].address.id] = index;
+        std::ranges::replace(teams_[members_[index].team].members, last, index);
+    }
+    members_.pop_back();
+    all_.members.pop_back();
+    all_.capacities_stale = all_.ring_stale = true;
+}
+
+auto MemberIndex::Get(uint64_t id) -> Member*
+{
+    auto iter = indices_.find(id);
+    return iter == indices_.end() ? nullptr : &members_[iter->second];
+}
+
+auto MemberIndex::Intern(std::string_view name) -> InternId
+{
+    if (InternId id = names_.Find(name); id != INVALID_INTERN_ID) return id;
+
+    InternId id = table_->Intern(name);
+    names_.CatchUp(*table_);
+
+    return id;
 }
 
-bool ClientHandle::Available(std::string_view type)
+auto MemberIndex::Choose(std::string_view teamname, std::string_view type,
+    uint64_t exclude, std::string_view key) -> const Member*
 {
-    return std::ranges::find(unavailable, type) == unavailable.end();
+    Team* team = &all_;
+    if (teamname != MSG_ALL) {
+        InternId id = names_.Find(teamname);
+        if (id >= teams_.size()) return nullptr;
+        team = &teams_[id];
+    }
+
+    // Looked up once, rather than compared with each member's unavailable types
+    InternId type_id = names_.Find(type);
+    if (!key.empty()) return ChooseByKey(*team, type_id, exclude, key);
+
+    const std::vector<uint32_t>& candidates = team->members;
+    size_t count = candidates.size();
+    if (count == 0) return nullptr;
+
+    auto queued_bytes = [this, &candidates] (size_t position) -> size_t {
+        const Member& member = members_[candidates[position]];
+        return member.queued_bytes ? member.queued_bytes->load() : 0;
+    };
+
+    // Where to start looking for an available member
+    size_t start = 0;
+    switch (team->dispatch) {
+    case Dispatch::FIRST_AVAILABLE:
+        break;
+    case Dispatch::ROUND_ROBIN:
+        start = team->next % count;
+        break;
+    case Dispatch::LEAST_LOADED: {
+        // The less loaded of two random members is almost as good as the least loaded
+        // of all of them, without looking at all of them
+        size_t a = random_() % count, b = random_() % count;
+        start = queued_bytes(b) < queued_bytes(a) ? b : a;
+        break;
+    }
+    case Dispatch::WEIGHTED:
+        if (team->capacities_stale) {
+            team->capacities.clear();
+            uint64_t total = 0;
+            for (uint32_t index : candidates) {
+                total += members_[index].capacity;
+                team->capacities.push_back(total);
+            }
+            team->capacities_stale = false;
+        }
+        // Pick evenly rather than divide by zero if every capacity is 0
+        if (team->capacities.back() == 0) {
+            start = random_() % count;
+            break;
+        }
+        start = std::ranges::upper_bound(team->capacities,
+            random_() % team->capacities.back()) - team->capacities.begin();
+        break;
+    }
+
+    const Member* result = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+        size_t position = (start + i) % count;
+        const Member& member = members_[candidates[position]];
+        if (member.address.id == exclude) continue;
+
+        result = &member;
+        if (member.Available(type_id)) {
+            team->next = position + 1;
+            break;
+        }
+    }
+
+    return result;
+}
+
+auto MemberIndex::ChooseByKey(Team& team, InternId type, uint64_t exclude,
+    std::string_view key) -> const Member*
+{
+    if (team.members.empty()) return nullptr;
+
+    if (team.ring_stale) {
+        team.ring.clear();
+        for (uint32_t index : team.members) {
+            uint64_t id = members_[index].address.id;
+            for (size_t point = 0; point < RING_POINTS; ++point)
+                team.ring.emplace_back(MixHash(id * RING_POINTS + point), id);
+        }
+        std::ranges::sort(team.ring);
+        team.ring_stale = false;
+    }
+
+    // Clockwise from the key's hash to the first member that can take the message
+    auto start = std::ranges::lower_bound(team.ring,
+        std::pair { MixHash(std::hash<std::string_view> {}(key)), uint64_t { 0 } });
+    size_t offset = start - team.ring.begin();
+
+    const Member* result = nullptr;
+    for (size_t i = 0; i < team.ring.size(); ++i) {
+        uint64_t id = team.ring[(offset + i) % team.ring.size()].second;
+        if (id == exclude || (result && result->address.id == id)) continue;
+
+        result = &members_[indices_.at(id)];
+        if (result->Available(type)) break;
+    }
+
+    return result;
 }
 
 // ClientHandle functions specific to stream-based connections
@@ -106,6 +500,8 @@ bool ClientHandle::Available(std::string_view type)
 // Server
 // Server constructors & destructor
 
+Server::Server(const ServerPreferences& preferences) : preferences(preferences) {}
+
 Server::~Server()
 {
     Close();
@@ -114,6 +510,42 @@ Server::~Server()
 // Listening socket setup
 
 tb::error<ListenError> Server::UnixServer(std::string_view path)
+{
+    auto result = ListenOnFile(path, unix_listener, unix_path);
+    if (result.is_error()) {
+        logger(LogLevel::WARNING,
+            fmt::format("Failed to listen for UNIX domain connections at {}: {}",
+                path, strerror(result.get_error().code)));
+        unix_server = INVALID_FILE_DESCRIPTOR;
+        return result;
+    }
+
+    unix_server = evconnlistener_get_fd(unix_listener.get());
+
+    Run();
+    logger(LogLevel::DEBUG, fmt::format("Listening on file {}", path));
+
+    return tb::ok;
+}
+
+tb::error<ListenError> Server::ShmServer(std::string_view path)
+{
+    auto result = ListenOnFile(path, shm_listener, shm_path);
+    if (result.is_error()) {
+        logger(LogLevel::WARNING,
+            fmt::format("Failed to listen for shared memory connections at {}: {}",
+                path, strerror(result.get_error().code)));
+        return result;
+    }
+
+    Run();
+    logger(LogLevel::DEBUG, fmt::format("Listening for shared memory on file {}", path));
+
+    return tb::ok;
+}
+
+tb::error<ListenError> Server::ListenOnFile(std::string_view path,
+    UEvconnListener& listener, std::string& bound_path)
 {
     if (SetupEvents().is_error())
         return ListenError { ListenError::LIBEVENT_ERROR };
@@ -126,63 +558,80 @@ tb::error<ListenError> Server::UnixServer(std::string_view path)
     memcpy(addr.sun_path, path.data(), path_len);
     addr.sun_path[path_len] = '\0';
 
-    unix_path = addr.sun_path;
+    bound_path = addr.sun_path;
 
-    unix_listener = make<UEvconnListener>(
+    Reactor& reactor = *reactors.front();
+    listener = make<UEvconnListener>(
         evconnlistener_new_bind(
-            ebase.get(), callbacks::ConnectionCallback, &callback_data,
-            LEV_OPT_CLOSE_ON_FREE, LIBEVENT_CHOSEN_BACKLOG,
+            reactor.ebase.get(), callbacks::ConnectionCallback, &reactor.event_handler,
+            LEV_OPT_CLOSE_ON_FREE, preferences.listen_backlog,
             reinterpret_cast<sockaddr*>(&addr), sizeof(addr)
         )
     );
 
-    if (!unix_listener) {
-        logger(LogLevel::WARNING,
-            fmt::format("Failed to listen for UNIX domain connections at {}: {}",
-                path, strerror(errno)));
-        unix_server = INVALID_FILE_DESCRIPTOR;
-        return ListenError { ListenError::BIND_ERROR, errno };
-    }
-
-    unix_server = evconnlistener_get_fd(unix_listener.get());
-
-    Run();
-    logger(LogLevel::DEBUG, fmt::format("Listening on file {}", path));
+    if (!listener) return ListenError { ListenError::BIND_ERROR, errno };
 
     return tb::ok;
 }
 
 tb::error<ListenError> Server::IPServer(uint16_t port)
+{
+    return IPServer("0.0.0.0", port);
+}
+
+tb::error<ListenError> Server::IPServer(std::string_view address, uint16_t port)
 {
     if (SetupEvents().is_error())
         return ListenError { ListenError::LIBEVENT_ERROR };
 
-    sockaddr_in addr = {0};
-    addr.sin_family = PF_INET;
-    addr.sin_port = htons(port);
+    addrinfo* res;
+    addrinfo hints {
+        .ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV,
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
 
-    if (INADDR_ANY) addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    std::string host { address }, service = std::to_string(port);
+    if (int gai_error = getaddrinfo(host.c_str(), service.c_str(), &hints, &res)) {
+        logger(LogLevel::WARNING,
+            fmt::format("Failed to listen for internet domain connections on {}: {}",
+                address, gai_strerror(gai_error)));
+        return ListenError { ListenError::ADDRESS_ERROR, gai_error };
+    }
 
-    ip_listener = make<UEvconnListener>(
-        evconnlistener_new_bind(
-            ebase.get(), callbacks::ConnectionCallback, &callback_data,
-            LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, LIBEVENT_CHOSEN_BACKLOG,
-            reinterpret_cast<sockaddr*>(&addr), sizeof(addr)
-        )
-    );
+    tb::scoped_guard addrinfo_guard = [res] () { freeaddrinfo(res); };
+
+    // Sharded, each reactor accepts the connections it is to serve, with no handover
+    // and no single thread for a storm of connections to queue behind
+    bool sharded = ShardsIPListeners();
+    int flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE;
+    if (sharded) flags |= LEV_OPT_REUSEABLE_PORT;
+
+    std::vector<UEvconnListener> listeners;
+    for (auto& reactor : reactors) {
+        auto& listener = listeners.emplace_back(make<UEvconnListener>(
+            evconnlistener_new_bind(
+                reactor->ebase.get(), callbacks::ConnectionCallback,
+                &reactor->event_handler, flags, preferences.listen_backlog,
+                res->ai_addr, res->ai_addrlen
+            )
+        ));
+
+        if (!listener) {
+            logger(LogLevel::WARNING,
+                fmt::format("Failed to listen for internet domain connections on "
+                    "{} port {}: {}", address, port, strerror(errno)));
+            return ListenError { ListenError::BIND_ERROR, errno };
+        }
 
-    if (!ip_listener) {
-        logger(LogLevel::WARNING,
-            fmt::format("Failed to listen for internet domain connections on port {}: {}",
-                port, strerror(errno)));
-        ip_server = INVALID_FILE_DESCRIPTOR;
-        return ListenError { ListenError::BIND_ERROR, errno };
+        if (!sharded) break;
     }
 
-    ip_server = evconnlistener_get_fd(ip_listener.get());
+    std::ranges::move(listeners, std::back_inserter(ip_listeners));
 
     Run();
-    logger(LogLevel::DEBUG, fmt::format("Listening on port {}", port));
+    logger(LogLevel::DEBUG, fmt::format("Listening on {} port {}{}", address, port,
+        sharded ? fmt::format(" on {} reactors", reactors.size()) : ""));
 
     return tb::ok;
 }
@@ -202,305 +651,809 @@ void Server::Run()
     if (started) return;
     started = true;
 
-    if (current_thread.joinable()) {
-        evuser_trigger(interrupt_event.get());
-        current_thread.join();
+    for (auto& reactor : reactors) {
+        reactor->thread = std::thread(&Server::Listen, this, std::ref(*reactor));
     }
-
-    current_thread = std::thread(&Server::Listen, this);
 }
 
 void Server::Close()
 {
     logger(LogLevel::DEBUG, "Shutting down server");
-    if (current_thread.joinable()) {
-        evuser_trigger(interrupt_event.get());
-        current_thread.join();
+    for (auto& reactor : reactors) {
+        if (reactor->thread.joinable()) evuser_trigger(reactor->interrupt_event.get());
+    }
+    for (auto& reactor : reactors) {
+        if (reactor->thread.joinable()) reactor->thread.join();
     }
 
-    for (ClientHandle& handle : clients) {
-        handle.Disconnect("Shutting down server");
+    for (auto& reactor : reactors) {
+        std::lock_guard<std::mutex> guard(reactor->clients_mutex);
+        reactor->clients.ForEach([] (ClientHandle& handle) {
+            handle.Disconnect("Shutting down server");
+        });
+
+        // Connections handed over too late to be served
+        reactor->inbox.Drain([] (Delivery&& delivery) {
+            if (delivery.type == Delivery::CONNECTION) close(delivery.socket);
+        });
     }
 
     if (unix_listener)
         unlink(unix_path.c_str());
+    if (shm_listener)
+        unlink(shm_path.c_str());
 
     started = false;
+
+    {
+        std::lock_guard<std::mutex> guard(blocking_mutex);
+        blocking_clients = 0;
+    }
+    unblocked.notify_all();
+}
+
+std::vector<QueueStats> Server::GetQueueStats()
+{
+    std::vector<QueueStats> stats;
+    for (auto& reactor : reactors) {
+        std::lock_guard<std::mutex> guard(reactor->clients_mutex);
+        reactor->clients.ForEach([&stats] (const ClientHandle& handle) {
+            stats.emplace_back(handle.Stats());
+        });
+    }
+
+    return stats;
+}
+
+void Server::SetBlocking(bool blocking)
+{
+    {
+        std::lock_guard<std::mutex> guard(blocking_mutex);
+        if (blocking) ++blocking_clients;
+        else if (blocking_clients > 0) --blocking_clients;
+    }
+
+    if (!blocking) unblocked.notify_all();
+}
+
+void Server::Broadcast_NoLock(Reactor& reactor, const Message& m)
+{
+    FrameCache frames { m };
+    reactor.clients.ForEach([&frames] (ClientHandle& handle) {
+        if (handle.Write(frames, true).is_error()) handle.Disconnect_NoWrite();
+    });
+}
+
+void Server::BroadcastAll(Reactor& reactor, const Message& m)
+{
+    Broadcast_NoLock(reactor, m);
+    if (reactors.size() == 1) return;
+
+    auto shared = std::make_shared<const Message>(m);
+    for (auto& other : reactors) {
+        if (other.get() == &reactor) continue;
+        Send(other->index, { .type = Delivery::BROADCAST, .message = shared });
+    }
+}
+
+// Reactors
+
+Reactor::Reactor(size_t index, const ServerPreferences& preferences, InternTable& names)
+    : index(index), members(preferences, names) {}
+
+void Server::PublishMember(Reactor& reactor, const Member& member)
+{
+    for (auto& other : reactors) {
+        if (other.get() == &reactor) continue;
+        Send(other->index, { .type = Delivery::MEMBER, .member = member });
+    }
 }
 
-void Server::Broadcast_NoLock(const Message& m)
+void Server::RemoveMember(Reactor& reactor, uint64_t id)
 {
-    for (ClientHandle& handle : clients) {
-        if (handle.Write(m).is_error()) handle.Disconnect_NoWrite();
+    reactor.members.Remove(id);
+
+    for (auto& other : reactors) {
+        if (other.get() == &reactor) continue;
+        Send(other->index, { .type = Delivery::MEMBER_LEFT, .client_id = id });
     }
 }
 
+void Server::Send(size_t index, Delivery&& delivery)
+{
+    Reactor& reactor = *reactors[index];
+    // Only the first delivery since the reactor last emptied its inbox wakes it up
+    if (reactor.inbox.Push(std::move(delivery)))
+        evuser_trigger(reactor.inbox_event.get());
+}
+
+void Server::HandleInbox(Reactor& reactor)
+{
+    event_del(reactor.inbox_event.get());
+
+    std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+    reactor.inbox.Drain([this, &reactor] (Delivery&& delivery) {
+        switch (delivery.type) {
+        case Delivery::FRAME: {
+            ClientHandle* destination = GetClient(reactor, delivery.slot);
+            if (!destination) break;
+            if (delivery.request.second) destination->OpenRequest(delivery.request);
+            if (destination->Write(std::move(delivery.frame)).is_error())
+                destination->Disconnect_NoWrite();
+            break;
+        }
+        case Delivery::BROADCAST:
+            Broadcast_NoLock(reactor, *delivery.message);
+            break;
+        case Delivery::CONNECTION:
+            AddConnection(reactor, delivery.socket, delivery.conn_type);
+            break;
+        case Delivery::MEMBER:
+            reactor.members.Put(std::move(delivery.member));
+            break;
+        case Delivery::MEMBER_LEFT:
+            reactor.members.Remove(delivery.client_id);
+            break;
+        }
+    });
+}
+
+bool Server::OnReactorThread() const
+{
+    return std::ranges::any_of(reactors, [] (const auto& reactor) {
+        return reactor->thread.get_id() == std::this_thread::get_id();
+    });
+}
+
 // Server connection management
 // INTERNAL only functions
 
-void Server::Internal_AddClient(Client& cl)
+SlotKey Server::Internal_AddClient(Client& cl)
 {
-    std::lock_guard<std::mutex> guard(clients_mutex);
-    auto& handle = clients.emplace_back(cl, cl.preferences.teamname);
+    Reactor& reactor = *reactors.front();
+    std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+    auto [slot, handle] = reactor.clients.Emplace(*this, reactor, cl,
+        cl.preferences.teamname);
+    handle.id = next_client_id++;
+    handle.slot = slot;
+    reactor.internal_clients[&cl] = slot;
 
     if (handle.Handshake().is_error()) handle.Disconnect_NoWrite();
+
+    return slot;
 }
 
 void Server::Internal_RemoveClient(Client& to_remove)
 {
-    std::lock_guard<std::mutex> guard(clients_mutex);
-    std::erase_if(clients, [&to_remove] (ClientHandle& handle) {
-        return handle.client_ptr == &to_remove;
-    });
+    Reactor& reactor = *reactors.front();
+    std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+    ClientHandle* handle = GetClientByPointer(reactor, &to_remove);
+    if (!handle) return;
 
-    Broadcast_NoLock({
-        .type { MSG_DISCONNECT },
-        .content = {
-            { "who", to_remove.preferences.teamname }
-        }
-    });
+    handle->connected = false;
+    RemoveClient(reactor, *handle);
 }
 
-void Server::Internal_ReceiveFrom(Client& cl, const Message& msg)
+void Server::Internal_ReceiveFrom(SlotKey slot, Message&& msg)
 {
-    std::lock_guard<std::mutex> guard(internal_mutex);
-    internal_messages.emplace_back(&cl, msg);
-    evuser_trigger(read_internal_event.get());
+    // Hold the producer back while a consumer catches up, unless it is a reactor
+    // thread, which is what drains the queues. Handlers of INTERNAL clients run on
+    // their executors, so they can wait here.
+    if (preferences.overflow_policy == OverflowPolicy::BLOCK && !OnReactorThread()) {
+        std::unique_lock<std::mutex> lock(blocking_mutex);
+        unblocked.wait(lock, [this] { return blocking_clients == 0; });
+    }
+
+    // Only the first message since the queue was last drained wakes the reactor up
+    if (internal_messages.Push({ slot, std::move(msg) }))
+        evuser_trigger(read_internal_event.get());
 }
 
 // Reading from socket-based clients
 
-void Server::Serve(HandleIter client_handle)
+void Server::Serve(ClientHandle& client_handle)
 {
-    client_handle->stream.ReadMessage()
-    .if_ok_mut([this, client_handle] (Message& message) {
-        HandleMessage(*client_handle, std::move(message));
-    }).if_err([client_handle] (StreamError error) {
+    if (client_handle.conn_type == ConnectionType::SHM) {
+        if (client_handle.stream.UsesShm()) {
+            // The client wakes us up for room in its ring as well
+            client_handle.Flush();
+        } else {
+            AcceptShm(client_handle);
+            if (!client_handle.stream.UsesShm()) return;
+        }
+    }
+
+    client_handle.stream.ReadFrames([this, &client_handle] (MessageFormat format,
+        uint8_t flags, std::span<const uint8_t> data, SharedAttachment attachment) {
+        if (!client_handle.connected) return;
+
+        if (flags & FRAME_CHUNK) {
+            HandleChunk(client_handle, format, data);
+            return;
+        }
+
+        if (flags & FRAME_BATCH) {
+            HandleBatch(client_handle, format, data);
+            return;
+        }
+
+        if (data.size() > preferences.max_message_size) {
+            client_handle.Error("Message exceeds the server's maximum message size");
+            return;
+        }
+
+        // Only the envelope is parsed here, the content stays as received
+        LazyMessage::Scan(format, data).if_ok_mut([this, &client_handle, &attachment]
+            (LazyMessage& message) {
+            message.attachment = std::move(attachment);
+            HandleMessage(client_handle, std::move(message));
+        });
+    }).if_err([&client_handle] (StreamError error) {
         if (error.type == StreamError::IO_ERROR
             && error.io_error.type == IOError::STREAM_CLOSED) {
-            client_handle->Disconnect();
+            client_handle.Disconnect();
         }
     });
 
-    if (!client_handle->connected) {
-        Broadcast_NoLock({
-            .type { MSG_DISCONNECT },
-            .content = {
-                { "who", client_handle->preferences.teamname }
-            }
-        });
+}
 
-        clients.erase(client_handle);
+void Server::AcceptShm(ClientHandle& client_handle)
+{
+    auto accepted = client_handle.stream.AcceptShm(client_handle.reactor->ebase.get());
+    if (accepted.is_error()) {
+        StreamError error = accepted.get_error();
+        if (error.type == StreamError::IO_ERROR
+            && error.io_error.type == IOError::BUFFER_EMPTY) {
+            return;
+        }
+
+        logger(LogLevel::WARNING, fmt::format("Failed to set up shared memory for a "
+            "client: {}", error.What()));
+        client_handle.Disconnect_NoWrite();
+        return;
     }
+
+    if (client_handle.Handshake().is_error()) client_handle.Disconnect_NoWrite();
 }
 
-void Server::HandleMessage(ClientHandle& client_handle, Message&& msg)
+void Server::HandleMessage(ClientHandle& client_handle, LazyMessage&& msg)
 {
+    Reactor& reactor = *client_handle.reactor;
+
     // Types of the JSON values are validated in checks
     if (!client_handle.handshaken) {
         if (msg.type != MSG_HANDSHAKE ||
-            !ValidateJSON(msg.content, VALIDATE_HANDSHAKE_SERVERSIDE)) {
+            !ValidateJSON(msg.Content(), VALIDATE_HANDSHAKE_SERVERSIDE)) {
             client_handle.Disconnect("Failed handshake");
             return;
         }
 
-        client_handle.preferences.teamname = msg.content["teamname"];
-        client_handle.preferences.format = msg.content["format"];
+        const json& content = msg.Content();
+        client_handle.preferences.teamname = content["teamname"];
+        client_handle.preferences.format = content["format"];
+        if (content["version"] >= BINARY_FORMAT_VERSION
+            && ValidateJSON(content, VALIDATE_PREFERRED_FORMAT)) {
+            client_handle.preferences.format = content["preferred_format"];
+        }
+        // Only compress for clients that asked for the compression this server offers
+        if (preferences.compression != Compression::NONE
+            && ValidateJSON(content, VALIDATE_COMPRESSION)
+            && content["compression"] == preferences.compression) {
+            client_handle.preferences.compression = preferences.compression;
+        }
+        if (ValidateJSON(content, VALIDATE_CAPACITY))
+            client_handle.capacity = content["capacity"].get<uint32_t>();
+        client_handle.attachments = client_handle.conn_type == ConnectionType::UNIX
+            && Attachment::Supported() && ValidateJSON(content, VALIDATE_ATTACHMENTS)
+            && content["attachments"] == true;
+        client_handle.batches = client_handle.conn_type != ConnectionType::INTERNAL
+            && ValidateJSON(content, VALIDATE_BATCHES) && content["batches"] == true;
         client_handle.handshaken = true;
+
+        Member member = client_handle.ToMember();
+        reactor.members.Put(member);
+        PublishMember(reactor, member);
         return;
     }
 
     if (msg.type == MSG_AVAILABLE) {
-        if (!ValidateJSON(msg.content, VALIDATE_AVAILABLE)) {
+        if (!ValidateJSON(msg.Content(), VALIDATE_AVAILABLE)) {
             client_handle.Error("Incorrect format for $$available message");
             return;
         }
-        std::string type = msg.content["type"];
-        bool available = msg.content["available"];
-        auto iter = std::ranges::find(client_handle.unavailable, type);
-        if (available) {
-            if (iter != client_handle.unavailable.end())
-                client_handle.unavailable.erase(iter);
-        } else {
-            if (iter == client_handle.unavailable.end())
-                client_handle.unavailable.emplace_back(type);
+        const json& content = msg.Content();
+        std::string type = content["type"];
+        bool available = content["available"];
+        Member* member = reactor.members.Get(client_handle.id);
+        bool full = member && !available
+            && member->unavailable.Size() >= Member::MAX_UNAVAILABLE_TYPES
+            && !member->unavailable.Contains(reactor.members.Find(type));
+        if (full) {
+            client_handle.Error("Unavailable for too many message types");
+        } else if (member) {
+            // Only types someone is unavailable for need an id
+            bool changed = available
+                ? member->unavailable.Erase(reactor.members.Find(type))
+                : member->unavailable.Insert(reactor.members.Intern(type));
+            if (changed) PublishMember(reactor, *member);
         }
     }
 
     if (msg.dest.empty()) return;
 
     msg.src = client_handle.preferences.teamname;
+    if (msg.reply) {
+        // Only from a client the request was delivered to, once, and only to the
+        // connection that sent it
+        RequestKey request { msg.requester, msg.correlation };
+        const Member* requester = reactor.members.Get(msg.requester);
+        if (requester && client_handle.CloseRequest(request)) {
+            FrameCache frames { std::move(msg) };
+            Deliver(reactor, requester->address, frames);
+        }
+        return;
+    }
+
+    // Only the server can say which connection a request came from
+    msg.requester = msg.correlation ? client_handle.id : 0;
+    RequestKey request { msg.requester, msg.correlation };
     if (msg.only_first) {
-        HandleIter destination = GetFirstAvailable(msg.dest, msg.type, client_handle);
-        if (destination != clients.end()) {
-            if (destination->Write(msg).is_error()) destination->Disconnect_NoWrite();
+        const Member* destination = reactor.members.Choose(msg.dest, msg.type,
+            client_handle.id, msg.key);
+        if (destination) {
+            FrameCache frames { std::move(msg) };
+            Deliver(reactor, destination->address, frames, request);
         }
         return;
     }
 
-    auto recipients = clients | std::views::filter([&msg] (ClientHandle& handle) {
-        return handle.preferences.teamname == msg.dest || msg.dest == MSG_ALL;
+    // Encoded at most once per format, however many recipients there are
+    std::string dest = msg.dest;
+    FrameCache frames { std::move(msg) };
+
+    reactor.members.ForEach(dest, [&] (const Member& member) {
+        if (member.address.id != client_handle.id)
+            Deliver(reactor, member.address, frames, request);
     });
+}
+
+void Server::HandleBatch(ClientHandle& client_handle, MessageFormat format,
+    std::span<const uint8_t> data)
+{
+    Reactor& reactor = *client_handle.reactor;
+
+    reactor.batching = true;
+    SplitBatch(data, [this, &client_handle, format] (std::span<const uint8_t> entry) {
+        if (!client_handle.connected) return;
+        LazyMessage::Scan(format, entry).if_ok_mut([this, &client_handle]
+            (LazyMessage& message) {
+            HandleMessage(client_handle, std::move(message));
+        });
+    });
+    reactor.batching = false;
+
+    for (auto& [_, batch] : reactor.pending_batches) SendBatch(reactor, batch);
+    reactor.pending_batches.clear();
+}
 
-    for (ClientHandle& destination : recipients) {
-        if (&destination == &client_handle) continue;
-        if (destination.Write(msg).is_error()) destination.Disconnect_NoWrite();
+void Server::HandleChunk(ClientHandle& client_handle, MessageFormat format,
+    std::span<const uint8_t> data)
+{
+    if (!client_handle.handshaken) {
+        client_handle.Disconnect("Failed handshake");
+        return;
     }
+
+    Reactor& reactor = *client_handle.reactor;
+    std::optional<ChunkHeader> header = ChunkHeader::Parse(data);
+    if (!header) return;
+    data = data.subspan(CHUNK_HEADER_SIZE);
+
+    auto& routes = client_handle.chunk_routes;
+    uint8_t end_flags = header->flags & (CHUNK_LAST | CHUNK_ABORTED);
+
+    if (header->flags & CHUNK_FIRST) {
+        // A reused id ends whatever message it belonged to
+        if (auto iter = routes.find(header->stream_id); iter != routes.end()) {
+            ChunkCache abort { { iter->second.stream_id, CHUNK_ABORTED }, {} };
+            ForwardChunk(reactor, iter->second, abort);
+            routes.erase(iter);
+        }
+
+        auto scanned = LazyMessage::Scan(format, data);
+        if (scanned.is_error()) return;
+        LazyMessage head = std::move(scanned.get_mut_unchecked());
+        if (head.dest.empty()) return;
+
+        // The recipients are fixed for the whole message. Chunked messages are never
+        // requests or replies.
+        head.src = client_handle.preferences.teamname;
+        head.correlation = head.requester = 0;
+        head.reply = false;
+        ChunkRoute route { .stream_id = next_stream_id++ };
+        if (head.only_first) {
+            const Member* destination = reactor.members.Choose(head.dest, head.type,
+                client_handle.id, head.key);
+            if (destination) route.recipients.emplace_back(destination->address);
+        } else {
+            reactor.members.ForEach(head.dest, [&] (const Member& member) {
+                if (member.address.id != client_handle.id)
+                    route.recipients.emplace_back(member.address);
+            });
+        }
+
+        FrameCache head_frames { std::move(head) };
+        ChunkCache chunk { { route.stream_id, uint8_t(CHUNK_FIRST | end_flags) },
+            head_frames };
+        ForwardChunk(reactor, route, chunk);
+
+        if (!end_flags) routes.emplace(header->stream_id, std::move(route));
+        return;
+    }
+
+    auto iter = routes.find(header->stream_id);
+    if (iter == routes.end()) return;
+    ChunkRoute& route = iter->second;
+
+    route.bytes += data.size();
+    if (route.bytes > preferences.max_message_size) {
+        ChunkCache abort { { route.stream_id, CHUNK_ABORTED }, {} };
+        ForwardChunk(reactor, route, abort);
+        routes.erase(iter);
+        client_handle.Error("Chunked message exceeds the server's maximum message size");
+        return;
+    }
+
+    ChunkCache chunk { { route.stream_id, end_flags }, data };
+    ForwardChunk(reactor, route, chunk);
+
+    if (end_flags) routes.erase(iter);
 }
 
-// Libevent setup
+void Server::Deliver(Reactor& reactor, const Address& to, FrameCache& frames,
+    RequestKey request)
+{
+    // Requests are opened on the recipient by whichever reactor serves it, which a
+    // batch frame gives no way to do
+    if (reactor.batching && to.batches && !frames.GetAttachment() && !request.second) {
+        AddToBatch(reactor, to, frames.Get(to.format));
+        return;
+    }
 
-tb::error<AllocError> Server::SetupEvents()
+    if (to.reactor == reactor.index) {
+        ClientHandle* destination = GetClient(reactor, to.slot);
+        if (!destination) return;
+        if (request.second) destination->OpenRequest(request);
+        if (destination->Write(frames).is_error()) destination->Disconnect_NoWrite();
+        return;
+    }
+
+    if (frames.GetAttachment() && !to.attachments) {
+        logger(LogLevel::WARNING, "A client cannot receive attachments - message "
+            "not sent");
+        return;
+    }
+
+    // Encoded here, so that every reactor only pays for the formats it sends in
+    Send(to.reactor, {
+        .type = Delivery::FRAME,
+        .slot = to.slot,
+        .frame = frames.Get(to.format, to.compression, preferences.compression_threshold),
+        .request = request
+    });
+}
+
+void Server::AddToBatch(Reactor& reactor, const Address& to, SharedFrame frame)
 {
-    if (ebase) return tb::ok;
+    PendingBatch& batch = reactor.pending_batches[to.id];
+    size_t bytes = BATCH_ENTRY_HEADER_SIZE + frame->payload.size();
+    // BINARY recipients are also sent MSGPACK, for messages the envelope cannot hold
+    if (!batch.frames.empty() && (batch.bytes + bytes > MAX_MESSAGE_LENGTH
+        || batch.frames.front()->Format() != frame->Format())) {
+        SendBatch(reactor, batch);
+    }
 
-    ebase = make<UEventBase>(event_base_new());
-    callback_data.event_base = ebase.get();
+    batch.to = to;
+    batch.bytes += bytes;
+    batch.frames.emplace_back(std::move(frame));
+}
 
-    interrupt_event = make<UEvent>(
-        event_new(
-            ebase.get(), INVALID_FILE_DESCRIPTOR, EV_PERSIST,
-            callbacks::LoopInterruptCallback,  &callback_data
-        )
-    );
+void Server::SendBatch(Reactor& reactor, PendingBatch& batch)
+{
+    if (batch.frames.empty()) return;
+
+    SharedFrame frame = batch.frames.size() == 1 ? batch.frames.front()
+                      : EncodedFrame::Batch(batch.frames);
+    if (batch.to.compression != Compression::NONE)
+        frame = EncodedFrame::Compress(frame, preferences.compression_threshold);
+    batch.frames.clear();
+    batch.bytes = 0;
+
+    if (batch.to.reactor != reactor.index) {
+        Send(batch.to.reactor, {
+            .type = Delivery::FRAME, .slot = batch.to.slot, .frame = std::move(frame)
+        });
+        return;
+    }
+
+    ClientHandle* destination = GetClient(reactor, batch.to.slot);
+    if (!destination) return;
+    if (destination->Write(std::move(frame)).is_error())
+        destination->Disconnect_NoWrite();
+}
+
+void Server::DeliverChunk(Reactor& reactor, const Address& to, ChunkCache& chunk)
+{
+    if (to.reactor == reactor.index) {
+        ClientHandle* destination = GetClient(reactor, to.slot);
+        if (!destination) return;
+        if (destination->WriteChunk(chunk).is_error()) destination->Disconnect_NoWrite();
+        return;
+    }
+
+    Send(to.reactor, {
+        .type = Delivery::FRAME,
+        .slot = to.slot,
+        .frame = chunk.Get(to.format, to.compression, preferences.compression_threshold)
+    });
+}
+
+void Server::ForwardChunk(Reactor& reactor, const ChunkRoute& route, ChunkCache& chunk)
+{
+    for (const Address& to : route.recipients) DeliverChunk(reactor, to, chunk);
+}
+
+void Server::AbortChunks(ClientHandle& client_handle)
+{
+    for (auto& [_, route] : client_handle.chunk_routes) {
+        ChunkCache abort { { route.stream_id, CHUNK_ABORTED }, {} };
+        ForwardChunk(*client_handle.reactor, route, abort);
+    }
+
+    client_handle.chunk_routes.clear();
+}
 
+// Libevent setup
+
+tb::error<AllocError> Server::SetupEvents()
+{
+    if (!reactors.empty()) return tb::ok;
+
+    for (size_t i = 0; i < std::max<size_t>(preferences.reactor_threads, 1); ++i) {
+        Reactor& reactor = *reactors.emplace_back(std::make_unique<Reactor>(i,
+            preferences, names));
+        reactor.ebase = make<UEventBase>(event_base_new());
+        reactor.event_handler = [this, &reactor] (const Event& event) {
+            HandleEvent(reactor, event);
+        };
+
+        reactor.interrupt_event = make<UEvent>(
+            event_new(
+                reactor.ebase.get(), INVALID_FILE_DESCRIPTOR, EV_PERSIST,
+                callbacks::LoopInterruptCallback, &reactor.event_handler
+            )
+        );
+
+        reactor.inbox_event = make<UEvent>(
+            evuser_new(
+                reactor.ebase.get(), callbacks::InboxCallback, &reactor.event_handler
+            )
+        );
+
+        if (!reactor.ebase || !reactor.interrupt_event || !reactor.inbox_event) {
+            logger(LogLevel::WARNING,
+                "Failed to allocate one or more libevent structures");
+            reactors.clear();
+            return AllocError {};
+        }
+    }
+
+    Reactor& first = *reactors.front();
     read_internal_event = make<UEvent>(
         evuser_new(
-            ebase.get(), callbacks::InternalReadCallback, &callback_data
+            first.ebase.get(), callbacks::InternalReadCallback, &first.event_handler
         )
     );
 
-    if (!ebase || !interrupt_event || !read_internal_event) {
+    if (!read_internal_event) {
         logger(LogLevel::WARNING, "Failed to allocate one or more libevent structures");
+        reactors.clear();
         return AllocError {};
     }
 
     return tb::ok;
 }
 
-void Server::Listen()
+void Server::Listen(Reactor& reactor)
 {
-    while (event_base_loop(ebase.get(), EVLOOP_NO_EXIT_ON_EMPTY) == 0) {
-        switch (callback_data.type) {
-        case EventType::NEW_CONNECTION: {
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            AddConnection(callback_data.socket, callback_data.address.sa_family);
-            break;
-        }
-        case EventType::READ_READY: {
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            Server::HandleIter iter = GetClientBySocket(callback_data.socket);
-            if (iter == clients.end()) break;
-            Serve(iter);
-
-            break;
-        }
-        case EventType::TIMEOUT: {
-            Server::HandleIter iter = GetClientBySocket(callback_data.socket);
-            if (iter == clients.end()) break;
-
-            if (!iter->handshaken) iter->Disconnect("Failed handshake");
-            break;
-        }
-        case EventType::INTERNAL_READ_READY: {
-            event_del(read_internal_event.get());
-            std::vector<std::pair<Client*, Message>> messages;
-            {
-                std::lock_guard<std::mutex> guard(internal_mutex);
-                messages = std::move(internal_messages);
-            }
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            for (auto& [client_ptr, message] : messages) {
-                Server::HandleIter iter = GetClientByPointer(client_ptr);
-                if (iter == clients.end()) continue;
-                HandleMessage(*iter, std::move(message));
-            }
-            break;
-        }
-        case EventType::INTERRUPT:
-            return;
-        case EventType::WRITE_READY:
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            Server::HandleIter iter = GetClientBySocket(callback_data.socket);
-            if (iter == clients.end()) break;
-
-            iter->stream.Flush().ignore_error();
-            break;
-        }
+    reactor.listening = true;
+    while (reactor.listening) {
+        // Returns once the handlers of everything the poll reported have run
+        int flags = EVLOOP_ONCE | EVLOOP_NO_EXIT_ON_EMPTY;
+        if (event_base_loop(reactor.ebase.get(), flags) < 0) break;
+
+        std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+        RemoveDisconnected(reactor);
     }
 }
 
-void Server::AddConnection(int fd, sa_family_t addr_family)
+void Server::HandleEvent(Reactor& reactor, const Event& event)
 {
-    ConnectionType conn_type;
-    std::string_view debug_string;
+    switch (event.type) {
+    case EventType::NEW_CONNECTION:
+        Accept(reactor, event.socket, event.listener);
+        break;
+    case EventType::INTERNAL_READ_READY: {
+        event_del(read_internal_event.get());
+        std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+        internal_messages.Drain([this, &reactor] (std::pair<SlotKey, Message>&& item) {
+            // Gone if it disconnected after writing
+            ClientHandle* handle = GetClient(reactor, item.first);
+            if (!handle) return;
+            HandleMessage(*handle, LazyMessage { std::move(item.second) });
+        });
+        break;
+    }
+    case EventType::INBOX_READY:
+        HandleInbox(reactor);
+        break;
+    case EventType::INTERRUPT:
+        reactor.listening = false;
+        event_base_loopbreak(reactor.ebase.get());
+        break;
+    default:
+        break;
+    }
+}
 
-    switch (addr_family) {
-    case AF_LOCAL:
-        conn_type = ConnectionType::UNIX;
-        evconnlistener_enable(unix_listener.get());
-        debug_string = "UNIX";
+void Server::HandleClientEvent(Reactor& reactor, SlotKey slot, const Event& event)
+{
+    std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+    ClientHandle* handle = GetClient(reactor, slot);
+    // Its events may already be ready when it is disconnected by something else
+    if (!handle || !handle->connected) return;
+
+    switch (event.type) {
+    case EventType::READ_READY:
+        Serve(*handle);
+        break;
+    case EventType::WRITE_READY:
+        handle->Flush();
+        break;
+    case EventType::TIMEOUT:
+        if (!handle->handshaken) handle->Disconnect("Failed handshake");
         break;
-    case AF_INET:
     default:
-        conn_type = ConnectionType::INTERNET;
-        evconnlistener_enable(ip_listener.get());
-        debug_string = "internet";
         break;
     }
+}
 
-    clients.emplace_back(conn_type, fd, ebase.get(), callback_data);
+void Server::RemoveDisconnected(Reactor& reactor)
+{
+    if (!reactor.clients_disconnected) return;
+    reactor.clients_disconnected = false;
+
+    // Handles are only removed here, between passes of the event loop, as their
+    // events may still be running while they disconnect
+    std::vector<std::string> teamnames;
+    reactor.clients.EraseIf([this, &reactor, &teamnames] (ClientHandle& handle) {
+        if (handle.connected) return false;
+        AbortChunks(handle);
+        if (handle.handshaken) RemoveMember(reactor, handle.id);
+        if (handle.conn_type != ConnectionType::INTERNAL) --reactor.connections;
+        else reactor.internal_clients.erase(handle.client_ptr);
+        teamnames.emplace_back(std::move(handle.preferences.teamname));
+        return true;
+    });
 
-    logger(LogLevel::DEBUG,
-        fmt::format("New client connected on {} domain, fd = {}", debug_string, fd));
+    for (const std::string& teamname : teamnames) {
+        BroadcastAll(reactor, {
+            .type { MSG_DISCONNECT },
+            .content = {
+                { "who", teamname }
+            }
+        });
+    }
 }
 
-// ClientHandle iteration
-
-auto Server::GetClientBySocket(int fd) -> HandleIter
+void Server::RemoveClient(Reactor& reactor, ClientHandle& client_handle)
 {
-    auto iter = std::ranges::find_if(clients,
-        [fd] (ClientHandle& handle) {
-            return handle.stream.GetSocket() == fd;
+    AbortChunks(client_handle);
+    if (client_handle.handshaken) RemoveMember(reactor, client_handle.id);
+    std::string teamname = std::move(client_handle.preferences.teamname);
+
+    if (client_handle.conn_type == ConnectionType::INTERNAL)
+        reactor.internal_clients.erase(client_handle.client_ptr);
+    reactor.clients.Erase(client_handle.slot);
+
+    BroadcastAll(reactor, {
+        .type { MSG_DISCONNECT },
+        .content = {
+            { "who", teamname }
         }
-    );
+    });
+}
 
-    if (iter == clients.end())
-        logger(LogLevel::WARNING,
-            fmt::format("No client with file descriptor {} found", fd));
+void Server::Accept(Reactor& reactor, FileDescriptor fd, evconnlistener* listener)
+{
+    ConnectionType conn_type = ConnectionType::INTERNET;
+    if (listener == unix_listener.get()) conn_type = ConnectionType::UNIX;
+    else if (listener == shm_listener.get()) conn_type = ConnectionType::SHM;
+
+    // The kernel has already picked a reactor for connections to sharded listeners
+    Reactor& chosen = conn_type == ConnectionType::INTERNET && ShardsIPListeners() ?
+        reactor : ChooseReactor();
+    ++chosen.connections;
+    if (&chosen == &reactor) {
+        std::lock_guard<std::mutex> guard(reactor.clients_mutex);
+        AddConnection(reactor, fd, conn_type);
+        return;
+    }
 
-    return iter;
+    Send(chosen.index, {
+        .type = Delivery::CONNECTION, .socket = fd, .conn_type = conn_type
+    });
 }
 
-auto Server::GetClientByPointer(Client* ptr) -> HandleIter
+auto Server::ChooseReactor() -> Reactor&
 {
-    auto iter = std::ranges::find_if(clients,
-        [ptr] (ClientHandle& handle) {
-            return handle.client_ptr == ptr;
-        }
-    );
+    if (preferences.balancing == ReactorBalancing::LEAST_LOADED) {
+        return **std::ranges::min_element(reactors, {}, [] (const auto& reactor) {
+            return reactor->connections.load();
+        });
+    }
 
-    if (iter == clients.end())
-        logger(LogLevel::WARNING,
-            fmt::format("No client with pointer {} found",
-                        static_cast<void*>(ptr)));
+    return *reactors[next_reactor++ % reactors.size()];
+}
 
-    return iter;
+bool Server::ShardsIPListeners() const
+{
+    // Elsewhere SO_REUSEPORT does not spread connections, or libevent does not set it
+#ifdef __linux__
+    return preferences.shard_ip_listeners && reactors.size() > 1;
+#else
+    return false;
+#endif
 }
 
-auto Server::GetFirstAvailable(std::string_view team, std::string_view type,
-                               const ClientHandle& exclude) -> HandleIter
+void Server::AddConnection(Reactor& reactor, FileDescriptor fd, ConnectionType conn_type)
 {
-    HandleIter result = clients.end();
+    std::string_view debug_string = "internet";
+    if (conn_type == ConnectionType::UNIX) debug_string = "UNIX";
+    else if (conn_type == ConnectionType::SHM) debug_string = "UNIX (shared memory)";
+
+    // The key of the slot it is about to take, for its events to find it by
+    auto [slot, handle] = reactor.clients.Emplace(*this, reactor, conn_type, fd,
+        [this, &reactor, slot = reactor.clients.NextKey()] (const Event& event) {
+            HandleClientEvent(reactor, slot, event);
+        });
+    handle.id = next_client_id++;
+    handle.slot = slot;
+    if (!handle.connected) reactor.clients_disconnected = true;
+
+    logger(LogLevel::DEBUG, fmt::format("New client connected on {} domain, fd = {}, "
+        "reactor {}", debug_string, fd, reactor.index));
+}
 
-    for (auto it = clients.begin(); it != clients.end(); ++it) {
-        if ((it->preferences.teamname == team || team == MSG_ALL) && &(*it) != &exclude)
-            result = it;
-        else continue;
-        if (result->Available(type)) return result;
+// ClientHandle iteration
+
+auto Server::GetClientByPointer(Reactor& reactor, Client* ptr) -> ClientHandle*
+{
+    auto iter = reactor.internal_clients.find(ptr);
+    if (iter == reactor.internal_clients.end()) {
+        logger(LogLevel::WARNING,
+            fmt::format("No client with pointer {} found",
+                        static_cast<void*>(ptr)));
+        return nullptr;
     }
 
-    return result;
+    return reactor.clients.Get(iter->second);
+}
+
+auto Server::GetClient(Reactor& reactor, SlotKey slot) -> ClientHandle*
+{
+    // Recipients of a chunked message may have disconnected since it started
+    return reactor.clients.Get(slot);
 }
 
 }
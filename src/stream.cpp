@@ -1,34 +1,379 @@
 #include "stream.hpp"
 
+#include "envelope.hpp"
+
 #include <algorithm>
+#include <bit>
+#include <optional>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <zstd.h>
 
 namespace buxtehude
 {
 
-ByteBuffer::ByteBuffer(size_t size) : data_(size) {}
+namespace
+{
+
+// Cheapest level, since messages are compressed on the thread that routes them
+constexpr int COMPRESSION_LEVEL = 1;
 
-auto ByteBuffer::WriteFromStream(FILE* stream, size_t bytes) -> tb::error<IOError>
+using UCompressionContext = std::unique_ptr<ZSTD_CCtx, tb::deleter<ZSTD_freeCCtx>>;
+using UDecompressionContext = std::unique_ptr<ZSTD_DCtx, tb::deleter<ZSTD_freeDCtx>>;
+
+// Decompresses `data` into `out`, which comes from the BufferPool. Returns the
+// decompressed size, or nothing if the data is corrupt.
+auto Decompress(std::span<const uint8_t> data, size_t content_size, Slab& out)
+-> std::optional<size_t>
 {
-    if (write_position_ + bytes > data_.view().size())
-        return IOError { IOError::BUFFER_FULL };
+    thread_local UDecompressionContext context { ZSTD_createDCtx() };
+    if (!context) return std::nullopt;
 
-    size_t bytes_read = fread(data_.view().data() + write_position_, 1, bytes, stream);
-    write_position_ += bytes_read;
+    out = BufferPool::Shared().Acquire(content_size);
+    size_t size = ZSTD_decompressDCtx(context.get(), out.view().data(), content_size,
+        data.data(), data.size());
+    if (ZSTD_isError(size) || size != content_size) return std::nullopt;
+
+    return size;
+}
+
+// Layout of a SHM connection's memory: both ring controls, then the client-to-server
+// ring, then the server-to-client one
+constexpr size_t SHM_CONTROL_SIZE = 4096;
+constexpr size_t SHM_SIZE = SHM_CONTROL_SIZE + ShmChannel::RING_SIZE * 2;
+static_assert(sizeof(ShmRingControl) * 2 <= SHM_CONTROL_SIZE);
+
+// Sent over the socket with the descriptors of a new SHM connection
+constexpr uint8_t SHM_PREAMBLE = 's';
+
+}
+
+// BufferPool
+
+auto BufferPool::Shared() -> BufferPool&
+{
+    // Never destroyed, so buffers released during static destruction are still safe
+    static BufferPool* pool = new BufferPool;
+    return *pool;
+}
+
+auto BufferPool::SlabSize(size_t size) -> size_t
+{
+    return std::max(MIN_SLAB_SIZE, std::bit_ceil(size));
+}
+
+auto BufferPool::Acquire(size_t size) -> Slab
+{
+    size_t slab_size = SlabSize(size);
+    size_t size_class = std::countr_zero(slab_size / MIN_SLAB_SIZE);
 
-    if (bytes_read < bytes) {
-        if (feof(stream))
-            return IOError { IOError::STREAM_CLOSED, errno };
+    if (size_class < SIZE_CLASSES) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto& slabs = free_slabs_[size_class];
+        if (!slabs.empty()) {
+            Slab slab = std::move(slabs.back());
+            slabs.pop_back();
+            return slab;
+        }
+    }
+
+    return Slab { slab_size };
+}
+
+void BufferPool::Release(Slab slab)
+{
+    size_t slab_size = slab.view().size();
+    if (slab_size < MIN_SLAB_SIZE || !std::has_single_bit(slab_size)) return;
+
+    size_t size_class = std::countr_zero(slab_size / MIN_SLAB_SIZE);
+    if (size_class >= SIZE_CLASSES) return;
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto& slabs = free_slabs_[size_class];
+    if ((slabs.size() + 1) * slab_size <= MAX_POOLED_BYTES_PER_CLASS)
+        slabs.emplace_back(std::move(slab));
+}
+
+// ShmChannel
+
+auto ShmChannel::Create() -> tb::result<std::unique_ptr<ShmChannel>, IOError>
+{
+#ifdef __linux__
+    std::unique_ptr<ShmChannel> channel { new ShmChannel { Side::CLIENT, {
+        memfd_create("buxtehude-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+        eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)
+    } } };
+
+    if (channel->memory_ < 0 || channel->client_wake_ < 0 || channel->server_wake_ < 0
+        || ftruncate(channel->memory_, SHM_SIZE) < 0
+        || fcntl(channel->memory_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
         return IOError { IOError::FILE_ERROR, errno };
     }
 
+    if (auto error = channel->Map(); error.is_error()) return error.get_error();
+
+    // Fresh memory is zeroed, so only the flags that are not start out set. Nobody is
+    // reading yet, so the first write to either ring wakes its reader.
+    channel->out_->reader_waiting = 1;
+    channel->in_->reader_waiting = 1;
+
+    return channel;
+#else
+    return IOError { IOError::FILE_ERROR, ENOTSUP };
+#endif
+}
+
+auto ShmChannel::Adopt(const Descriptors& descriptors)
+-> tb::result<std::unique_ptr<ShmChannel>, IOError>
+{
+#ifdef __linux__
+    std::unique_ptr<ShmChannel> channel { new ShmChannel { Side::SERVER, descriptors } };
+
+    struct stat status;
+    int seals = fcntl(channel->memory_, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(channel->memory_, &status) < 0
+        || size_t(status.st_size) < SHM_SIZE) {
+        return IOError { IOError::FILE_ERROR, EINVAL };
+    }
+
+    // Whatever the client says they are, never block on them
+    for (FileDescriptor fd : { channel->client_wake_, channel->server_wake_ }) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            return IOError { IOError::FILE_ERROR, errno };
+    }
+
+    if (auto error = channel->Map(); error.is_error()) return error.get_error();
+
+    // The client may have written already
+    channel->read_position_ = channel->in_->head.load();
+    channel->write_position_ = channel->out_->tail.load();
+
+    return channel;
+#else
+    for (FileDescriptor fd : descriptors) close(fd);
+    return IOError { IOError::FILE_ERROR, ENOTSUP };
+#endif
+}
+
+ShmChannel::ShmChannel(Side side, const Descriptors& descriptors)
+    : side_(side), memory_(descriptors[0]), client_wake_(descriptors[1]),
+      server_wake_(descriptors[2]) {}
+
+ShmChannel::~ShmChannel()
+{
+    if (mapping_) munmap(mapping_, SHM_SIZE);
+    for (FileDescriptor fd : { memory_, client_wake_, server_wake_ }) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+auto ShmChannel::Map() -> tb::error<IOError>
+{
+    void* mapping = mmap(nullptr, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+        memory_, 0);
+    if (mapping == MAP_FAILED) return IOError { IOError::FILE_ERROR, errno };
+    mapping_ = static_cast<uint8_t*>(mapping);
+
+    auto* controls = reinterpret_cast<ShmRingControl*>(mapping_);
+    uint8_t* to_server = mapping_ + SHM_CONTROL_SIZE;
+    uint8_t* to_client = to_server + RING_SIZE;
+
+    if (side_ == Side::CLIENT) {
+        out_ = &controls[0], out_data_ = to_server;
+        in_ = &controls[1], in_data_ = to_client;
+    } else {
+        in_ = &controls[0], in_data_ = to_server;
+        out_ = &controls[1], out_data_ = to_client;
+    }
+
+    return tb::ok;
+}
+
+auto ShmChannel::GetDescriptors() const -> Descriptors
+{
+    return { memory_, client_wake_, server_wake_ };
+}
+
+auto ShmChannel::GetWakeDescriptor() const -> FileDescriptor
+{
+    return side_ == Side::CLIENT ? client_wake_ : server_wake_;
+}
+
+auto ShmChannel::Write(std::span<const uint8_t> data) -> tb::result<size_t, IOError>
+{
+    uint64_t used = write_position_ - out_->head.load(std::memory_order_acquire);
+    if (used > RING_SIZE) return IOError { IOError::STREAM_CLOSED };
+
+    size_t size = std::min<size_t>(data.size(), RING_SIZE - used);
+    if (size == 0) return size;
+
+    size_t offset = write_position_ % RING_SIZE;
+    size_t first = std::min(size, RING_SIZE - offset);
+    memcpy(out_data_ + offset, data.data(), first);
+    memcpy(out_data_, data.data() + first, size - first);
+
+    write_position_ += size;
+    out_->tail.store(write_position_, std::memory_order_release);
+
+    // Pairs with WaitForData() on the other side
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (out_->reader_waiting.load(std::memory_order_relaxed)
+        && out_->reader_waiting.exchange(0)) {
+        Signal(side_ == Side::CLIENT ? server_wake_ : client_wake_);
+    }
+
+    return size;
+}
+
+auto ShmChannel::Read(std::span<uint8_t> out) -> tb::result<size_t, IOError>
+{
+    uint64_t available = in_->tail.load(std::memory_order_acquire) - read_position_;
+    if (available > RING_SIZE) return IOError { IOError::STREAM_CLOSED };
+
+    size_t size = std::min<size_t>(out.size(), available);
+    if (size == 0) return size;
+
+    size_t offset = read_position_ % RING_SIZE;
+    size_t first = std::min(size, RING_SIZE - offset);
+    memcpy(out.data(), in_data_ + offset, first);
+    memcpy(out.data() + first, in_data_, size - first);
+
+    read_position_ += size;
+    in_->head.store(read_position_, std::memory_order_release);
+
+    // Pairs with WaitForSpace() on the other side
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (in_->writer_waiting.load(std::memory_order_relaxed)
+        && in_->writer_waiting.exchange(0)) {
+        Signal(side_ == Side::CLIENT ? server_wake_ : client_wake_);
+    }
+
+    return size;
+}
+
+auto ShmChannel::WaitForData() -> bool
+{
+    in_->reader_waiting.store(1);
+    return in_->tail.load() == read_position_;
+}
+
+auto ShmChannel::WaitForSpace() -> bool
+{
+    out_->writer_waiting.store(1);
+    return write_position_ - out_->head.load() >= RING_SIZE;
+}
+
+void ShmChannel::ClearWake()
+{
+    // Fails harmlessly if it had not fired after all
+    uint64_t count;
+    [[maybe_unused]] ssize_t result = read(GetWakeDescriptor(), &count, sizeof(count));
+}
+
+void ShmChannel::WakeSelf()
+{
+    Signal(GetWakeDescriptor());
+}
+
+void ShmChannel::Signal(FileDescriptor fd)
+{
+    // Only fails if the counter is about to overflow, when it is still set anyway
+    uint64_t count = 1;
+    [[maybe_unused]] ssize_t result = write(fd, &count, sizeof(count));
+}
+
+// ByteBuffer
+
+ByteBuffer::ByteBuffer(size_t initial_size, size_t max_size)
+    : initial_size_(initial_size), max_size_(max_size)
+{
+    if (initial_size_ > 0) data_ = BufferPool::Shared().Acquire(initial_size_);
+}
+
+ByteBuffer::ByteBuffer(ByteBuffer&& other) noexcept
+    : data_(std::exchange(other.data_, Slab {})),
+      initial_size_(other.initial_size_), max_size_(other.max_size_),
+      write_position_(std::exchange(other.write_position_, 0)),
+      read_position_(std::exchange(other.read_position_, 0)) {}
+
+ByteBuffer& ByteBuffer::operator=(ByteBuffer&& other) noexcept
+{
+    if (this == &other) return *this;
+
+    if (Capacity() > 0) BufferPool::Shared().Release(std::exchange(data_, Slab {}));
+    data_ = std::exchange(other.data_, Slab {});
+    initial_size_ = other.initial_size_;
+    max_size_ = other.max_size_;
+    write_position_ = std::exchange(other.write_position_, 0);
+    read_position_ = std::exchange(other.read_position_, 0);
+
+    return *this;
+}
+
+ByteBuffer::~ByteBuffer()
+{
+    if (Capacity() > 0) BufferPool::Shared().Release(std::exchange(data_, Slab {}));
+}
+
+auto ByteBuffer::WriteFromSocket(FileDescriptor socket,
+    std::deque<FileDescriptor>& descriptors) -> tb::error<IOError>
+{
+    if (BytesFree() == 0 && Reserve(BufferPool::MIN_SLAB_SIZE).is_error())
+        return IOError { IOError::BUFFER_FULL };
+
+    iovec iov { data_.view().data() + write_position_, BytesFree() };
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(FileDescriptor) * 16)];
+    msghdr message {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t bytes_read = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t bytes_read = recvmsg(socket, &message, 0);
+#endif
+
+    if (bytes_read > 0) {
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg;
+             cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(FileDescriptor);
+            for (size_t i = 0; i < count; ++i) {
+                FileDescriptor fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(FileDescriptor), sizeof(fd));
+                descriptors.push_back(fd);
+            }
+        }
+    }
+
+    if (bytes_read == 0)
+        return IOError { IOError::STREAM_CLOSED };
+    if (bytes_read < 0)
+        return IOError { IOError::FILE_ERROR, errno };
+
+    write_position_ += bytes_read;
+
     return tb::ok;
 }
 
 auto ByteBuffer::WriteFromMemory(tb::contiguous_byte_range auto const& source)
 -> tb::error<IOError>
 {
-    if (write_position_ + std::size(source) > data_.view().size())
-        return IOError { IOError::BUFFER_FULL };
+    if (auto io_error = Reserve(std::size(source)); io_error.is_error())
+        return io_error;
 
     memcpy(data_.view().data() + write_position_, std::data(source), std::size(source));
     write_position_ += source.size();
@@ -36,11 +381,22 @@ auto ByteBuffer::WriteFromMemory(tb::contiguous_byte_range auto const& source)
     return tb::ok;
 }
 
+auto ByteBuffer::WriteFromShm(ShmChannel& channel) -> tb::result<size_t, IOError>
+{
+    if (BytesFree() == 0 && Reserve(BufferPool::MIN_SLAB_SIZE).is_error())
+        return IOError { IOError::BUFFER_FULL };
+
+    auto result = channel.Read({ data_.view().data() + write_position_, BytesFree() });
+    if (result.is_ok()) write_position_ += result.get_mut_unchecked();
+
+    return result;
+}
+
 template<typename T> requires std::is_scalar_v<T>
 auto ByteBuffer::WriteFromMemory(T object) -> tb::error<IOError>
 {
-    if (write_position_ + sizeof(T) > data_.view().size())
-        return IOError { IOError::BUFFER_FULL };
+    if (auto io_error = Reserve(sizeof(T)); io_error.is_error())
+        return io_error;
 
     memcpy(data_.view().data() + write_position_, &object, sizeof(T));
     write_position_ += sizeof(T);
@@ -48,35 +404,67 @@ auto ByteBuffer::WriteFromMemory(T object) -> tb::error<IOError>
     return tb::ok;
 }
 
-auto ByteBuffer::ReadIntoStream(FILE* stream, size_t bytes) -> tb::error<IOError>
+template<typename T> requires std::is_scalar_v<T>
+auto ByteBuffer::ReadIntoMemory(T& object) -> tb::error<IOError>
 {
-    if (read_position_ == write_position_)
+    if (BytesToRead() < sizeof(T))
         return IOError { IOError::BUFFER_EMPTY };
 
-    bytes = std::min(BytesToRead(), bytes);
+    memcpy(&object, data_.view().data() + read_position_, sizeof(T));
+    read_position_ += sizeof(T);
+
+    return tb::ok;
+}
 
-    size_t bytes_written = fwrite(data_.view().data() + read_position_, 1, bytes, stream);
-    read_position_ += bytes_written;
+auto ByteBuffer::Reserve(size_t bytes) -> tb::error<IOError>
+{
+    if (BytesFree() >= bytes) return tb::ok;
 
-    if (bytes_written < bytes) {
-        if (feof(stream))
-            return IOError { IOError::STREAM_CLOSED, errno };
-        return IOError { IOError::FILE_ERROR, errno };
+    size_t unread = BytesToRead();
+    if (unread + bytes <= Capacity()) {
+        Compact();
+        return tb::ok;
     }
 
+    if (unread + bytes > max_size_)
+        return IOError { IOError::BUFFER_FULL };
+
+    Slab slab = BufferPool::Shared().Acquire(unread + bytes);
+    if (unread > 0)
+        memcpy(slab.view().data(), data_.view().data() + read_position_, unread);
+    if (Capacity() > 0) BufferPool::Shared().Release(std::exchange(data_, Slab {}));
+
+    data_ = std::move(slab);
+    read_position_ = 0;
+    write_position_ = unread;
+
     return tb::ok;
 }
 
-template<typename T> requires std::is_scalar_v<T>
-auto ByteBuffer::ReadIntoMemory(T& object) -> tb::error<IOError>
+void ByteBuffer::Shrink()
 {
-    if (BytesToRead() < sizeof(T))
-        return IOError { IOError::BUFFER_EMPTY };
+    if (BytesToRead() > 0) return;
 
-    memcpy(&object, data_.view().data() + read_position_, sizeof(T));
-    read_position_ += sizeof(T);
+    Reset();
+    if (Capacity() <= initial_size_) return;
 
-    return tb::ok;
+    BufferPool::Shared().Release(std::exchange(data_, Slab {}));
+    if (initial_size_ > 0) data_ = BufferPool::Shared().Acquire(initial_size_);
+}
+
+void ByteBuffer::Skip(size_t bytes)
+{
+    read_position_ += std::min(BytesToRead(), bytes);
+    if (read_position_ == write_position_) Reset();
+}
+
+void ByteBuffer::Compact()
+{
+    if (read_position_ == 0) return;
+
+    memmove(data_.view().data(), data_.view().data() + read_position_, BytesToRead());
+    write_position_ -= read_position_;
+    read_position_ = 0;
 }
 
 void ByteBuffer::Reset()
@@ -90,40 +478,224 @@ auto ByteBuffer::BytesToRead() const -> size_t
     return write_position_ - read_position_;
 }
 
+auto ByteBuffer::BytesFree() const -> size_t
+{
+    return data_.view().size() - write_position_;
+}
+
+auto ByteBuffer::Capacity() const -> size_t
+{
+    return data_.view().size();
+}
+
 auto ByteBuffer::ReadView() const -> std::span<uint8_t>
 {
     return std::span<uint8_t> { data_.view().data() + read_position_, BytesToRead() };
 }
 
-auto Stream::FromSocket(FileDescriptor socket, event_base* ebase,
-    EventCallbackData& callback_data)
+// Batches
+
+auto SplitBatch(std::span<const uint8_t> payload,
+    const std::function<void(std::span<const uint8_t>)>& f) -> bool
+{
+    while (!payload.empty()) {
+        if (payload.size() < BATCH_ENTRY_HEADER_SIZE) return false;
+
+        uint32_t length = payload[0] | (payload[1] << 8) | (payload[2] << 16)
+                        | (uint32_t { payload[3] } << 24);
+        payload = payload.subspan(BATCH_ENTRY_HEADER_SIZE);
+        if (length > payload.size()) return false;
+
+        f(payload.first(length));
+        payload = payload.subspan(length);
+    }
+
+    return true;
+}
+
+// ChunkHeader
+
+auto ChunkHeader::Parse(std::span<const uint8_t> payload) -> std::optional<ChunkHeader>
+{
+    if (payload.size() < CHUNK_HEADER_SIZE) return std::nullopt;
+
+    // Little-endian, like the rest of the protocol
+    uint32_t stream_id = payload[0] | (payload[1] << 8) | (payload[2] << 16)
+                       | (uint32_t { payload[3] } << 24);
+
+    return ChunkHeader { stream_id, payload[4] };
+}
+
+// EncodedFrame
+
+auto EncodedFrame::Encode(MessageFormat format, const Message& message) -> SharedFrame
+{
+    std::string payload;
+
+    switch (format) {
+    case MessageFormat::JSON:
+        payload = json(message).dump();
+        break;
+    case MessageFormat::MSGPACK:
+        json::to_msgpack(message, payload);
+        break;
+    case MessageFormat::BINARY:
+        if (AppendBinaryEnvelope(payload, message.type, message.dest, message.src,
+            message.only_first, message.key, message.correlation, message.reply,
+            message.requester)) {
+            if (!message.content.empty()) json::to_msgpack(message.content, payload);
+            break;
+        }
+        // Too long for the binary envelope, but BINARY peers read MessagePack too
+        format = MessageFormat::MSGPACK;
+        json::to_msgpack(message, payload);
+        break;
+    }
+
+    return FromPayload(format, std::move(payload), 0, message.attachment);
+}
+
+auto EncodedFrame::FromPayload(MessageFormat format, std::string&& payload,
+    uint8_t flags, SharedAttachment attachment) -> SharedFrame
+{
+    auto frame = std::make_shared<EncodedFrame>();
+    frame->payload = std::move(payload);
+    if (attachment) flags |= FRAME_ATTACHMENT;
+    frame->attachment = std::move(attachment);
+
+    uint32_t length = frame->payload.size();
+    frame->header[0] = static_cast<uint8_t>(format) | flags;
+    memcpy(frame->header.data() + sizeof(MessageFormat), &length, sizeof(uint32_t));
+
+    return frame;
+}
+
+auto EncodedFrame::EncodeChunk(MessageFormat format, ChunkHeader header,
+    std::span<const uint8_t> data) -> SharedFrame
+{
+    std::string payload;
+    payload.reserve(CHUNK_HEADER_SIZE + data.size());
+    for (int shift = 0; shift < 32; shift += 8) payload.push_back(header.stream_id >> shift);
+    payload.push_back(header.flags);
+    payload.append(data.begin(), data.end());
+
+    return FromPayload(format, std::move(payload), FRAME_CHUNK);
+}
+
+auto EncodedFrame::Batch(std::span<const SharedFrame> frames) -> SharedFrame
+{
+    size_t size = 0;
+    for (const SharedFrame& frame : frames)
+        size += BATCH_ENTRY_HEADER_SIZE + frame->payload.size();
+
+    std::string payload;
+    payload.reserve(size);
+    for (const SharedFrame& frame : frames) {
+        uint32_t length = frame->payload.size();
+        for (int shift = 0; shift < 32; shift += 8) payload.push_back(length >> shift);
+        payload += frame->payload;
+    }
+
+    return FromPayload(frames.front()->Format(), std::move(payload), FRAME_BATCH);
+}
+
+auto EncodedFrame::Compress(const SharedFrame& frame, size_t threshold) -> SharedFrame
+{
+    // Frames over the limit are refused when queued, compressed or not
+    if (frame->payload.size() < threshold || frame->payload.size() > MAX_MESSAGE_LENGTH
+        || frame->Flags() & FRAME_COMPRESSED) {
+        return frame;
+    }
+
+    thread_local UCompressionContext context { ZSTD_createCCtx() };
+    if (!context) return frame;
+
+    std::string compressed(ZSTD_compressBound(frame->payload.size()), '\0');
+    size_t size = ZSTD_compressCCtx(context.get(), compressed.data(), compressed.size(),
+        frame->payload.data(), frame->payload.size(), COMPRESSION_LEVEL);
+    if (ZSTD_isError(size) || size >= frame->payload.size()) return frame;
+
+    compressed.resize(size);
+    return FromPayload(frame->Format(), std::move(compressed),
+        frame->Flags() | FRAME_COMPRESSED, frame->attachment);
+}
+
+auto EncodedFrame::Format() const -> MessageFormat
+{
+    return static_cast<MessageFormat>(header[0] & FRAME_FORMAT_MASK);
+}
+
+auto EncodedFrame::Flags() const -> uint8_t
+{
+    return header[0] & ~FRAME_FORMAT_MASK;
+}
+
+auto EncodedFrame::Size() const -> size_t
+{
+    return header.size() + payload.size();
+}
+
+// Stream
+
+Stream::Stream(Stream&& other) noexcept
+    : read_buffer_(std::move(other.read_buffer_)),
+      received_descriptors_(std::move(other.received_descriptors_)),
+      write_queue_(std::move(other.write_queue_)),
+      write_offset_(std::exchange(other.write_offset_, 0)),
+      queued_bytes_(std::exchange(other.queued_bytes_, 0)),
+      read_event_(std::move(other.read_event_)),
+      write_event_(std::move(other.write_event_)),
+      wake_event_(std::move(other.wake_event_)),
+      handler_(std::move(other.handler_)),
+      shm_(std::move(other.shm_)),
+      socket_(std::exchange(other.socket_, INVALID_FILE_DESCRIPTOR)) {}
+
+Stream& Stream::operator=(Stream&& other) noexcept
+{
+    if (this == &other) return *this;
+
+    Close();
+    read_buffer_ = std::move(other.read_buffer_);
+    received_descriptors_ = std::move(other.received_descriptors_);
+    write_queue_ = std::move(other.write_queue_);
+    write_offset_ = std::exchange(other.write_offset_, 0);
+    queued_bytes_ = std::exchange(other.queued_bytes_, 0);
+    read_event_ = std::move(other.read_event_);
+    write_event_ = std::move(other.write_event_);
+    wake_event_ = std::move(other.wake_event_);
+    handler_ = std::move(other.handler_);
+    shm_ = std::move(other.shm_);
+    socket_ = std::exchange(other.socket_, INVALID_FILE_DESCRIPTOR);
+
+    return *this;
+}
+
+Stream::~Stream()
+{
+    Close();
+}
+
+auto Stream::FromSocket(FileDescriptor socket, event_base* ebase, EventHandler handler)
 -> tb::result<Stream, StreamError>
 {
     Stream stream;
     stream.socket_ = socket;
+    stream.handler_ = std::make_unique<EventHandler>(std::move(handler));
 
-    stream.stream_handle_.reset(fdopen(socket, "r+"));
-    if (stream.stream_handle_.get() == nullptr)
-        return StreamError {
-            StreamError::IO_ERROR,
-            IOError { IOError::FILE_ERROR, errno }
-        };
-
-    setvbuf(stream.stream_handle_.get(), nullptr, _IONBF, 0);
     int flags = fcntl(stream.socket_, F_GETFL);
     fcntl(stream.socket_, F_SETFL, flags | O_NONBLOCK);
 
     stream.read_event_.reset(
         event_new(
             ebase, stream.socket_, EV_PERSIST | EV_READ,
-            callbacks::ReadWriteCallback, static_cast<void*>(&callback_data)
+            callbacks::ReadWriteCallback, static_cast<void*>(stream.handler_.get())
         )
     );
 
     stream.write_event_.reset(
         event_new(
             ebase, stream.socket_, EV_WRITE,
-            callbacks::ReadWriteCallback, static_cast<void*>(&callback_data)
+            callbacks::ReadWriteCallback, static_cast<void*>(stream.handler_.get())
         )
     );
 
@@ -132,132 +704,405 @@ auto Stream::FromSocket(FileDescriptor socket, event_base* ebase,
 
     event_add(stream.read_event_.get(), &callbacks::DEFAULT_TIMEOUT);
 
-    stream.read_buffer_ = ByteBuffer { BUFFER_SIZE };
-    stream.write_buffer_ = ByteBuffer { BUFFER_SIZE };
+    stream.read_buffer_ = ByteBuffer { INITIAL_READ_BUFFER_SIZE, BUFFER_SIZE };
 
     return stream;
 }
 
+auto Stream::ConnectShm(event_base* ebase) -> tb::error<StreamError>
+{
+    auto created = ShmChannel::Create();
+    if (created.is_error()) return StreamError { StreamError::IO_ERROR, created.get_error() };
+    std::unique_ptr<ShmChannel> channel = std::move(created.get_mut_unchecked());
+
+    ShmChannel::Descriptors descriptors = channel->GetDescriptors();
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(descriptors))] = {};
+    iovec iov { const_cast<uint8_t*>(&SHM_PREAMBLE), sizeof(SHM_PREAMBLE) };
+    msghdr message {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(descriptors));
+    memcpy(CMSG_DATA(cmsg), descriptors.data(), sizeof(descriptors));
+
+    // A fresh socket always has room for one byte
+    if (sendmsg(socket_, &message, 0) != sizeof(SHM_PREAMBLE))
+        return StreamError { StreamError::IO_ERROR, { IOError::FILE_ERROR, errno } };
+
+    shm_ = std::move(channel);
+    return WatchShm(ebase);
+}
+
+auto Stream::AcceptShm(event_base* ebase) -> tb::error<StreamError>
+{
+    auto io_error = read_buffer_.WriteFromSocket(socket_, received_descriptors_);
+    if (io_error.is_error()) {
+        IOError error = io_error.get_error();
+        if (error.code == EAGAIN || error.code == EWOULDBLOCK)
+            return StreamError { StreamError::IO_ERROR, { IOError::BUFFER_EMPTY } };
+        return StreamError { StreamError::IO_ERROR, error };
+    }
+
+    bool valid = read_buffer_.BytesToRead() == sizeof(SHM_PREAMBLE)
+        && read_buffer_.ReadView()[0] == SHM_PREAMBLE
+        && received_descriptors_.size() == ShmChannel::DESCRIPTOR_COUNT;
+    read_buffer_.Reset();
+    if (!valid) return StreamError { StreamError::INVALID_MESSAGE_TYPE };
+
+    ShmChannel::Descriptors descriptors;
+    std::ranges::copy(received_descriptors_, descriptors.begin());
+    received_descriptors_.clear();
+
+    auto adopted = ShmChannel::Adopt(descriptors);
+    if (adopted.is_error()) return StreamError { StreamError::IO_ERROR, adopted.get_error() };
+
+    shm_ = std::move(adopted.get_mut_unchecked());
+    return WatchShm(ebase);
+}
+
+auto Stream::WatchShm(event_base* ebase) -> tb::error<StreamError>
+{
+    wake_event_.reset(
+        event_new(
+            ebase, shm_->GetWakeDescriptor(), EV_PERSIST | EV_READ,
+            callbacks::ReadWriteCallback, static_cast<void*>(handler_.get())
+        )
+    );
+    if (!wake_event_) return StreamError { StreamError::LIBEVENT_ERROR };
+
+    event_add(wake_event_.get(), nullptr);
+
+    return tb::ok;
+}
+
+auto Stream::UsesShm() const -> bool
+{
+    return shm_ != nullptr;
+}
+
 auto Stream::WriteMessage(MessageFormat format, const Message& message)
 -> tb::error<IOError>
 {
-    clearerr(stream_handle_.get());
+    return QueueFrame(EncodedFrame::Encode(format, message));
+}
 
-    write_buffer_.WriteFromMemory(format).ignore_error();
-    switch (format) {
-    case MessageFormat::JSON: {
-        json object = message;
-        std::string serialised = object.dump();
-
-        write_buffer_.WriteFromMemory<uint32_t>(serialised.size()).ignore_error();
-        if (auto io_error = write_buffer_.WriteFromMemory(serialised);
-            io_error.is_error())
-            return io_error;
-        break;
-    }
-    case MessageFormat::MSGPACK: {
-        std::vector<uint8_t> serialised = json::to_msgpack(message);
+auto Stream::QueueFrame(SharedFrame frame) -> tb::error<IOError>
+{
+    bool was_empty = write_queue_.empty();
+    auto result = AppendFrame(std::move(frame));
+    if (result.is_error()) return result;
 
-        write_buffer_.WriteFromMemory<uint32_t>(serialised.size()).ignore_error();
-        if (auto io_error = write_buffer_.WriteFromMemory(serialised);
-            io_error.is_error())
-            return io_error;
-        break;
-    }
+    // Otherwise the write event is already pending and Flush() will get to it
+    if (was_empty) return Flush();
+
+    return tb::ok;
+}
+
+auto Stream::AppendFrame(SharedFrame frame) -> tb::error<IOError>
+{
+    if (frame->payload.size() > MAX_MESSAGE_LENGTH)
+        return IOError { IOError::BUFFER_FULL };
+
+    queued_bytes_ += frame->Size();
+    write_queue_.emplace_back(std::move(frame));
+
+    return tb::ok;
+}
+
+auto Stream::DropOldest(size_t target_bytes) -> size_t
+{
+    // A frame that has started sending has to be finished
+    auto iter = write_queue_.begin() + (write_offset_ > 0 ? 1 : 0);
+
+    size_t dropped = 0;
+    while (queued_bytes_ > target_bytes && iter != write_queue_.end()) {
+        if ((*iter)->Flags() & FRAME_CHUNK) {
+            ++iter;
+            continue;
+        }
+
+        queued_bytes_ -= (*iter)->Size();
+        iter = write_queue_.erase(iter);
+        ++dropped;
     }
 
-    return Flush();
+    return dropped;
 }
 
-auto Stream::ReadMessage() -> tb::result<Message, StreamError>
+auto Stream::ReadFrames(const FrameCallback& callback) -> tb::error<StreamError>
 {
-    auto reset_stream_state = [this] () {
-        read_buffer_.Reset();
-        read_state_ = ReadState::AWAITING_MESSAGE_FORMAT;
-    };
+    if (shm_) return ReadShmFrames(callback);
 
-    clearerr(stream_handle_.get());
+    // Make room at the end of the buffer for the rest of any partial frame
+    read_buffer_.Compact();
 
-    if (read_state_ == ReadState::AWAITING_MESSAGE_FORMAT) {
-        auto io_error = read_buffer_.WriteFromStream(
-            stream_handle_.get(),
-            sizeof(MessageFormat) - read_buffer_.BytesToRead()
-        );
-        if (io_error.is_error())
+    auto io_error = read_buffer_.WriteFromSocket(socket_, received_descriptors_);
+    while (received_descriptors_.size() > MAX_RECEIVED_DESCRIPTORS) {
+        close(received_descriptors_.back());
+        received_descriptors_.pop_back();
+    }
+    bool filled = read_buffer_.BytesFree() == 0;
+    if (io_error.is_error() && io_error.get_error().code != EAGAIN
+        && io_error.get_error().code != EWOULDBLOCK) {
+        // Frames that arrived before the peer hung up are still delivered
+        if (io_error.get_error().type != IOError::STREAM_CLOSED)
             return StreamError { StreamError::IO_ERROR, io_error.get_error() };
+    }
+
+    if (auto error = ParseFrames(callback); error.is_error()) return error;
+
+    // A read that filled the buffer means more is probably waiting, so double the
+    // buffer for the next one; once the peer goes quiet, hand the memory back.
+    if (filled)
+        read_buffer_.Reserve(read_buffer_.Capacity()).ignore_error();
+    else
+        read_buffer_.Shrink();
+
+    if (io_error.is_error() && io_error.get_error().type == IOError::STREAM_CLOSED)
+        return StreamError { StreamError::IO_ERROR, io_error.get_error() };
+
+    return tb::ok;
+}
+
+auto Stream::ParseFrames(const FrameCallback& callback) -> tb::error<StreamError>
+{
+    while (read_buffer_.BytesToRead() >= HEADER_SIZE) {
+        std::span<uint8_t> view = read_buffer_.ReadView();
+
+        auto format = static_cast<MessageFormat>(view[0] & FRAME_FORMAT_MASK);
+        uint8_t flags = view[0] & ~FRAME_FORMAT_MASK;
+        uint32_t length;
+        memcpy(&length, view.data() + sizeof(MessageFormat), sizeof(uint32_t));
 
-        read_buffer_.ReadIntoMemory(expected_format_).ignore_error();
-        if (expected_format_ != MessageFormat::JSON
-            && expected_format_ != MessageFormat::MSGPACK) {
-            reset_stream_state();
+        if ((format != MessageFormat::JSON && format != MessageFormat::MSGPACK
+            && format != MessageFormat::BINARY)
+            || (flags & ~(FRAME_COMPRESSED | FRAME_CHUNK | FRAME_ATTACHMENT
+                | FRAME_BATCH))
+            || ((flags & FRAME_BATCH) && (flags & (FRAME_CHUNK | FRAME_ATTACHMENT)))) {
+            read_buffer_.Reset();
             return StreamError { StreamError::INVALID_MESSAGE_TYPE };
         }
 
-        read_state_ = ReadState::AWAITING_MESSAGE_LENGTH;
-    }
+        if (length > MAX_MESSAGE_LENGTH) {
+            read_buffer_.Reset();
+            return StreamError { StreamError::INVALID_MESSAGE_LENGTH };
+        }
 
-    if (read_state_ == ReadState::AWAITING_MESSAGE_LENGTH) {
-        auto io_error = read_buffer_.WriteFromStream(
-            stream_handle_.get(),
-            sizeof(uint32_t) - read_buffer_.BytesToRead()
-        );
-        if (io_error.is_error())
-            return StreamError { StreamError::IO_ERROR, io_error.get_error() };
+        if (view.size() < HEADER_SIZE + length) {
+            // Grow now so the rest of the frame can be received in one go
+            read_buffer_.Reserve(HEADER_SIZE + length - view.size()).ignore_error();
+            break;
+        }
 
-        read_buffer_.ReadIntoMemory(expected_length_).ignore_error();
-        if (expected_length_ > MAX_MESSAGE_LENGTH) {
-            reset_stream_state();
+        // Descriptors arrive no later than the first byte of the frame they go with
+        SharedAttachment attachment;
+        if ((flags & FRAME_ATTACHMENT) && !received_descriptors_.empty()) {
+            FileDescriptor fd = received_descriptors_.front();
+            received_descriptors_.pop_front();
+            Attachment::FromDescriptor(fd).if_ok_mut([&attachment] (SharedAttachment& a) {
+                attachment = std::move(a);
+            });
+        }
+        if ((flags & FRAME_ATTACHMENT) && !attachment) {
+            read_buffer_.Skip(HEADER_SIZE + length);
+            continue;
+        }
+        flags &= ~FRAME_ATTACHMENT;
+
+        std::span<const uint8_t> payload = view.subspan(HEADER_SIZE, length);
+        if (!(flags & FRAME_COMPRESSED)) {
+            callback(format, flags, payload, std::move(attachment));
+            read_buffer_.Skip(HEADER_SIZE + length);
+            continue;
+        }
+
+        // The limit applies to the message once decompressed as well
+        size_t content_size = ZSTD_getFrameContentSize(payload.data(), payload.size());
+        if (content_size == ZSTD_CONTENTSIZE_ERROR
+            || content_size == ZSTD_CONTENTSIZE_UNKNOWN
+            || content_size > MAX_MESSAGE_LENGTH) {
+            read_buffer_.Reset();
             return StreamError { StreamError::INVALID_MESSAGE_LENGTH };
         }
 
-        read_state_ = ReadState::AWAITING_MESSAGE_DATA;
+        Slab decompressed;
+        std::optional<size_t> size = Decompress(payload, content_size, decompressed);
+        read_buffer_.Skip(HEADER_SIZE + length);
+
+        // Like malformed messages, corrupt frames are dropped
+        if (size)
+            callback(format, flags & ~FRAME_COMPRESSED, decompressed.view().first(*size),
+                std::move(attachment));
+        if (decompressed.view().size()) BufferPool::Shared().Release(std::move(decompressed));
     }
 
-    json object;
-    if (read_state_ == ReadState::AWAITING_MESSAGE_DATA) {
-        auto io_error = read_buffer_.WriteFromStream(
-            stream_handle_.get(),
-            expected_length_ - read_buffer_.BytesToRead()
-        );
-        if (io_error.is_error())
-            return StreamError { StreamError::IO_ERROR, io_error.get_error() };
 
-        switch (expected_format_) {
-        case MessageFormat::JSON:
-            object = json::parse(read_buffer_.ReadView(), nullptr, false);
-            break;
-        case MessageFormat::MSGPACK:
-            object = json::from_msgpack(read_buffer_.ReadView(), true, false);
-            break;
+    return tb::ok;
+}
+
+auto Stream::ReadShmFrames(const FrameCallback& callback) -> tb::error<StreamError>
+{
+    shm_->ClearWake();
+
+    size_t total = 0;
+    for (;;) {
+        read_buffer_.Compact();
+        auto result = read_buffer_.WriteFromShm(*shm_);
+        if (result.is_error()) {
+            read_buffer_.Reset();
+            return StreamError { StreamError::IO_ERROR, result.get_error() };
         }
 
-        reset_stream_state();
-        if (object.is_discarded())
-            return StreamError { StreamError::PARSE_ERROR };
+        if (auto error = ParseFrames(callback); error.is_error()) return error;
+
+        size_t bytes_read = result.get_mut_unchecked();
+        total += bytes_read;
+        if (bytes_read > 0 && total >= MAX_SHM_READ) {
+            shm_->WakeSelf();
+            break;
+        }
+        if (bytes_read == 0 && shm_->WaitForData()) break;
     }
-    return object.get<Message>();
+
+    read_buffer_.Shrink();
+
+    // Nothing else comes over the socket, so it only polls readable once the peer has
+    // gone. Being woken up with nothing to read is the only time that is worth a look;
+    // the socket keeps polling readable until it is looked at.
+    uint8_t byte;
+    if (total == 0 && recv(socket_, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) == 0)
+        return StreamError { StreamError::IO_ERROR, { IOError::STREAM_CLOSED } };
+
+    return tb::ok;
 }
 
 auto Stream::Flush() -> tb::error<IOError>
 {
-    clearerr(stream_handle_.get());
+    if (shm_) return FlushShm();
 
-    auto io_error = write_buffer_.ReadIntoStream(
-        stream_handle_.get(),
-        write_buffer_.BytesToRead()
-    );
+    while (!write_queue_.empty()) {
+        iovec iov[MAX_FRAMES_PER_WRITE * 2];
+        size_t iov_count = 0, iov_bytes = 0, skip = write_offset_;
 
-    if (io_error.is_ok()) {
-        write_buffer_.Reset();
-        return tb::ok;
+        // Only a frame at the start of a call can pass its descriptor, and only
+        // before any of it has been sent
+        FileDescriptor descriptor = INVALID_FILE_DESCRIPTOR;
+        const EncodedFrame& first = *write_queue_.front();
+        if (first.attachment && write_offset_ == 0)
+            descriptor = first.attachment->Descriptor();
+
+        for (const SharedFrame& frame : write_queue_) {
+            if (iov_count + 2 > std::size(iov)) break;
+            if (frame->attachment && frame != write_queue_.front()) break;
+
+            for (std::span<const uint8_t> part : {
+                     std::span<const uint8_t> { frame->header },
+                     std::span<const uint8_t> {
+                         reinterpret_cast<const uint8_t*>(frame->payload.data()),
+                         frame->payload.size()
+                     }
+                 }) {
+                if (skip >= part.size()) {
+                    skip -= part.size();
+                    continue;
+                }
+                part = part.subspan(skip);
+                skip = 0;
+                iov[iov_count++] = { const_cast<uint8_t*>(part.data()), part.size() };
+                iov_bytes += part.size();
+            }
+        }
+
+        alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(FileDescriptor))] = {};
+        msghdr message { .msg_iov = iov, .msg_iovlen = iov_count };
+        if (descriptor != INVALID_FILE_DESCRIPTOR) {
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(FileDescriptor));
+            memcpy(CMSG_DATA(cmsg), &descriptor, sizeof(FileDescriptor));
+        }
+
+        ssize_t bytes_written = sendmsg(socket_, &message, 0);
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return IOError { IOError::STREAM_CLOSED, errno };
+            return IOError { IOError::FILE_ERROR, errno };
+        }
+
+        queued_bytes_ -= bytes_written;
+        size_t written = write_offset_ + bytes_written;
+        while (!write_queue_.empty() && written >= write_queue_.front()->Size()) {
+            written -= write_queue_.front()->Size();
+            write_queue_.pop_front();
+        }
+        write_offset_ = written;
+
+        if (static_cast<size_t>(bytes_written) < iov_bytes) break;
     }
 
-    if (io_error.get_error().code == EAGAIN) {
+    if (!write_queue_.empty())
         event_add(write_event_.get(), nullptr);
-        return tb::ok;
+
+    return tb::ok;
+}
+
+auto Stream::FlushShm() -> tb::error<IOError>
+{
+    while (!write_queue_.empty()) {
+        const EncodedFrame& frame = *write_queue_.front();
+        std::span<const uint8_t> parts[] = {
+            frame.header,
+            { reinterpret_cast<const uint8_t*>(frame.payload.data()), frame.payload.size() }
+        };
+
+        size_t offset = write_offset_;
+        bool full = false;
+        for (std::span<const uint8_t> part : parts) {
+            if (offset >= part.size()) {
+                offset -= part.size();
+                continue;
+            }
+
+            auto result = shm_->Write(part.subspan(offset));
+            if (result.is_error()) return result.get_error();
+
+            size_t bytes_written = result.get_mut_unchecked();
+            write_offset_ += bytes_written;
+            queued_bytes_ -= bytes_written;
+            offset = 0;
+            if (bytes_written < part.size()) {
+                full = true;
+                break;
+            }
+        }
+
+        if (!full) {
+            write_queue_.pop_front();
+            write_offset_ = 0;
+        } else if (shm_->WaitForSpace()) {
+            // The reader wakes us up once it has made room
+            break;
+        }
     }
 
-    return io_error;
+    return tb::ok;
+}
+
+auto Stream::QueuedBytes() const -> size_t
+{
+    return queued_bytes_;
+}
+
+auto Stream::QueuedFrames() const -> size_t
+{
+    return write_queue_.size();
 }
 
 auto Stream::GetSocket() const -> FileDescriptor
@@ -265,9 +1110,23 @@ auto Stream::GetSocket() const -> FileDescriptor
     return socket_;
 }
 
+auto Stream::GetWakeDescriptor() const -> FileDescriptor
+{
+    return shm_ ? shm_->GetWakeDescriptor() : INVALID_FILE_DESCRIPTOR;
+}
+
 void Stream::Close()
 {
-    fclose(stream_handle_.get());
+    if (socket_ == INVALID_FILE_DESCRIPTOR) return;
+
+    read_event_.reset();
+    write_event_.reset();
+    wake_event_.reset();
+    shm_.reset();
+    for (FileDescriptor fd : received_descriptors_) close(fd);
+    received_descriptors_.clear();
+    close(socket_);
+    socket_ = INVALID_FILE_DESCRIPTOR;
 }
 
 }
@@ -0,0 +1,120 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    if (!bux::Attachment::Supported()) {
+        fmt::print("Attachments are not supported here - skipping test ({})\n", __FILE__);
+        return 0;
+    }
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_attachment";
+    constexpr uint16_t PORT = 16401;
+    constexpr size_t SIZE = 1024 * 1024 * 4 + 17;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    auto fail_test = [] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        std::exit(1);
+    };
+
+    // Only sealed memfds are accepted from peers
+    int pipe_ends[2];
+    if (pipe(pipe_ends) < 0) fail_test("could not create pipe");
+    close(pipe_ends[1]);
+    if (bux::Attachment::FromDescriptor(pipe_ends[0]).is_ok())
+        fail_test("pipe accepted as an attachment");
+
+    std::vector<uint8_t> blob(SIZE);
+    for (size_t i = 0; i < blob.size(); ++i) blob[i] = i * 7 + (i >> 12);
+
+    auto created = bux::Attachment::Create(blob);
+    if (created.is_error()) fail_test(created.get_error().What());
+    bux::SharedAttachment attachment = created.get_mut_unchecked();
+    if (attachment->Size() != SIZE) fail_test("wrong attachment size");
+    if (!std::ranges::equal(attachment->Data(), blob)) fail_test("attachment mangled");
+
+    bux::Server server;
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    bux::Client sender({ .teamname = "sender" });
+    bux::Client a({ .teamname = "receivers", .format = bux::MessageFormat::JSON });
+    bux::Client b({ .teamname = "receivers", .format = bux::MessageFormat::BINARY });
+    bux::Client internal({ .teamname = "receivers" });
+
+    // Recipients in different processes would see the same inode, as these do
+    std::atomic<int> received = 0;
+    std::vector<ino_t> inodes;
+    std::mutex inodes_mutex;
+    auto check = [&] (bux::Client&, const bux::Message& m) {
+        if (m.content != "score") fail_test("content mangled");
+        if (!m.attachment) fail_test("attachment missing");
+        if (!std::ranges::equal(m.attachment->Data(), blob)) fail_test("data mangled");
+
+        struct stat status;
+        if (fstat(m.attachment->Descriptor(), &status) < 0) fail_test("fstat failed");
+        std::lock_guard<std::mutex> guard(inodes_mutex);
+        inodes.push_back(status.st_ino);
+        ++received;
+    };
+    for (bux::Client* client : { &a, &b, &internal }) client->AddHandler("score", check);
+
+    if (sender.UnixConnect(UNIX_FILE).is_error() || a.UnixConnect(UNIX_FILE).is_error()
+        || b.UnixConnect(UNIX_FILE).is_error() || internal.InternalConnect(server).is_error()) {
+        fail_test("clients could not connect");
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    bux::Message message {
+        .type = "score", .dest = "receivers", .content = "score", .attachment = attachment
+    };
+    if (sender.Write(message).is_error()) fail_test("could not send attachment");
+
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (received != 3) {
+        if (std::chrono::steady_clock::now() > deadline) fail_test("attachment not delivered");
+        std::this_thread::sleep_for(10ms);
+    }
+
+    struct stat original;
+    fstat(attachment->Descriptor(), &original);
+    for (ino_t inode : inodes) {
+        if (inode != original.st_ino) fail_test("attachment copied instead of shared");
+    }
+
+    // Internet domain connections cannot carry them
+    bux::Client ip({ .teamname = "ip" });
+    if (server.IPServer(PORT).is_error() || ip.IPConnect("localhost", PORT).is_error())
+        fail_test("could not connect over IP");
+    std::this_thread::sleep_for(200ms);
+    if (ip.Write(message).is_ok()) fail_test("attachment written over IP");
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_batch";
+    constexpr int BATCHES = 20;
+    constexpr int BATCH_SIZE = 256;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 64 });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    // Sinks in every format, over a socket and not, all in one team
+    struct Sink
+    {
+        std::unique_ptr<bux::Client> client;
+        int next = 0; // Handlers run one at a time without a handler pool
+        std::atomic<int> received = 0, out_of_order = 0;
+        std::atomic<size_t> large_bytes = 0;
+    };
+
+    std::vector<Sink> sinks(4);
+    const bux::MessageFormat formats[] = {
+        bux::MessageFormat::JSON, bux::MessageFormat::MSGPACK, bux::MessageFormat::BINARY,
+        bux::MessageFormat::MSGPACK
+    };
+    for (size_t i = 0; i < sinks.size(); ++i) {
+        Sink& sink = sinks[i];
+        sink.client = std::make_unique<bux::Client>(bux::ClientPreferences {
+            .teamname = "sink", .format = formats[i]
+        });
+        sink.client->AddHandler("count", [&sink] (bux::Client&, const bux::Message& m) {
+            if (sink.next++ != m.content.get<int>()) ++sink.out_of_order;
+            ++sink.received;
+        });
+        sink.client->AddHandler("large", [&sink] (bux::Client&, const bux::Message& m) {
+            sink.large_bytes += m.content.get<std::string>().size();
+        });
+        auto result = i == sinks.size() - 1 ? sink.client->InternalConnect(server)
+                    : sink.client->UnixConnect(UNIX_FILE);
+        if (result.is_error()) fail_test("sink could not connect");
+    }
+
+    bux::Client producer({
+        .teamname = "producer", .format = bux::MessageFormat::BINARY
+    });
+    if (producer.UnixConnect(UNIX_FILE).is_error())
+        fail_test("producer could not connect");
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(100ms);
+
+    auto wait_until = [] (auto&& done) {
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!done() && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        return done();
+    };
+
+    // Every message of every batch reaches every sink, in order
+    std::vector<bux::Message> batch(BATCH_SIZE);
+    for (int b = 0; b < BATCHES; ++b) {
+        for (int i = 0; i < BATCH_SIZE; ++i)
+            batch[i] = { .type = "count", .dest = "sink", .content = b * BATCH_SIZE + i };
+        if (producer.WriteBatch(batch).is_error()) fail_test("batch write failed");
+    }
+
+    for (Sink& sink : sinks) {
+        if (!wait_until([&sink] { return sink.received == BATCHES * BATCH_SIZE; }))
+            fail_test("messages were lost");
+        if (sink.out_of_order) fail_test("messages arrived out of order");
+    }
+
+    // Batches too large for one frame are split over several
+    constexpr size_t LARGE = 100000;
+    std::vector<bux::Message> large(4, {
+        .type = "large", .dest = "sink", .content = std::string(LARGE, 'x')
+    });
+    if (producer.WriteBatch(large).is_error()) fail_test("large batch write failed");
+
+    for (Sink& sink : sinks) {
+        if (!wait_until([&] { return sink.large_bytes == large.size() * LARGE; }))
+            fail_test("messages of a large batch were lost");
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -56,6 +56,11 @@ int main()
         .format = bux::MessageFormat::JSON
     });
 
+    bux::Client client_binary({
+        .teamname = "binary-client",
+        .format = bux::MessageFormat::BINARY
+    });
+
     bux::Client client_internal({
         .teamname = "internal-client"
     });
@@ -102,6 +107,23 @@ int main()
         fmt::print("unix-client connected to UNIX server OK\n");
     });
 
+    // Binary envelope client
+
+    bool binary_got_ping = false;
+
+    client_binary.AddHandler("ping",
+      [&binary_got_ping] (bux::Client&, const bux::Message& m) {
+        fmt::print("binary-client received ping from {} OK\n", m.src);
+        binary_got_ping = true;
+    });
+
+    client_binary.UnixConnect(UNIX_FILE).if_err([&fail_test] (bux::ConnectError e) {
+        fmt::print("binary-client failed to connect to unix server: {}\n", e.What());
+        fail_test();
+    }).if_ok([] {
+        fmt::print("binary-client connected to UNIX server OK\n");
+    });
+
     // Internal client
 
     client_internal.AddHandler("ping",
@@ -150,10 +172,20 @@ int main()
         fail_test();
     });
 
+    client_binary.Write({
+        .type = "ping", .dest = "internal-client",
+        .content = {
+            { "target", "binary-client" }
+        }
+    }).if_err([&fail_test] (bux::WriteError) {
+        fmt::print("binary-client failed to write\n");
+        fail_test();
+    });
+
     fmt::print("Sleeping for 1s...\n");
     std::this_thread::sleep_for(1s);
 
-    assert(ip_got_pong && unix_got_ping);
+    assert(ip_got_pong && unix_got_ping && binary_got_ping);
     fmt::print("Test ({}) completed successfully\n", __FILE__);
 
     return 0;
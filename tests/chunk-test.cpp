@@ -0,0 +1,155 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+// Reassembles the chunked messages a client receives, checking that they arrive whole
+// and in order
+struct Receiver
+{
+    void Attach(bux::Client& client)
+    {
+        client.AddChunkHandler("blob", [this] (bux::Client&, const bux::Message& head,
+            const bux::Chunk& chunk) {
+            if (chunk.first) {
+                name = head.content["name"];
+                src = head.src;
+                data.clear();
+            }
+            largest_piece = std::max(largest_piece, chunk.data.size());
+            data.insert(data.end(), chunk.data.begin(), chunk.data.end());
+            if (chunk.aborted) ++aborted;
+            else if (chunk.last) ++completed;
+        });
+    }
+
+    std::string name, src;
+    std::vector<uint8_t> data;
+    size_t largest_piece = 0;
+    std::atomic<int> completed = 0, aborted = 0;
+};
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_chunk";
+    constexpr size_t MAX_SIZE = 1024 * 1024 * 2;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server({ .max_message_size = MAX_SIZE });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    bux::Client sender({ .teamname = "sender", .format = bux::MessageFormat::JSON });
+    bux::Client socket_receiver({ .teamname = "receivers" });
+    bux::Client internal_receiver({ .teamname = "receivers" });
+
+    Receiver socket_received, internal_received;
+    socket_received.Attach(socket_receiver);
+    internal_received.Attach(internal_receiver);
+
+    if (sender.UnixConnect(UNIX_FILE).is_error()
+        || socket_receiver.UnixConnect(UNIX_FILE).is_error()
+        || internal_receiver.InternalConnect(server).is_error()) {
+        fail_test("clients could not connect");
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    auto wait_for = [&fail_test] (auto&& done, std::string_view what) {
+        auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (!done()) {
+            if (std::chrono::steady_clock::now() > deadline) fail_test(what);
+            std::this_thread::sleep_for(10ms);
+        }
+    };
+
+    // Several times the frame limit, written in uneven parts
+    std::vector<uint8_t> blob(bux::MAX_MESSAGE_LENGTH * 5 + 123);
+    for (size_t i = 0; i < blob.size(); ++i) blob[i] = i * 31 + (i >> 10);
+
+    auto stream_id = sender.StartChunked({
+        .type = "blob", .dest = "receivers", .content = { { "name", "toccata" } }
+    });
+    if (stream_id.is_error()) fail_test("could not start chunked message");
+    uint32_t id = stream_id.get_mut_unchecked();
+
+    std::span<const uint8_t> rest { blob };
+    for (size_t part = 1000; !rest.empty(); part *= 3) {
+        std::span<const uint8_t> piece = rest.first(std::min(part, rest.size()));
+        rest = rest.subspan(piece.size());
+        if (sender.WriteChunk(id, piece, rest.empty()).is_error())
+            fail_test("could not write chunk");
+    }
+
+    wait_for([&] {
+        return socket_received.completed == 1 && internal_received.completed == 1;
+    }, "chunked message not delivered");
+
+    for (Receiver* received : { &socket_received, &internal_received }) {
+        if (received->name != "toccata" || received->src != "sender")
+            fail_test("head not delivered");
+        if (received->data != blob) fail_test("data corrupted");
+        if (received->largest_piece > bux::CHUNK_SIZE) fail_test("chunk too large");
+    }
+
+    // Going over the server's limit aborts the message for every recipient
+    stream_id = sender.StartChunked({ .type = "blob", .dest = "receivers",
+        .content = { { "name", "too large" } } });
+    if (stream_id.is_error()) fail_test("could not start chunked message");
+    id = stream_id.get_mut_unchecked();
+
+    for (size_t sent = 0; sent <= MAX_SIZE; sent += blob.size()) {
+        if (sender.WriteChunk(id, blob).is_error()) fail_test("could not write chunk");
+    }
+
+    wait_for([&] {
+        return socket_received.aborted == 1 && internal_received.aborted == 1;
+    }, "oversized chunked message not aborted");
+
+    // As does the sender going away part way through
+    {
+        bux::Client quitter({ .teamname = "quitter" });
+        if (quitter.UnixConnect(UNIX_FILE).is_error()) fail_test("client could not connect");
+        std::this_thread::sleep_for(100ms);
+
+        stream_id = quitter.StartChunked({ .type = "blob", .dest = "receivers",
+            .content = { { "name", "unfinished" } } });
+        if (stream_id.is_error()) fail_test("could not start chunked message");
+        if (quitter.WriteChunk(stream_id.get_mut_unchecked(), std::span { blob }.first(10))
+            .is_error()) {
+            fail_test("could not write chunk");
+        }
+        std::this_thread::sleep_for(100ms);
+    }
+
+    wait_for([&] {
+        return socket_received.aborted == 2 && internal_received.aborted == 2;
+    }, "unfinished chunked message not aborted");
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_compression";
+    constexpr size_t THRESHOLD = 1024;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    auto fail_test = [] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        std::exit(1);
+    };
+
+    // Frames are only compressed above the threshold, and only if that helps
+    std::string text;
+    while (text.size() < 64 * 1024) text += "Membra Jesu nostri patientis sanctissima ";
+
+    bux::Message large { .type = "text", .dest = "b", .content = text };
+    bux::SharedFrame frame = bux::EncodedFrame::Encode(bux::MessageFormat::JSON, large);
+    bux::SharedFrame compressed = bux::EncodedFrame::Compress(frame, THRESHOLD);
+    if (!(compressed->Flags() & bux::FRAME_COMPRESSED)) fail_test("frame not compressed");
+    if (compressed->Format() != bux::MessageFormat::JSON) fail_test("format lost");
+    if (compressed->payload.size() >= frame->payload.size() / 10)
+        fail_test("compressible frame barely shrank");
+
+    bux::Message small { .type = "text", .dest = "b", .content = "short" };
+    frame = bux::EncodedFrame::Encode(bux::MessageFormat::JSON, small);
+    if (bux::EncodedFrame::Compress(frame, THRESHOLD) != frame)
+        fail_test("frame under the threshold compressed");
+
+    std::string noise;
+    uint32_t state = 1637;
+    for (size_t i = 0; i < 16 * 1024; ++i) {
+        state = state * 1664525 + 1013904223;
+        noise.push_back(state >> 24);
+    }
+    bux::Message random { .type = "noise", .content = bux::json::binary({ noise.begin(),
+        noise.end() }) };
+    frame = bux::EncodedFrame::Encode(bux::MessageFormat::MSGPACK, random);
+    if (bux::EncodedFrame::Compress(frame, THRESHOLD) != frame)
+        fail_test("incompressible frame replaced");
+
+    // End to end: the server compresses for the clients that ask for it, and every
+    // client reads whatever it is sent
+    bux::Server server({
+        .compression = bux::Compression::ZSTD,
+        .compression_threshold = THRESHOLD
+    });
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    bux::Client a({
+        .teamname = "a", .format = bux::MessageFormat::JSON,
+        .compression = bux::Compression::ZSTD, .compression_threshold = THRESHOLD
+    });
+    bux::Client b({ .teamname = "b", .format = bux::MessageFormat::BINARY,
+        .compression = bux::Compression::ZSTD });
+    bux::Client c({ .teamname = "c" });
+
+    std::atomic<int> a_received = 0, b_received = 0, c_received = 0;
+    auto check = [&text, &fail_test] (std::atomic<int>& counter) {
+        return [&text, &fail_test, &counter] (bux::Client&, const bux::Message& m) {
+            if (m.content != text && m.content != "short") fail_test("content mangled");
+            ++counter;
+        };
+    };
+    a.AddHandler("text", check(a_received));
+    b.AddHandler("text", check(b_received));
+    c.AddHandler("text", check(c_received));
+
+    for (bux::Client* client : { &a, &b, &c }) {
+        if (client->UnixConnect(UNIX_FILE).is_error()) fail_test("client could not connect");
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    for (const bux::Message& m : { large, small }) {
+        for (std::string_view dest : { "b", "c" }) {
+            bux::Message copy = m;
+            copy.dest = dest;
+            a.Write(copy).if_err([&fail_test] (bux::WriteError) { fail_test("a failed to write"); });
+        }
+        bux::Message reply = m;
+        reply.dest = "a";
+        c.Write(reply).if_err([&fail_test] (bux::WriteError) { fail_test("c failed to write"); });
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (a_received != 2 || b_received != 2 || c_received != 2) {
+        if (std::chrono::steady_clock::now() > deadline) fail_test("messages not delivered");
+        std::this_thread::sleep_for(10ms);
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
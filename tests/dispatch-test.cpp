@@ -0,0 +1,243 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_dispatch";
+    constexpr int WORKERS = 4;
+    constexpr int ROUNDS = 100;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    // Round robin by default, weighted for two teams
+    bux::Server server({
+        .dispatch = bux::Dispatch::ROUND_ROBIN,
+        .team_dispatch = {
+            { "weighted", bux::Dispatch::WEIGHTED },
+            { "capacity", bux::Dispatch::WEIGHTED }
+        }
+    });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.InternalServer().is_error() || server.UnixServer(UNIX_FILE).is_error())
+        fail_test("could not start server");
+
+    struct Worker
+    {
+        std::unique_ptr<bux::Client> client;
+        std::atomic<int> received = 0;
+    };
+
+    std::vector<Worker> even(WORKERS), weighted(WORKERS);
+    auto connect = [&] (Worker& worker, std::string_view team, uint32_t capacity) {
+        worker.client = std::make_unique<bux::Client>(bux::ClientPreferences {
+            .teamname = std::string { team }, .capacity = capacity
+        });
+        worker.client->AddHandler("job", [&worker] (bux::Client&, const bux::Message&) {
+            ++worker.received;
+        });
+        if (worker.client->InternalConnect(server).is_error())
+            fail_test("worker could not connect");
+    };
+    for (int i = 0; i < WORKERS; ++i) {
+        connect(even[i], "even", 1);
+        // Capacities 1, 2, 4 and 8
+        connect(weighted[i], "weighted", 1 << i);
+    }
+
+    bux::Client producer({ .teamname = "producer" });
+    if (producer.InternalConnect(server).is_error())
+        fail_test("producer could not connect");
+
+    using namespace std::chrono_literals;
+    auto send = [&] (std::string_view team, int count) {
+        for (int i = 0; i < count; ++i) {
+            if (producer.Write({ .type = "job", .dest = std::string { team },
+                .only_first = true }).is_error()) {
+                fail_test("write failed");
+            }
+        }
+        std::this_thread::sleep_for(200ms);
+    };
+
+    // Exactly even, however many members the team has
+    send("even", WORKERS * ROUNDS);
+    for (Worker& worker : even) {
+        if (worker.received != ROUNDS) fail_test("round robin is not even");
+    }
+
+    // Unavailable members are passed over, without the others losing their turn
+    if (even[0].client->SetAvailable("job", false).is_error())
+        fail_test("could not set availability");
+    std::this_thread::sleep_for(100ms);
+    send("even", (WORKERS - 1) * ROUNDS);
+    if (even[0].received != ROUNDS) fail_test("unavailable member chosen");
+    for (int i = 1; i < WORKERS; ++i) {
+        if (even[i].received != 2 * ROUNDS) fail_test("round robin is not even");
+    }
+
+    // Shares in proportion to capacity, give or take what randomness allows
+    constexpr int WEIGHTED_MESSAGES = 15000;
+    send("weighted", WEIGHTED_MESSAGES);
+    for (int i = 0; i < WORKERS; ++i) {
+        double expected = WEIGHTED_MESSAGES * (1 << i) / 15.0;
+        int received = weighted[i].received;
+        if (received < expected * 0.8 || received > expected * 1.2)
+            fail_test("weighted dispatch is not proportional to capacity");
+    }
+
+    // A peer's handshake cannot give it a capacity outside 1..UINT32_MAX: the server
+    // ignores it, and neither truncates it nor divides by a total of zero
+    std::vector<int> peers;
+    for (bux::json capacity : { bux::json(4294967296ull), bux::json(0.5) }) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr { .sun_family = AF_UNIX };
+        UNIX_FILE.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            fail_test("peer could not connect");
+        peers.push_back(fd);
+
+        bux::SharedFrame handshake = bux::EncodedFrame::Encode(bux::MessageFormat::JSON, {
+            .type { bux::MSG_HANDSHAKE },
+            .content = {
+                { "capacity", capacity },
+                { "format", bux::MessageFormat::JSON },
+                { "teamname", "capacity" },
+                { "version", bux::CURRENT_VERSION },
+            }
+        });
+        if (write(fd, handshake->header.data(), handshake->header.size()) < 0
+            || write(fd, handshake->payload.data(), handshake->payload.size()) < 0) {
+            fail_test("peer could not handshake");
+        }
+    }
+    std::this_thread::sleep_for(100ms);
+    send("capacity", ROUNDS);
+    send("even", (WORKERS - 1) * ROUNDS);
+    if (even[1].received != 3 * ROUNDS) fail_test("server stopped dispatching");
+    for (int fd : peers) close(fd);
+
+    // Keyed messages stick to one member, and only the keys of members that leave or
+    // become unavailable move
+    constexpr int KEYS = 400;
+    struct KeyedWorker
+    {
+        std::unique_ptr<bux::Client> client;
+        std::mutex mutex;
+        std::map<std::string, int> keys; // Messages received per key
+    };
+
+    std::vector<KeyedWorker> keyed(WORKERS);
+    for (KeyedWorker& worker : keyed) {
+        worker.client = std::make_unique<bux::Client>(bux::ClientPreferences {
+            .teamname = "keyed"
+        });
+        worker.client->AddHandler("job", [&worker] (bux::Client&, const bux::Message& m) {
+            std::scoped_lock lock { worker.mutex };
+            ++worker.keys[m.key];
+        });
+        if (worker.client->InternalConnect(server).is_error())
+            fail_test("worker could not connect");
+    }
+
+    // Which worker each key went to, after sending every key `repeat` times
+    auto send_keyed = [&] (int repeat) {
+        for (KeyedWorker& worker : keyed) worker.keys.clear();
+        for (int i = 0; i < repeat; ++i) {
+            for (int key = 0; key < KEYS; ++key) {
+                if (producer.Write({ .type = "job", .dest = "keyed", .only_first = true,
+                    .key = fmt::format("entity-{}", key) }).is_error()) {
+                    fail_test("write failed");
+                }
+            }
+        }
+        std::this_thread::sleep_for(200ms);
+
+        std::map<std::string, int> owners;
+        for (int i = 0; i < WORKERS; ++i) {
+            std::scoped_lock lock { keyed[i].mutex };
+            for (auto& [key, count] : keyed[i].keys) {
+                if (count != repeat || owners.contains(key))
+                    fail_test("a key went to more than one member");
+                owners[key] = i;
+            }
+        }
+        if (owners.size() != KEYS) fail_test("keyed messages were lost");
+        return owners;
+    };
+
+    auto before = send_keyed(3);
+    for (KeyedWorker& worker : keyed) {
+        if (worker.keys.empty()) fail_test("a member got no keys");
+    }
+
+    if (keyed[0].client->SetAvailable("job", false).is_error())
+        fail_test("could not set availability");
+    keyed[WORKERS - 1].client.reset();
+    std::this_thread::sleep_for(100ms);
+
+    auto after = send_keyed(1);
+    for (auto& [key, owner] : before) {
+        bool moves = owner == 0 || owner == WORKERS - 1;
+        if (after[key] == 0 || after[key] == WORKERS - 1)
+            fail_test("a key went to an unavailable or departed member");
+        if (!moves && after[key] != owner) fail_test("a key moved needlessly");
+    }
+
+    // A member can only be unavailable for so many types at once. Past that it stays
+    // available, until it makes room.
+    std::vector<Worker> fussy(2);
+    for (Worker& worker : fussy) connect(worker, "fussy", 1);
+    bux::Client& picky = *fussy[0].client;
+    for (size_t i = 0; i < bux::Member::MAX_UNAVAILABLE_TYPES; ++i) {
+        if (picky.SetAvailable(fmt::format("spare-{}", i), false).is_error())
+            fail_test("could not set availability");
+    }
+    if (picky.SetAvailable("job", false).is_error())
+        fail_test("could not set availability");
+    std::this_thread::sleep_for(100ms);
+    send("fussy", 2 * ROUNDS);
+    if (fussy[0].received != ROUNDS || fussy[1].received != ROUNDS)
+        fail_test("unavailable for more types than allowed");
+
+    if (picky.SetAvailable("spare-0", true).is_error()
+        || picky.SetAvailable("job", false).is_error()) {
+        fail_test("could not set availability");
+    }
+    std::this_thread::sleep_for(100ms);
+    send("fussy", ROUNDS);
+    if (fussy[0].received != ROUNDS) fail_test("unavailable member chosen");
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include <buxtehude/buxtehude.hpp>
+
+namespace bux = buxtehude;
+
+using bux::json, bux::MessageFormat;
+
+static auto Bytes(const std::string& s) -> std::span<const uint8_t>
+{
+    return { reinterpret_cast<const uint8_t*>(s.data()), s.size() };
+}
+
+static auto Payload(const bux::SharedFrame& frame) -> json
+{
+    MessageFormat format;
+    memcpy(&format, frame->header.data(), sizeof(MessageFormat));
+    if (format == MessageFormat::JSON) return json::parse(frame->payload);
+    if (format == MessageFormat::MSGPACK) return json::from_msgpack(frame->payload);
+
+    auto result = bux::LazyMessage::Scan(format, Bytes(frame->payload));
+    assert(result.is_ok());
+    return std::move(result.get_mut_unchecked()).ToMessage();
+}
+
+static auto Format(const bux::SharedFrame& frame) -> MessageFormat
+{
+    return static_cast<MessageFormat>(frame->header[0]);
+}
+
+int main()
+{
+    const json content = {
+        { "notes", { 1, 2.5, -3, nullptr, "\"quoted\" }{ ][" } },
+        { "nested", { { "deeper", { { "x", json::array() } } } } },
+        { "flag", false }
+    };
+
+    // JSON envelope with escapes, nested content and unknown keys
+    {
+        std::string text = R"( { "dest" : "chorale", "extra": [1, {"a": "}"}],
+            "type": "cantata", "only_first": true, "content": )"
+            + content.dump() + R"(, "src": "x\"y" } )";
+
+        auto result = bux::LazyMessage::Scan(MessageFormat::JSON, Bytes(text));
+        assert(result.is_ok());
+        bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+        assert(msg.dest == "chorale");
+        assert(msg.src == "x\"y");
+        assert(msg.type == "cantata");
+        assert(msg.only_first);
+        assert(msg.Content() == content);
+    }
+
+    // MessagePack envelope, including wide integers, binary and extension types
+    {
+        json full = {
+            { "type", "passacaglia" }, { "dest", "organ" },
+            { "content", content }, { "only_first", false },
+            { "ignored", { 1ull << 40, -(1ll << 40), 1.5 } },
+            { "blob", json::binary({ 1, 2, 3 }, 7) }
+        };
+        std::string packed;
+        json::to_msgpack(full, packed);
+
+        auto result = bux::LazyMessage::Scan(MessageFormat::MSGPACK, Bytes(packed));
+        assert(result.is_ok());
+        bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+        assert(msg.dest == "organ");
+        assert(msg.src.empty());
+        assert(msg.type == "passacaglia");
+        assert(!msg.only_first);
+        assert(msg.Content() == content);
+    }
+
+    constexpr MessageFormat FORMATS[] = {
+        MessageFormat::JSON, MessageFormat::MSGPACK, MessageFormat::BINARY
+    };
+
+    // Same-format forwarding splices the received content bytes unchanged
+    for (MessageFormat format : FORMATS) {
+        bux::Message original {
+            .type = "toccata", .dest = "d", .src = "s", .content = content
+        };
+        std::string payload = bux::EncodedFrame::Encode(format, original)->payload;
+        std::string raw_content;
+        if (format == MessageFormat::BINARY) assert(payload[0] == 0);
+        if (format == MessageFormat::JSON) raw_content = content.dump();
+        else json::to_msgpack(content, raw_content);
+
+        auto result = bux::LazyMessage::Scan(format, Bytes(payload));
+        assert(result.is_ok());
+        bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+        msg.src = "replaced";
+
+        bux::SharedFrame frame = msg.Encode(format);
+        assert(frame->payload.find(raw_content) != std::string::npos);
+
+        json decoded = Payload(frame);
+        assert(decoded["src"] == "replaced");
+        assert(decoded["content"] == content);
+
+        // Other recipients get the content transcoded, except between MessagePack
+        // and binary envelopes, which encode it the same way
+        for (MessageFormat other : FORMATS) {
+            bux::SharedFrame frame = msg.Encode(other);
+            assert(Format(frame) == other);
+            if (bux::FallbackFormat(other) == bux::FallbackFormat(format))
+                assert(frame->payload.find(raw_content) != std::string::npos);
+
+            decoded = Payload(frame);
+            assert(decoded["type"] == "toccata");
+            assert(decoded["dest"] == "d");
+            assert(decoded["content"] == content);
+            assert(decoded.get<bux::Message>().content == content);
+        }
+    }
+
+    // Binary envelopes with fields too long for them fall back to MessagePack
+    {
+        bux::Message original {
+            .type = std::string(bux::MAX_ENVELOPE_FIELD_LENGTH + 1, 't'),
+            .content = content, .only_first = true
+        };
+        bux::SharedFrame frame = bux::EncodedFrame::Encode(MessageFormat::BINARY, original);
+        assert(Format(frame) == MessageFormat::MSGPACK);
+        assert(Payload(frame)["only_first"] == true);
+
+        frame = bux::LazyMessage { original }.Encode(MessageFormat::BINARY);
+        assert(Format(frame) == MessageFormat::MSGPACK);
+        assert(Payload(frame)["content"] == content);
+    }
+
+    // Keys survive every envelope, and only binary envelopes with one set its flag
+    for (MessageFormat format : FORMATS) {
+        for (std::string key : { "", "entity-42" }) {
+            bux::Message original {
+                .type = "chaconne", .dest = "d", .content = content, .only_first = true,
+                .key = key
+            };
+            std::string payload = bux::EncodedFrame::Encode(format, original)->payload;
+            if (format == MessageFormat::BINARY)
+                assert(payload[0] == (key.empty() ? 1 : 3));
+
+            auto result = bux::LazyMessage::Scan(format, Bytes(payload));
+            assert(result.is_ok());
+            bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+            assert(msg.key == key);
+            assert(msg.only_first);
+
+            for (MessageFormat other : FORMATS) {
+                bux::Message decoded = Payload(msg.Encode(other)).get<bux::Message>();
+                assert(decoded.key == key);
+                assert(decoded.content == content);
+            }
+        }
+    }
+
+    // So do correlation ids, requester ids and replies, including ids too large for a
+    // double
+    for (MessageFormat format : FORMATS) {
+        for (uint64_t correlation : { uint64_t { 7 }, ~uint64_t { 0 } - 1 }) {
+            bux::Message original {
+                .type = "toccata", .dest = "d", .content = content,
+                .correlation = correlation, .reply = true, .requester = correlation + 1
+            };
+            std::string payload = bux::EncodedFrame::Encode(format, original)->payload;
+            if (format == MessageFormat::BINARY)
+                assert(payload[0] == (bux::ENVELOPE_CORRELATION | bux::ENVELOPE_REPLY
+                    | bux::ENVELOPE_REQUESTER));
+
+            auto result = bux::LazyMessage::Scan(format, Bytes(payload));
+            assert(result.is_ok());
+            bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+            assert(msg.correlation == correlation);
+            assert(msg.reply);
+            assert(msg.requester == correlation + 1);
+
+            for (MessageFormat other : FORMATS) {
+                bux::Message decoded = Payload(msg.Encode(other)).get<bux::Message>();
+                assert(decoded.correlation == correlation);
+                assert(decoded.reply);
+                assert(decoded.requester == correlation + 1);
+                assert(decoded.content == content);
+            }
+        }
+    }
+
+    // Messages without content stay without it
+    {
+        std::string text = R"({"type":"fugue","only_first":false})";
+        auto result = bux::LazyMessage::Scan(MessageFormat::JSON, Bytes(text));
+        assert(result.is_ok());
+        bux::LazyMessage msg = std::move(result.get_mut_unchecked());
+        assert(msg.Content().is_null());
+        assert(!Payload(msg.Encode(MessageFormat::MSGPACK)).contains("content"));
+    }
+
+    // Malformed envelopes are rejected
+    for (std::string text : {
+        "", "[]", "{", R"({"type": 5})", R"({"only_first": 1})",
+        R"({"content": [1, 2})", R"({"content": {"a": 1]})", R"({"type": "a"} x)",
+        R"({"type": "a",})", R"({"content": "unterminated})",
+        R"({"correlation": -1})", R"({"correlation": 99999999999999999999})",
+        R"({"requester": "a"})"
+    }) {
+        assert(bux::LazyMessage::Scan(MessageFormat::JSON, Bytes(text)).is_error());
+    }
+
+    for (std::string packed : {
+        std::string { "\x91\xa1x" }, std::string { "\x81\xa4type\x05" },
+        std::string { "\x81\xa7" "content" "\x92\x01" },
+        std::string { "\x81\xa7" "content" "\xc1" },
+        std::string { "\x80\x00", 2 }, std::string { "\xdf\x00\x00\x00" }
+    }) {
+        assert(bux::LazyMessage::Scan(MessageFormat::MSGPACK, Bytes(packed)).is_error());
+    }
+
+    for (std::string packed : {
+        std::string {}, std::string { "\x20" }, std::string { "\x00\x01", 2 },
+        std::string { "\x00\x05\x00" "abc", 6 },
+        std::string { "\x00\x01\x00" "a\x00\x00\x00", 7 },
+        std::string { "\x02\x01\x00" "a\x00\x00\x00\x00", 8 },
+        std::string { "\x04\x01\x00" "a\x00\x00\x00\x00\x01\x02", 10 },
+        std::string { "\x10\x01\x00" "a\x00\x00\x00\x00\x01\x02", 10 }
+    }) {
+        assert(bux::LazyMessage::Scan(MessageFormat::BINARY, Bytes(packed)).is_error());
+    }
+
+    // Batch frames hold each payload as it was, and splitting them gives them back
+    {
+        std::vector<bux::SharedFrame> frames;
+        for (int i = 0; i < 3; ++i) {
+            frames.emplace_back(bux::EncodedFrame::Encode(MessageFormat::MSGPACK,
+                { .type = "aria", .content = i }));
+        }
+        bux::SharedFrame batch = bux::EncodedFrame::Batch(frames);
+        assert(batch->Flags() == bux::FRAME_BATCH);
+        assert(batch->Format() == MessageFormat::MSGPACK);
+
+        std::vector<std::string> entries;
+        assert(bux::SplitBatch(Bytes(batch->payload), [&] (std::span<const uint8_t> e) {
+            entries.emplace_back(e.begin(), e.end());
+        }));
+        assert(entries.size() == frames.size());
+        for (size_t i = 0; i < frames.size(); ++i)
+            assert(entries[i] == frames[i]->payload);
+
+        // Stops at an entry longer than what is left
+        std::string truncated = batch->payload.substr(0, batch->payload.size() - 1);
+        entries.clear();
+        assert(!bux::SplitBatch(Bytes(truncated), [&] (std::span<const uint8_t> e) {
+            entries.emplace_back(e.begin(), e.end());
+        }));
+        assert(entries.size() == frames.size() - 1);
+        assert(!bux::SplitBatch(Bytes(std::string { "\x01\x00", 2 }), [] (auto) {}));
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_handler";
+    constexpr int TYPES = 4;
+    constexpr int MESSAGES = 2000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server;
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    bux::Client producer({ .teamname = "producer" });
+    if (producer.InternalConnect(server).is_error())
+        fail_test("producer could not connect");
+
+    using namespace std::chrono_literals;
+    auto wait_until = [] (auto&& done) {
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!done() && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        return done();
+    };
+
+    // Each type's messages are handled in order, on several threads at once
+    {
+        bux::Client worker({
+            .teamname = "worker", .handler_threads = 4,
+            .handler_ordering = bux::HandlerOrdering::PER_TYPE
+        });
+
+        std::vector<int> next(TYPES, 0);
+        std::vector<std::atomic<bool>> busy(TYPES);
+        std::atomic<int> received = 0, out_of_order = 0, overlapping = 0;
+        for (int type = 0; type < TYPES; ++type) {
+            worker.AddHandler(fmt::format("type-{}", type), [&, type] (bux::Client&,
+                const bux::Message& m) {
+                if (busy[type].exchange(true)) ++overlapping;
+                if (next[type]++ != m.content.get<int>()) ++out_of_order;
+                std::this_thread::sleep_for(10us);
+                busy[type] = false;
+                ++received;
+            });
+        }
+        if (worker.UnixConnect(UNIX_FILE).is_error())
+            fail_test("worker could not connect");
+        std::this_thread::sleep_for(100ms);
+
+        for (int n = 0; n < MESSAGES; ++n) {
+            for (int type = 0; type < TYPES; ++type) {
+                producer.Write({ .type = fmt::format("type-{}", type), .dest = "worker",
+                    .content = n }).ignore_error();
+            }
+        }
+
+        if (!wait_until([&] { return received == TYPES * MESSAGES; }))
+            fail_test("messages were lost");
+        if (out_of_order) fail_test("messages of one type were handled out of order");
+        if (overlapping) fail_test("one type was handled on two threads at once");
+    }
+
+    // A slow type does not hold up the others, nor the reading of new messages
+    {
+        bux::Client worker({
+            .teamname = "worker", .handler_threads = 2,
+            .handler_ordering = bux::HandlerOrdering::PER_TYPE
+        });
+
+        std::atomic<bool> released = false;
+        std::atomic<int> fast_received = 0;
+        worker.AddHandler("slow", [&released] (bux::Client&, const bux::Message&) {
+            while (!released) std::this_thread::sleep_for(1ms);
+        });
+        worker.AddHandler("fast", [&fast_received] (bux::Client&, const bux::Message&) {
+            ++fast_received;
+        });
+        if (worker.UnixConnect(UNIX_FILE).is_error())
+            fail_test("worker could not connect");
+        std::this_thread::sleep_for(100ms);
+
+        producer.Write({ .type = "slow", .dest = "worker" }).ignore_error();
+        for (int n = 0; n < 100; ++n)
+            producer.Write({ .type = "fast", .dest = "worker" }).ignore_error();
+
+        bool done = wait_until([&] { return fast_received == 100; });
+        released = true;
+        if (!done) fail_test("a slow handler held up another type");
+    }
+
+    // Handlers can be added and erased while others run, from handlers too
+    {
+        bux::Client worker({ .teamname = "worker", .handler_threads = 4 });
+
+        std::atomic<int> received = 0, erased_received = 0;
+        worker.AddHandler("churn", [&received] (bux::Client& c, const bux::Message& m) {
+            std::string spare = fmt::format("spare-{}", m.content.get<int>() % 8);
+            c.AddHandler(spare, [] (bux::Client&, const bux::Message&) {});
+            c.EraseHandler(spare);
+            ++received;
+        });
+        worker.AddHandler("erased", [&erased_received] (bux::Client& c,
+            const bux::Message&) {
+            ++erased_received;
+            c.EraseHandler("erased");
+        });
+        if (worker.UnixConnect(UNIX_FILE).is_error())
+            fail_test("worker could not connect");
+        std::this_thread::sleep_for(100ms);
+
+        std::atomic<bool> churning = true;
+        std::thread churner([&] {
+            for (int n = 0; churning; ++n) {
+                worker.AddHandler(fmt::format("other-{}", n % 8),
+                    [] (bux::Client&, const bux::Message&) {});
+                worker.EraseHandler(fmt::format("other-{}", (n + 4) % 8));
+            }
+        });
+
+        producer.Write({ .type = "erased", .dest = "worker" }).ignore_error();
+        for (int n = 0; n < MESSAGES; ++n) {
+            producer.Write({ .type = "churn", .dest = "worker", .content = n })
+                .ignore_error();
+        }
+
+        bool done = wait_until([&] { return received == MESSAGES; });
+        churning = false;
+        churner.join();
+        if (!done) fail_test("messages were lost while handlers changed");
+
+        producer.Write({ .type = "erased", .dest = "worker" }).ignore_error();
+        std::this_thread::sleep_for(100ms);
+        if (erased_received != 1) fail_test("an erased handler was still called");
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <cassert>
+#include <cstdio>
+
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <buxtehude/intern.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    InternTable names;
+
+    assert(names.Find("cantata") == INVALID_INTERN_ID);
+    InternId cantata = names.Intern("cantata");
+    InternId motet = names.Intern("motet");
+    assert(cantata == 0 && motet == 1);
+    assert(names.Intern("cantata") == cantata && names.Find("motet") == motet);
+    assert(names.Name(motet) == "motet" && names.Size() == 2);
+
+    // Names outlive the strings they were interned from
+    {
+        std::string temporary = "passion";
+        names.Intern(temporary);
+        temporary = "overwritten";
+    }
+    assert(names.Find("passion") == 2 && names.Name(2) == "passion");
+
+    // Every thread gets the same id for the same name, and ids stay dense
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&names] {
+            for (int i = 0; i < 1000; ++i) names.Intern(std::to_string(i));
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    assert(names.Size() == 1003);
+    for (int i = 0; i < 1000; ++i) {
+        InternId id = names.Find(std::to_string(i));
+        assert(id < names.Size() && names.Name(id) == std::to_string(i));
+    }
+
+    // Snapshots only know what was interned when they last caught up, by the same ids
+    InternSnapshot snapshot;
+    assert(snapshot.Find("cantata") == INVALID_INTERN_ID && snapshot.Size() == 0);
+    snapshot.CatchUp(names);
+    assert(snapshot.Size() == names.Size() && snapshot.Find("motet") == motet);
+    assert(snapshot.Name(cantata) == "cantata");
+    InternId oratorio = names.Intern("oratorio");
+    assert(snapshot.Find("oratorio") == INVALID_INTERN_ID);
+    snapshot.CatchUp(names);
+    assert(snapshot.Find("oratorio") == oratorio);
+    assert(snapshot.Name(oratorio) == "oratorio");
+
+    InternSet set;
+    assert(!set.Contains(cantata) && !set.Contains(INVALID_INTERN_ID));
+    assert(set.Insert(cantata) && !set.Insert(cantata) && set.Size() == 1);
+    assert(set.Insert(1000) && set.Contains(1000) && !set.Contains(999));
+    assert(!set.Insert(INVALID_INTERN_ID) && !set.Contains(INVALID_INTERN_ID));
+    assert(set.Erase(cantata) && !set.Erase(cantata) && !set.Contains(cantata));
+    assert(!set.Erase(INVALID_INTERN_ID) && set.Contains(1000) && set.Size() == 1);
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
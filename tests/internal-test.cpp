@@ -0,0 +1,136 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr int WRITERS = 8;
+    constexpr int MESSAGES = 5000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server;
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.InternalServer().is_error()) fail_test("could not start server");
+
+    // Messages from each writer arrive in the order it wrote them
+    std::vector<int> next(WRITERS, 0);
+    std::atomic<int> received = 0, out_of_order = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("tick", [&] (bux::Client&, const bux::Message& m) {
+        int writer = m.content["writer"], n = m.content["n"];
+        if (next[writer]++ != n) ++out_of_order;
+        ++received;
+    });
+    if (sink.InternalConnect(server).is_error()) fail_test("sink could not connect");
+
+    std::vector<std::unique_ptr<bux::Client>> writers;
+    for (int i = 0; i < WRITERS; ++i) {
+        auto& writer = writers.emplace_back(std::make_unique<bux::Client>(
+            bux::ClientPreferences { .teamname = "writer" }));
+        if (writer->InternalConnect(server).is_error())
+            fail_test("writer could not connect");
+    }
+
+    // Many threads at once, by rvalue and by const reference
+    std::vector<std::thread> threads;
+    for (int i = 0; i < WRITERS; ++i) {
+        threads.emplace_back([&, i] {
+            for (int n = 0; n < MESSAGES; ++n) {
+                bux::Message m {
+                    .type = "tick", .dest = "sink",
+                    .content = { { "writer", i }, { "n", n } }
+                };
+                auto result = n % 2 ? writers[i]->Write(m)
+                            : writers[i]->Write(std::move(m));
+                if (result.is_error()) fail_test("write failed");
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    using namespace std::chrono_literals;
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while (received < WRITERS * MESSAGES && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(10ms);
+
+    if (received != WRITERS * MESSAGES) fail_test("messages were lost");
+    if (out_of_order) fail_test("messages from one writer arrived out of order");
+
+    // A slow handler only holds up its own client, whichever executor it runs on
+    for (auto executor : { bux::InternalExecutor::OWN_THREAD,
+        bux::InternalExecutor::SHARED_POOL }) {
+        std::atomic<bool> released = false;
+        std::atomic<int> fast_received = 0;
+
+        bux::Client slow({ .teamname = "slow", .executor = executor });
+        slow.AddHandler("tick", [&released] (bux::Client&, const bux::Message&) {
+            while (!released) std::this_thread::sleep_for(1ms);
+        });
+        bux::Client fast({ .teamname = "fast", .executor = executor });
+        fast.AddHandler("tick", [&fast_received] (bux::Client&, const bux::Message&) {
+            ++fast_received;
+        });
+        if (slow.InternalConnect(server).is_error()
+            || fast.InternalConnect(server).is_error()) {
+            fail_test("could not connect");
+        }
+
+        writers.front()->Write({ .type = "tick", .dest = "slow" }).ignore_error();
+        for (int n = 0; n < 100; ++n)
+            writers.front()->Write({ .type = "tick", .dest = "fast" }).ignore_error();
+
+        deadline = std::chrono::steady_clock::now() + 5s;
+        while (fast_received < 100 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        released = true;
+
+        if (fast_received != 100) fail_test("a slow handler held up another client");
+    }
+
+    // The shared pool can handle the server's handshake before InternalConnect() has
+    // returned, which must not race with the client setting itself up
+    std::atomic<int> pooled_received = 0;
+    for (int i = 0; i < 200; ++i) {
+        bux::Client pooled({
+            .teamname = "pooled", .executor = bux::InternalExecutor::SHARED_POOL
+        });
+        pooled.AddHandler("tick", [&pooled_received] (bux::Client&, const bux::Message&) {
+            ++pooled_received;
+        });
+        if (pooled.InternalConnect(server).is_error()) fail_test("could not connect");
+
+        writers.front()->Write({ .type = "tick", .dest = "pooled" }).ignore_error();
+        deadline = std::chrono::steady_clock::now() + 5s;
+        while (pooled_received <= i && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(1ms);
+        if (pooled_received != i + 1) fail_test("a pooled client lost a message");
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
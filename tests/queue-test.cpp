@@ -0,0 +1,168 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_queue";
+    constexpr size_t HIGH_WATERMARK = 1024 * 64;
+    constexpr int MESSAGES = 2000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server({
+        .high_watermark = HIGH_WATERMARK,
+        .low_watermark = HIGH_WATERMARK / 4,
+        .overflow_policy = bux::OverflowPolicy::DROP_OLDEST
+    });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    // The slow client stops reading until it is released, so the server has to queue
+    // (and drop) everything sent to it in the meantime.
+    std::atomic<bool> released = false;
+    std::atomic<int> last_received = -1;
+
+    bux::Client slow({ .teamname = "slow" });
+    slow.AddHandler("data", [&released, &last_received] (bux::Client&, const bux::Message& m) {
+        while (!released) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        last_received = m.content["index"].get<int>();
+    });
+
+    bux::Client producer({ .teamname = "producer" });
+
+    if (slow.UnixConnect(UNIX_FILE).is_error()) fail_test("slow client could not connect");
+    if (producer.InternalConnect(server).is_error())
+        fail_test("producer could not connect");
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    std::string padding(4096, 'x');
+    for (int i = 0; i < MESSAGES; ++i) {
+        producer.Write({
+            .type = "data", .dest = "slow",
+            .content = { { "index", i }, { "padding", padding } }
+        }).if_err([&fail_test] (bux::WriteError) { fail_test("producer failed to write"); });
+    }
+
+    std::this_thread::sleep_for(500ms);
+
+    bool found = false;
+    for (const bux::QueueStats& stats : server.GetQueueStats()) {
+        if (stats.teamname != "slow") continue;
+        found = true;
+
+        fmt::print("slow client: {} frames / {} bytes queued, {} dropped\n",
+            stats.queued_frames, stats.queued_bytes, stats.dropped_messages);
+
+        if (stats.queued_bytes > HIGH_WATERMARK) fail_test("queue exceeded high watermark");
+        if (stats.dropped_messages == 0) fail_test("no messages were dropped");
+        if (!stats.congested) fail_test("slow client not marked as congested");
+    }
+    if (!found) fail_test("no queue statistics for the slow client");
+
+    // Dropping the oldest messages means the newest one still arrives
+    released = true;
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (last_received != MESSAGES - 1) {
+        if (std::chrono::steady_clock::now() > deadline)
+            fail_test("newest message was not delivered");
+        std::this_thread::sleep_for(10ms);
+    }
+
+    // The server's own messages are never dropped, so that a congested client still
+    // learns why it was sent an error
+    constexpr std::string_view NEWEST_FILE = "_unix_bux_queue_newest";
+    bux::Server newest_server({
+        .high_watermark = HIGH_WATERMARK,
+        .low_watermark = HIGH_WATERMARK / 4,
+        .overflow_policy = bux::OverflowPolicy::DROP_NEWEST
+    });
+    if (newest_server.UnixServer(NEWEST_FILE).is_error())
+        fail_test("could not start server");
+
+    // A peer that reads nothing until it looks for the error
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr { .sun_family = AF_UNIX };
+    NEWEST_FILE.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        fail_test("peer could not connect");
+    auto send_frame = [fd] (const bux::Message& m) {
+        bux::SharedFrame frame = bux::EncodedFrame::Encode(bux::MessageFormat::JSON, m);
+        return write(fd, frame->header.data(), frame->header.size()) >= 0
+            && write(fd, frame->payload.data(), frame->payload.size()) >= 0;
+    };
+    bool handshaken = send_frame({
+        .type { bux::MSG_HANDSHAKE },
+        .content = {
+            { "format", bux::MessageFormat::JSON },
+            { "teamname", "newest" },
+            { "version", bux::CURRENT_VERSION }
+        }
+    });
+    if (!handshaken) fail_test("peer could not handshake");
+
+    bux::Client newest_producer({ .teamname = "producer" });
+    if (newest_producer.InternalConnect(newest_server).is_error())
+        fail_test("producer could not connect");
+    std::this_thread::sleep_for(200ms);
+
+    for (int i = 0; i < MESSAGES; ++i) {
+        newest_producer.Write({
+            .type = "data", .dest = "newest",
+            .content = { { "index", i }, { "padding", padding } }
+        }).if_err([&fail_test] (bux::WriteError) { fail_test("producer failed to write"); });
+    }
+
+    // A client is sent at most one error a second
+    std::this_thread::sleep_for(1s);
+    if (!send_frame({ .type { bux::MSG_AVAILABLE }, .content = 5 }))
+        fail_test("peer could not write");
+
+    std::string received;
+    char buffer[64 * 1024];
+    deadline = std::chrono::steady_clock::now() + 5s;
+    while (received.find(bux::MSG_ERROR) == std::string::npos
+        && std::chrono::steady_clock::now() < deadline) {
+        pollfd readable { .fd = fd, .events = POLLIN };
+        if (poll(&readable, 1, 100) <= 0) continue;
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count <= 0) break;
+        received.append(buffer, count);
+    }
+    close(fd);
+    if (received.find(bux::MSG_ERROR) == std::string::npos)
+        fail_test("the server's error was dropped");
+
+    newest_server.Close();
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
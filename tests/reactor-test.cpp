@@ -0,0 +1,205 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_reactor";
+    constexpr uint16_t PORT = 16380;
+    constexpr int WORKERS = 8;
+    constexpr int COUNT = 500;
+    constexpr size_t BLOB_SIZE = 300 * 1024;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    auto fail_test = [] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        std::exit(1);
+    };
+
+    using namespace std::chrono_literals;
+    auto wait_for = [&] (auto condition, std::string_view what) {
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() > deadline) fail_test(what);
+            std::this_thread::sleep_for(10ms);
+        }
+    };
+
+    // Round robin spreads the workers over every reactor, so most messages between
+    // them have to cross from one reactor to another
+    bux::Server server({ .reactor_threads = 4 });
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    struct Worker
+    {
+        bux::Client client { { .teamname = "workers" } };
+        std::atomic<int> count = 0, hello = 0, jobs = 0, blob_size = 0;
+        std::atomic<bool> in_order = true, blob_intact = true;
+        std::vector<uint8_t> blob;
+    };
+
+    std::vector<uint8_t> blob(BLOB_SIZE);
+    for (size_t i = 0; i < blob.size(); ++i) blob[i] = i * 13 + (i >> 9);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < WORKERS; ++i) {
+        Worker& worker = *workers.emplace_back(std::make_unique<Worker>());
+        worker.client.AddHandler("count", [&worker] (bux::Client&,
+            const bux::Message& m) {
+            if (m.content != worker.count.load()) worker.in_order = false;
+            ++worker.count;
+        });
+        worker.client.AddHandler("hello", [&worker] (bux::Client&, const bux::Message&) {
+            ++worker.hello;
+        });
+        worker.client.AddHandler("job", [&worker] (bux::Client&, const bux::Message&) {
+            ++worker.jobs;
+        });
+        worker.client.AddChunkHandler("blob", [&worker, &blob] (bux::Client&,
+            const bux::Message&, const bux::Chunk& chunk) {
+            worker.blob.insert(worker.blob.end(), chunk.data.begin(), chunk.data.end());
+            if (!chunk.last) return;
+            if (worker.blob != blob) worker.blob_intact = false;
+            worker.blob_size = worker.blob.size();
+        });
+    }
+
+    bux::Client sender({ .teamname = "sender" });
+    bux::Client sink({ .teamname = "sink" });
+    std::atomic<int> pings = 0, sink_hello = 0, disconnects = 0;
+    sink.AddHandler("ping", [&pings] (bux::Client&, const bux::Message&) { ++pings; });
+    sink.AddHandler("hello", [&sink_hello] (bux::Client&, const bux::Message&) {
+        ++sink_hello;
+    });
+    sink.AddHandler(std::string { bux::MSG_DISCONNECT }, [&] (bux::Client&,
+        const bux::Message& m) {
+        if (m.content["who"] == "leaver") ++disconnects;
+    });
+
+    if (sender.UnixConnect(UNIX_FILE).is_error()
+        || sink.InternalConnect(server).is_error()) {
+        fail_test("clients could not connect");
+    }
+    for (auto& worker : workers) {
+        if (worker->client.UnixConnect(UNIX_FILE).is_error())
+            fail_test("worker could not connect");
+    }
+    std::this_thread::sleep_for(200ms);
+
+    if (server.GetQueueStats().size() != WORKERS + 2)
+        fail_test("wrong number of clients");
+
+    // A team spread over the reactors gets everything, in order
+    for (int i = 0; i < COUNT; ++i) {
+        if (sender.Write({ .type = "count", .dest = "workers", .content = i }).is_error())
+            fail_test("write failed");
+    }
+    wait_for([&] {
+        return std::ranges::all_of(workers, [] (auto& w) { return w->count == COUNT; });
+    }, "team messages not delivered");
+    for (auto& worker : workers) {
+        if (!worker->in_order) fail_test("team messages out of order");
+    }
+
+    bux::Message hello { .type = "hello", .dest = std::string { bux::MSG_ALL } };
+    if (sender.Write(hello).is_error()) fail_test("write failed");
+    wait_for([&] {
+        return sink_hello == 1
+            && std::ranges::all_of(workers, [] (auto& w) { return w->hello == 1; });
+    }, "$$all message not delivered");
+
+    // Into the INTERNAL client from every reactor
+    for (auto& worker : workers) {
+        if (worker->client.Write({ .type = "ping", .dest = "sink" }).is_error())
+            fail_test("write failed");
+    }
+    wait_for([&] { return pings == WORKERS; }, "messages to internal client lost");
+
+    // Availability is seen by the reactors the worker is not on
+    constexpr int CHOSEN = 5;
+    for (int i = 0; i < WORKERS; ++i) {
+        if (workers[i]->client.SetAvailable("job", i == CHOSEN).is_error())
+            fail_test("could not set availability");
+    }
+    std::this_thread::sleep_for(200ms);
+    for (int i = 0; i < 20; ++i) {
+        if (sender.Write({ .type = "job", .dest = "workers", .only_first = true })
+            .is_error()) {
+            fail_test("write failed");
+        }
+    }
+    wait_for([&] { return workers[CHOSEN]->jobs == 20; }, "only_first not delivered");
+    for (int i = 0; i < WORKERS; ++i) {
+        if (i != CHOSEN && workers[i]->jobs != 0) fail_test("unavailable worker chosen");
+    }
+
+    auto stream_id = sender.StartChunked({ .type = "blob", .dest = "workers" });
+    if (stream_id.is_error()) fail_test("could not start chunked message");
+    if (sender.WriteChunk(stream_id.get_mut_unchecked(), blob, true).is_error())
+        fail_test("could not write chunk");
+    wait_for([&] {
+        return std::ranges::all_of(workers, [] (auto& w) {
+            return w->blob_size == int(BLOB_SIZE);
+        });
+    }, "chunked message not delivered");
+    for (auto& worker : workers) {
+        if (!worker->blob_intact) fail_test("chunked message mangled");
+    }
+
+    // Seen from a reactor other than the leaver's
+    {
+        bux::Client leaver({ .teamname = "leaver" });
+        if (leaver.UnixConnect(UNIX_FILE).is_error())
+            fail_test("leaver could not connect");
+        std::this_thread::sleep_for(100ms);
+    }
+    wait_for([&] { return disconnects == 1; }, "disconnection not noticed");
+
+    // Sharded IP listeners on two ports at once, opened while the server is running
+    if (server.IPServer("127.0.0.1", PORT).is_error()
+        || server.IPServer("127.0.0.1", PORT + 1).is_error()) {
+        fail_test("could not listen on IP addresses");
+    }
+    if (server.IPServer("not an address", PORT).is_ok())
+        fail_test("listened on an invalid address");
+
+    std::atomic<int> ip_pings = 0;
+    std::vector<std::unique_ptr<bux::Client>> ip_clients;
+    for (int i = 0; i < WORKERS; ++i) {
+        auto& client = *ip_clients.emplace_back(std::make_unique<bux::Client>(
+            bux::ClientPreferences { .teamname = "ip" }));
+        client.AddHandler("ping", [&ip_pings] (bux::Client&, const bux::Message&) {
+            ++ip_pings;
+        });
+        if (client.IPConnect("localhost", PORT + i % 2).is_error())
+            fail_test("IP client could not connect");
+    }
+    std::this_thread::sleep_for(200ms);
+
+    if (sender.Write({ .type = "ping", .dest = "ip" }).is_error())
+        fail_test("write failed");
+    wait_for([&] { return ip_pings == WORKERS; }, "messages to IP clients lost");
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
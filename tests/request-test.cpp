@@ -0,0 +1,176 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_request";
+    constexpr int REQUESTS = 2000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 64 });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    bux::Client responder({ .teamname = "doubler" });
+    responder.AddHandler("double", [] (bux::Client& c, const bux::Message& m) {
+        c.Reply(m, { .type = "double", .content = m.content.get<int>() * 2 })
+            .ignore_error();
+    });
+    // Takes requests but never answers them by itself
+    bux::Client silent({ .teamname = "silent" });
+    std::atomic<uint64_t> seen_requester = 0, seen_correlation = 0;
+    silent.AddHandler("double", [&] (bux::Client&, const bux::Message& m) {
+        seen_requester = m.requester;
+        seen_correlation = m.correlation;
+    });
+
+    if (responder.UnixConnect(UNIX_FILE).is_error()
+        || silent.InternalConnect(server).is_error()) {
+        fail_test("responders could not connect");
+    }
+
+    using namespace std::chrono_literals;
+
+    // Two members of one team, over a socket and not. Replies reach the one that asked,
+    // and never the handlers of either.
+    bux::Client unix_asker({ .teamname = "asker" });
+    bux::Client internal_asker({ .teamname = "asker" });
+    bux::Client* askers[] = { &unix_asker, &internal_asker };
+    std::atomic<int> handled = 0;
+    for (bux::Client* asker : askers) {
+        asker->AddHandler("double", [&handled] (bux::Client&, const bux::Message&) {
+            ++handled;
+        });
+    }
+    if (unix_asker.UnixConnect(UNIX_FILE).is_error()
+        || internal_asker.InternalConnect(server).is_error()) {
+        fail_test("askers could not connect");
+    }
+    std::this_thread::sleep_for(100ms);
+
+    // All of them in flight at once, from both members. Their correlation ids overlap,
+    // so a reply sent to the wrong member would be taken as the wrong answer.
+    using Reply = tb::result<bux::Message, bux::RequestError>;
+    std::vector<std::future<Reply>> replies[std::size(askers)];
+    for (int i = 0; i < REQUESTS; ++i) {
+        for (size_t a = 0; a < std::size(askers); ++a) {
+            replies[a].emplace_back(askers[a]->Request({
+                .type = "double", .dest = "doubler", .content = i * int(a + 1)
+            }, 10s));
+        }
+    }
+
+    for (size_t a = 0; a < std::size(askers); ++a) {
+        for (int i = 0; i < REQUESTS; ++i) {
+            if (replies[a][i].wait_for(10s) != std::future_status::ready)
+                fail_test("no reply");
+            Reply result = replies[a][i].get();
+            if (result.is_error()) fail_test("request failed");
+            if (result.get_mut_unchecked().content != i * int(a + 1) * 2)
+                fail_test("wrong reply");
+        }
+    }
+
+    // And with a callback
+    for (bux::Client* asker : askers) {
+        std::promise<int> doubled;
+        asker->Request({ .type = "double", .dest = "doubler", .content = 21 },
+            [&doubled] (Reply result) {
+            doubled.set_value(result.is_ok()
+                ? result.get_mut_unchecked().content.get<int>() : -1);
+        });
+        auto future = doubled.get_future();
+        if (future.wait_for(10s) != std::future_status::ready || future.get() != 42)
+            fail_test("callback got no reply");
+    }
+
+    // Only requests can be replied to
+    if (responder.Reply({ .type = "double", .src = "asker" }, {}).is_ok())
+        fail_test("replied to a message that is not a request");
+
+    std::this_thread::sleep_for(100ms);
+    if (handled) fail_test("a reply went to a handler");
+
+    // Replies only come from a client the request was sent to, and only once. Anyone
+    // else's are dropped, even with the right ids.
+    bux::Client forger({ .teamname = "forger" });
+    if (forger.UnixConnect(UNIX_FILE).is_error()) fail_test("forger could not connect");
+    std::this_thread::sleep_for(100ms);
+
+    auto forged = unix_asker.Request({ .type = "double", .dest = "silent" }, 10s);
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while (!seen_correlation && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(1ms);
+    if (!seen_correlation) fail_test("request never arrived");
+
+    auto reply = [&] (uint64_t correlation, int content) -> bux::Message {
+        return {
+            .type = "double", .dest = "asker", .content = content,
+            .correlation = correlation, .reply = true, .requester = seen_requester
+        };
+    };
+    if (forger.Write(reply(seen_correlation, -1)).is_error()
+        || silent.Write(reply(seen_correlation + 1, -1)).is_error()) {
+        fail_test("could not write forged replies");
+    }
+    if (forged.wait_for(300ms) == std::future_status::ready)
+        fail_test("a forged reply was delivered");
+
+    if (silent.Write(reply(seen_correlation, 7)).is_error()) fail_test("reply failed");
+    if (forged.wait_for(10s) != std::future_status::ready)
+        fail_test("reply from the client the request went to was dropped");
+    auto answer = forged.get();
+    if (answer.is_error() || answer.get_mut_unchecked().content != 7)
+        fail_test("wrong reply");
+
+    // Unanswered requests time out
+    auto start = std::chrono::steady_clock::now();
+    auto unanswered = unix_asker.Request({ .type = "double", .dest = "silent" }, 200ms);
+    if (unanswered.wait_for(10s) != std::future_status::ready)
+        fail_test("request never timed out");
+    auto result = unanswered.get();
+    if (result.is_ok() || result.get_error().type != bux::RequestError::TIMED_OUT)
+        fail_test("request did not time out");
+    if (std::chrono::steady_clock::now() - start < 200ms)
+        fail_test("request timed out early");
+
+    // And end when the client disconnects
+    for (bux::Client* asker : askers) {
+        auto pending = asker->Request({ .type = "double", .dest = "silent" }, 60s);
+        asker->Disconnect();
+        if (pending.wait_for(10s) != std::future_status::ready)
+            fail_test("request outlived its client's connection");
+        auto result = pending.get();
+        if (result.is_ok() || result.get_error().type != bux::RequestError::DISCONNECTED)
+            fail_test("request did not end with the connection");
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
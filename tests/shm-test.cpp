@@ -0,0 +1,120 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+#ifndef __linux__
+    fmt::print("Shared memory connections need Linux - skipping test ({})\n", __FILE__);
+    return 0;
+#endif
+
+    constexpr std::string_view UNIX_FILE = "_unix_bux_shm";
+    constexpr std::string_view SHM_FILE = "_shm_bux_shm";
+    constexpr int COUNT = 2000;
+    // Enough large messages to go round the rings several times while the reader is
+    // still catching up
+    constexpr int LARGE_COUNT = 24;
+    constexpr size_t LARGE_SIZE = 200 * 1024;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    auto fail_test = [] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        std::exit(1);
+    };
+
+    bux::Server server;
+    if (server.UnixServer(UNIX_FILE).is_error() || server.ShmServer(SHM_FILE).is_error())
+        fail_test("could not start server");
+
+    bux::Client shm_a({ .teamname = "shm-a" });
+    bux::Client shm_b({ .teamname = "shm-b", .format = bux::MessageFormat::JSON });
+    bux::Client unix_c({ .teamname = "unix-c" });
+
+    std::atomic<int> a_count = 0, b_count = 0, c_count = 0, large_count = 0;
+    std::atomic<bool> in_order = true;
+    auto counter = [&in_order] (std::atomic<int>& count) {
+        return [&in_order, &count] (bux::Client&, const bux::Message& m) {
+            if (m.content != count.load()) in_order = false;
+            ++count;
+        };
+    };
+    shm_a.AddHandler("count", counter(a_count));
+    shm_b.AddHandler("count", counter(b_count));
+    unix_c.AddHandler("count", counter(c_count));
+
+    std::string large(LARGE_SIZE, 'x');
+    for (size_t i = 0; i < large.size(); ++i) large[i] = 'a' + (i * 31 + i / 977) % 26;
+    shm_b.AddHandler("large", [&] (bux::Client&, const bux::Message& m) {
+        if (m.content != large) fail_test("large message mangled");
+        ++large_count;
+    });
+
+    std::atomic<int> disconnects = 0;
+    unix_c.AddHandler(std::string { bux::MSG_DISCONNECT }, [&] (bux::Client&,
+        const bux::Message& m) {
+        if (m.content["who"] == "leaver") ++disconnects;
+    });
+
+    if (shm_a.ShmConnect(SHM_FILE).is_error() || shm_b.ShmConnect(SHM_FILE).is_error()
+        || unix_c.UnixConnect(UNIX_FILE).is_error()) {
+        fail_test("clients could not connect");
+    }
+
+    using namespace std::chrono_literals;
+    std::this_thread::sleep_for(200ms);
+
+    auto wait_for = [&] (auto condition, std::string_view what) {
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() > deadline) fail_test(what);
+            std::this_thread::sleep_for(10ms);
+        }
+    };
+
+    // Every combination of transports, both ways
+    for (int i = 0; i < COUNT; ++i) {
+        if (shm_a.Write({ .type = "count", .dest = "shm-b", .content = i }).is_error()
+            || unix_c.Write({ .type = "count", .dest = "shm-a", .content = i }).is_error()
+            || shm_b.Write({ .type = "count", .dest = "unix-c", .content = i }).is_error()) {
+            fail_test("write failed");
+        }
+    }
+    wait_for([&] { return a_count == COUNT && b_count == COUNT && c_count == COUNT; },
+        "messages not delivered");
+    if (!in_order) fail_test("messages out of order");
+
+    for (int i = 0; i < LARGE_COUNT; ++i) {
+        if (shm_a.Write({ .type = "large", .dest = "shm-b", .content = large }).is_error())
+            fail_test("large write failed");
+    }
+    wait_for([&] { return large_count == LARGE_COUNT; }, "large messages not delivered");
+
+    // The server only has the socket to tell it the client has gone
+    {
+        bux::Client leaver({ .teamname = "leaver" });
+        if (leaver.ShmConnect(SHM_FILE).is_error()) fail_test("leaver could not connect");
+        std::this_thread::sleep_for(100ms);
+    }
+    wait_for([&] { return disconnects == 1; }, "disconnection not noticed");
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}
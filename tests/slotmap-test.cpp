@@ -0,0 +1,47 @@
+#include <cassert>
+#include <cstdio>
+
+#include <string>
+
+#include <buxtehude/slotmap.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    SlotMap<std::string> map;
+
+    SlotKey next = map.NextKey();
+    auto [organ, organ_value] = map.Emplace("organ");
+    assert(organ == next);
+    auto [lute, lute_value] = map.Emplace("lute");
+    assert(*map.Get(organ) == "organ" && *map.Get(lute) == "lute");
+    assert(&organ_value == map.Get(organ) && &lute_value == map.Get(lute));
+    assert(map.Size() == 2);
+
+    // Values stay where they are as the map grows
+    for (int i = 0; i < 1000; ++i) map.Emplace(std::to_string(i));
+    assert(&organ_value == map.Get(organ));
+
+    // The slot is reused, but the old key no longer finds anything in it
+    map.Erase(organ);
+    assert(map.Get(organ) == nullptr);
+    auto [gamba, gamba_value] = map.Emplace("viola da gamba");
+    assert((gamba & 0xffffffff) == (organ & 0xffffffff) && gamba != organ);
+    assert(map.Get(organ) == nullptr && *map.Get(gamba) == "viola da gamba");
+    map.Erase(organ);
+    assert(map.Size() == 1002);
+
+    map.EraseIf([] (const std::string& value) { return value.size() > 3; });
+    assert(map.Get(gamba) == nullptr && map.Get(lute) == nullptr);
+    assert(map.Size() == 1000);
+
+    size_t count = 0;
+    map.ForEach([&count] (const std::string&) { ++count; });
+    assert(count == map.Size());
+    assert(map.Get(INVALID_SLOT_KEY) == nullptr);
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
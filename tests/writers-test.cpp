@@ -0,0 +1,94 @@
+#include <buxtehude/buxtehude.hpp>
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace bux = buxtehude;
+
+int main()
+{
+    fmt::print("Starting test ({})\n", __FILE__);
+
+    constexpr std::string_view UNIX_FILE = "_unix_writers";
+    constexpr int WRITERS = 8;
+    constexpr int MESSAGES = 2000;
+
+    bux::Initialise([] (auto level, auto msg) {
+        if (level < bux::LogLevel::WARNING) return;
+        fmt::print("(buxtehude) {}\n", msg);
+    });
+
+    bux::Server server({ .high_watermark = 1024 * 1024 * 64 });
+
+    auto fail_test = [&server] (std::string_view reason) {
+        fmt::print("Test failed: {}\n", reason);
+        server.Close();
+        std::exit(1);
+    };
+
+    if (server.UnixServer(UNIX_FILE).is_error()) fail_test("could not start server");
+
+    // Handlers of an INTERNAL client run one at a time, so no locking is needed here
+    std::vector<int> next(WRITERS, 0);
+    std::atomic<int> received = 0, out_of_order = 0;
+    bux::Client sink({ .teamname = "sink" });
+    sink.AddHandler("count", [&] (bux::Client&, const bux::Message& m) {
+        int writer = m.content["writer"].get<int>();
+        if (next[writer]++ != m.content["n"].get<int>()) ++out_of_order;
+        ++received;
+    });
+    if (sink.InternalConnect(server).is_error()) fail_test("sink could not connect");
+
+    using namespace std::chrono_literals;
+    auto wait_until = [] (auto&& done) {
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!done() && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        return done();
+    };
+
+    // Many threads write through one socket client at once, with and without a delay
+    // to batch their messages in, and nothing is lost or reordered per thread
+    for (auto delay : { 0us, 200us }) {
+        std::fill(next.begin(), next.end(), 0);
+        received = 0;
+
+        bux::Client producer({ .teamname = "producer", .write_delay = delay });
+        if (producer.UnixConnect(UNIX_FILE).is_error())
+            fail_test("producer could not connect");
+        std::this_thread::sleep_for(100ms);
+
+        std::atomic<int> failed = 0;
+        std::vector<std::thread> writers;
+        for (int writer = 0; writer < WRITERS; ++writer) {
+            writers.emplace_back([&, writer] {
+                for (int n = 0; n < MESSAGES; ++n) {
+                    if (producer.Write({ .type = "count", .dest = "sink",
+                        .content = { { "writer", writer }, { "n", n } } }).is_error()) {
+                        ++failed;
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : writers) thread.join();
+
+        if (failed) fail_test("write failed");
+        if (!wait_until([&] { return received == WRITERS * MESSAGES; }))
+            fail_test("messages were lost");
+        if (out_of_order) fail_test("one thread's messages arrived out of order");
+    }
+
+    server.Close();
+    fmt::print("Test ({}) completed successfully\n", __FILE__);
+
+    return 0;
+}